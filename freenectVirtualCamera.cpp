@@ -9,7 +9,55 @@
 //   --ir               Enable infrared (IR) streaming (8-bit grayscale).
 //   --rgb              Enable RGB video streaming.
 //   --depth            Enable depth streaming.
-//   --loopback <dev>   Specify the v4l2loopback device to use (default: /dev/video2).
+//   --loopback <dev>[:<f>[,<f>...]]  Specify a v4l2loopback device to use (default: /dev/video2),
+//                      optionally with its own pixel format(s). Repeat to feed several devices.
+//                      Given several formats, the cheapest to produce is used (see planFormats()).
+//   --fps <n>          Pace output to a constant <n> frames per second (e.g. 30 or 15).
+//   --io <write|mmap>  Loopback I/O method: write() or V4L2 mmap streaming (default: write).
+//   --io-uring         Submit the writes of loopback and file sinks for each frame in one io_uring batch.
+//   --denoise <1-3>    Enable motion-adaptive temporal denoising of the video stream.
+//   --denoise-depth-mask  Use depth changes to mark motion for the denoiser (needs --depth).
+//   --threads <n>      Number of worker threads for frame processing (default: all cores).
+//   --output-size <WxH>  Scale output frames to WxH (default: 640x480).
+//   --pixel-format <f>[,<f>...]  Output pixel format(s): grey, rgb24, bgr24, yuyv, uyvy, abgr32 or bgr32.
+//   --depth-alpha      Output RGB with registered depth in the alpha channel (abgr32/bgr32).
+//   --depth-alpha-range <near>:<far>  Depth range in mm mapped to alpha 255..1 (default: 500:4000).
+//   --mirror           Mirror frames horizontally.
+//   --composite <l>    Render video and depth into one frame: sbs, tb or pip.
+//   --sink <spec>      Add a sink to the main stream: a loopback device, shm:<name> (a
+//                      shared-memory ring, see kinect_shm.h), unix:<path> (memfd frame
+//                      server, see kinect_memfd.h), file:<path> (file or FIFO) or - (stdout),
+//                      with optional :<f>[,<f>...].
+//   --record <dir>     Record the raw RGB, IR and depth streams to <dir> (see kinect_rec.h).
+//   --mcap <file>      Record the raw streams as ROS 2 sensor_msgs/Image messages to an MCAP file.
+//   --mcap-compression <none|zstd[:<level>]>  MCAP chunk compression (default: zstd:1 when built
+//                      with libzstd, otherwise none).
+//   --tcp-server [<addr>:]<port>  Stream the raw capture streams to TCP clients (default address
+//                      127.0.0.1; see kinect_tcp.h), depth compressed losslessly with RVL.
+//   --tcp-video <raw|jpeg[:<q>]>  How RGB and IR frames are sent to TCP clients (default: raw).
+//   --tcp-workers <n>  Encoder threads of the TCP server (default: 2).
+//   --http-preview [<addr>:]<port>  Serve MJPEG previews of the streams over HTTP (default address
+//                      127.0.0.1).
+//   --preview-fps <n>  Preview frames per second and stream (default: 5).
+//   --preview-size <WxH>  Size of the preview frames (default: 320x240).
+//   --on-demand        Only convert frames for sinks with readers; stop capture while there are none.
+//   --frame-headers    Precede each frame of file:, FIFO and stdout sinks with a header
+//                      (see kinect_raw.h).
+//   --alternate-ir <dev>[:<f>]  With --rgb, alternate RGB and IR capture; IR frames go to <dev>
+//                      (may be repeated).
+//   --alternate-dwell <ms>  Time each mode is held when alternating (default: 1000).
+//   --auto-ir          With --rgb, switch to IR in the dark and back when light returns.
+//   --autoframe        Pan and zoom the video stream to follow the nearest person (uses depth).
+//   --video-filter <list>  Neighbourhood filters for the video stream, e.g. "median,blur:2".
+//   --depth-filter <list>  Neighbourhood filters for the depth stream, e.g. "median,bilateral:2".
+//   --gamma <g>        Apply a gamma curve to the output (default: 1.0).
+//   --saturation <s>   Scale RGB colour saturation (default: 1.0).
+//   --synthetic        Use generated test frames instead of a Kinect.
+//   --replay <dir>     Play a --record recording instead of using a Kinect.
+//   --replay-mode <m>  Replay pacing: realtime, fast or step (default: realtime).
+//   --replay-loop      Restart the replay at the end instead of exiting.
+//   --synthetic-fps <n>  Frame rate of the synthetic source (default: 30, 0 = unthrottled).
+//   --synthetic-disconnect <s>  Simulate a disconnect <s> seconds after each (re)connect.
 //   --help             Display this help message.
 //
 // Notes:
@@ -19,20 +67,66 @@
 
 #include <iostream>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <thread>
 #include <chrono>
 #include <vector>
 #include <cstring>
 #include <string>
+#include <cstdlib>
+#include <memory>
+#include <functional>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <deque>
+#include <csignal>
 
 #include <libfreenect.h>
 
+#include "kinect_rec.h"
+
+#ifdef HAVE_JPEG
+  #include <csetjmp>
+  #include <jpeglib.h>
+#endif
+#ifdef HAVE_ZSTD
+  #include <zstd.h>
+#endif
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+  #include <tmmintrin.h>
+#endif
+
 #ifdef __linux__
   #include <fcntl.h>
   #include <unistd.h>
+  #include <poll.h>
+  #include <signal.h>
   #include <sys/ioctl.h>
+  #include <sys/mman.h>
+  #include <sys/timerfd.h>
   #include <linux/videodev2.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+  #include "kinect_shm.h"
+  #include <sys/stat.h>
+  #include <sys/uio.h>
+  #include <sys/file.h>
+  #include "kinect_memfd.h"
+  #include "kinect_raw.h"
+  #include <sys/eventfd.h>
+  #include <sys/syscall.h>
+  #include <linux/io_uring.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <arpa/inet.h>
+  #include "kinect_tcp.h"
 #elif defined(__APPLE__)
   // Include macOS headers for virtual device creation (e.g. AVFoundation)
 #elif defined(_WIN32)
@@ -43,62 +137,420 @@
 constexpr int WIDTH  = 640;
 constexpr int HEIGHT = 480;
 
+// Pixel formats that frames can be converted to before they reach a sink.
+enum PixelFormat {
+    PIXFMT_GREY,   // 8-bit luma.
+    PIXFMT_RGB24,  // R, G, B.
+    PIXFMT_BGR24,  // B, G, R.
+    PIXFMT_YUYV,   // Packed 4:2:2, Y0 U Y1 V (BT.601 limited range).
+    PIXFMT_UYVY,   // Packed 4:2:2, U Y0 V Y1 (BT.601 limited range).
+    PIXFMT_ABGR32, // B, G, R, A.
+    PIXFMT_BGR32   // B, G, R, X (X carries the same byte as ABGR32's alpha).
+};
+
+const char* pixelFormatName(PixelFormat fmt) {
+    switch (fmt) {
+    case PIXFMT_GREY:  return "grey";
+    case PIXFMT_RGB24: return "rgb24";
+    case PIXFMT_BGR24: return "bgr24";
+    case PIXFMT_YUYV:  return "yuyv";
+    case PIXFMT_UYVY:  return "uyvy";
+    case PIXFMT_ABGR32: return "abgr32";
+    case PIXFMT_BGR32:  return "bgr32";
+    }
+    return "unknown";
+}
+
+bool parsePixelFormat(const std::string& name, PixelFormat& fmt) {
+    static const PixelFormat kAll[] = { PIXFMT_GREY, PIXFMT_RGB24, PIXFMT_BGR24, PIXFMT_YUYV, PIXFMT_UYVY,
+                                        PIXFMT_ABGR32, PIXFMT_BGR32 };
+    for (PixelFormat f : kAll) {
+        if (name == pixelFormatName(f)) {
+            fmt = f;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parse a comma-separated list of formats, e.g. "uyvy,yuyv".
+bool parsePixelFormatList(const std::string& list, std::vector<PixelFormat>& formats) {
+    std::vector<PixelFormat> parsed;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+        PixelFormat fmt;
+        if (!parsePixelFormat(list.substr(start, end - start), fmt))
+            return false;
+        if (std::find(parsed.begin(), parsed.end(), fmt) == parsed.end())
+            parsed.push_back(fmt);
+        start = end + 1;
+    }
+    formats = parsed;
+    return true;
+}
+
+int pixelFormatBytesPerPixel(PixelFormat fmt) {
+    switch (fmt) {
+    case PIXFMT_GREY:  return 1;
+    case PIXFMT_RGB24:
+    case PIXFMT_BGR24: return 3;
+    case PIXFMT_YUYV:
+    case PIXFMT_UYVY:  return 2;
+    case PIXFMT_ABGR32:
+    case PIXFMT_BGR32: return 4;
+    }
+    return 0;
+}
+
+// Four-character code of a format, as used by V4L2 and the shared-memory rings.
+uint32_t pixelFormatFourcc(PixelFormat fmt) {
+    auto fourcc = [](char a, char b, char c, char d) {
+        return static_cast<uint32_t>(a) | (static_cast<uint32_t>(b) << 8) |
+               (static_cast<uint32_t>(c) << 16) | (static_cast<uint32_t>(d) << 24);
+    };
+    switch (fmt) {
+    case PIXFMT_GREY:  return fourcc('G', 'R', 'E', 'Y');
+    case PIXFMT_RGB24: return fourcc('R', 'G', 'B', '3');
+    case PIXFMT_BGR24: return fourcc('B', 'G', 'R', '3');
+    case PIXFMT_YUYV:  return fourcc('Y', 'U', 'Y', 'V');
+    case PIXFMT_UYVY:  return fourcc('U', 'Y', 'V', 'Y');
+    case PIXFMT_ABGR32: return fourcc('A', 'R', '2', '4');
+    case PIXFMT_BGR32:  return fourcc('B', 'G', 'R', '4');
+    }
+    return 0;
+}
+
+// Layouts for rendering video and depth into a single sink frame.
+enum CompositeLayout {
+    COMPOSITE_NONE,
+    COMPOSITE_SIDE_BY_SIDE,  // Video left, depth right.
+    COMPOSITE_TOP_BOTTOM,    // Video top, depth bottom.
+    COMPOSITE_PIP            // Video full frame, depth inset bottom-right.
+};
+
+bool parseCompositeLayout(const std::string& name, CompositeLayout& layout) {
+    if (name == "sbs")      layout = COMPOSITE_SIDE_BY_SIDE;
+    else if (name == "tb")  layout = COMPOSITE_TOP_BOTTOM;
+    else if (name == "pip") layout = COMPOSITE_PIP;
+    else return false;
+    return true;
+}
+
 // Global mode flags (set via command-line arguments).
 bool enable_ir    = false;
 bool enable_rgb   = false;
 bool enable_depth = false;
 
-// Number of video channels: 1 for IR, 3 for RGB.
+// Render video and depth into one frame (--composite).
+CompositeLayout composite_layout = COMPOSITE_NONE;
+
+// Pack registered depth into the alpha channel of 32-bit RGB output (--depth-alpha),
+// mapping the given range in millimetres to 255 (near) .. 1 (far).
+bool enable_depth_alpha = false;
+int depth_alpha_near_mm = 500;
+int depth_alpha_far_mm  = 4000;
+
+// Switch between RGB and IR automatically depending on ambient light (--auto-ir).
+bool enable_auto_ir = false;
+
+// Crop and zoom the video stream onto the nearest person using depth (--autoframe).
+bool enable_autoframe = false;
+
+// Depth is captured when it is streamed or needed by auto-framing.
+bool capture_depth = false;
+
+// Bytes per video pixel: 1 for IR, 2 for raw YUV, 3 for RGB.
 int videoChannels = 0;
 
-// Virtual loopback device (default: /dev/video2). Can be set via --loopback.
-std::string loopback_device = "/dev/video2";
+// Sinks of the main stream (default: /dev/video2). Set via --loopback or --sink,
+// which may be repeated to feed the same stream to several sinks.
+std::vector<std::string> video_sink_specs;
+
+// Alternating IR/RGB mode (--alternate-ir): the sinks IR frames go to (empty =
+// off), their default pixel format, and how long each mode is held before switching.
+std::vector<std::string> ir_sink_specs;
+PixelFormat ir_output_format = PIXFMT_GREY;
+int alternate_dwell_ms = 1000;
+
+// Constant output rate in frames per second (0 = forward frames as they arrive).
+int output_fps = 0;
+
+// Temporal denoising strength for the video stream (0 = off), and whether depth
+// changes should mark motion for it.
+int denoise_strength = 0;
+bool denoise_depth_mask = false;
 
-// Global file descriptor for the loopback device (Linux only).
+// Worker threads for frame processing (0 = one per hardware thread).
+unsigned worker_threads = 0;
+
+// Output geometry, pixel format and per-pixel processing applied before frames
+// reach the virtual device. The format defaults to GREY for IR/depth and RGB24
+// for RGB unless --pixel-format is given; given a list, each sink without a
+// format of its own gets the cheapest of them (see planFormats()).
+int output_width  = WIDTH;
+int output_height = HEIGHT;
+bool output_size_set = false;
+PixelFormat output_format = PIXFMT_GREY;
+std::vector<PixelFormat> output_formats;  // Every format --pixel-format lists; the first is output_format.
+bool output_format_set = false;
+bool output_mirror = false;
+double output_gamma = 1.0;
+double output_saturation = 1.0;
+
+// Neighbourhood filter specifications for each stream (empty = none).
+std::string video_filter_spec;
+std::string depth_filter_spec;
+
+// How frames are handed to the virtual device: write() per frame, or V4L2
+// streaming I/O with mmap'ed buffers.
+enum DeviceIO {
+    DEVICE_IO_WRITE,
+    DEVICE_IO_MMAP
+};
+
+// Metadata captured with each frame.
+struct FrameInfo {
+    uint32_t kinect_timestamp = 0;  // Timestamp reported by libfreenect.
+    uint64_t capture_ns = 0;        // Arrival time on the monotonic clock.
+    uint64_t sequence = 0;          // Frame counter of the stream.
+};
+
+// Nanoseconds on the monotonic clock (CLOCK_MONOTONIC on Linux).
+inline uint64_t monotonicNanos() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// A virtual video device and the format it was configured with.
+struct VirtualDevice {
+    std::string path;
+    PixelFormat format = PIXFMT_GREY;
+    int width  = WIDTH;
+    int height = HEIGHT;
+    DeviceIO io = DEVICE_IO_WRITE;
 #ifdef __linux__
-static int g_loopback_fd = -1;
+    int fd = -1;  // Loopback file descriptor (Linux only).
+
+    // Streaming I/O state (io == DEVICE_IO_MMAP).
+    struct MappedBuffer {
+        void* start;
+        size_t length;
+        bool queued;
+        bool held;  // Being rendered into in place (LoopbackSink::mapBuffer()).
+    };
+    std::vector<MappedBuffer> buffers;
+    bool stream_on = false;
+
+    // Capture clients streaming from the device, as reported by v4l2loopback
+    // (-1 = unknown).
+    int readers = -1;
+#endif
+};
+
+// Requested I/O method for the virtual devices (--io).
+DeviceIO device_io = DEVICE_IO_WRITE;
+
+// Batch the writes of sinks that take a frame in one write() into a single
+// io_uring submission per frame set (--io-uring).
+bool use_io_uring = false;
+
+// Only convert and write frames for sinks that have readers, and stop the
+// capture streams while no sink has any (--on-demand).
+bool on_demand_streaming = false;
+
+// Prefix frames written to file, FIFO and stdout sinks with a kraw_frame_header.
+bool frame_headers = false;
+
+// Directory the raw capture streams are recorded to (--record; empty = off).
+std::string record_dir;
+
+// MCAP file the raw capture streams are recorded to (--mcap; empty = off), and how
+// its chunks are compressed (--mcap-compression).
+enum McapCompression {
+    MCAP_COMPRESSION_NONE,
+    MCAP_COMPRESSION_ZSTD
+};
+std::string mcap_path;
+#ifdef HAVE_ZSTD
+McapCompression mcap_compression = MCAP_COMPRESSION_ZSTD;
+#else
+McapCompression mcap_compression = MCAP_COMPRESSION_NONE;
 #endif
+int mcap_zstd_level = 1;
+
+// TCP streaming server (--tcp-server; port 0 = off): address it listens on, how
+// RGB and IR frames are encoded (--tcp-video), and the encoder threads.
+enum TcpVideoEncoding {
+    TCP_VIDEO_RAW,
+    TCP_VIDEO_JPEG
+};
+std::string tcp_address = "127.0.0.1";
+int tcp_port = 0;
+TcpVideoEncoding tcp_video = TCP_VIDEO_RAW;
+int tcp_jpeg_quality = 85;
+unsigned tcp_workers = 2;
+
+// HTTP MJPEG preview (--http-preview; port 0 = off): address it listens on, and
+// the rate and size of the preview frames.
+std::string preview_address = "127.0.0.1";
+int preview_port = 0;
+int preview_fps = 5;
+int preview_width = 320;
+int preview_height = 240;
+
+// Split "[<address>:]<port>", leaving address unchanged when none is given.
+bool parseListenAddress(const std::string& value, std::string& address, int& port) {
+    size_t colon = value.rfind(':');
+    std::string host = colon == std::string::npos ? address : value.substr(0, colon);
+    int n = std::atoi(value.c_str() + (colon == std::string::npos ? 0 : colon + 1));
+    if (n < 1 || n > 65535 || host.empty())
+        return false;
+    address = host == "localhost" ? "127.0.0.1" : host;
+    port = n;
+    return true;
+}
+
+// How a recording is played back (--replay-mode).
+enum ReplayMode {
+    REPLAY_REALTIME,  // With the recorded frame timing.
+    REPLAY_FAST,      // As fast as the pipeline consumes frames.
+    REPLAY_STEP       // One frame per line read from stdin.
+};
+
+// Recording played back instead of a Kinect (--replay; empty = off), its pacing
+// and whether it restarts at the end (--replay-loop).
+std::string replay_dir;
+ReplayMode replay_mode = REPLAY_REALTIME;
+bool replay_loop = false;
+
+// Generated frames instead of a Kinect (--synthetic): frame rate (0 = as fast as
+// possible) and simulated disconnect interval in seconds (0 = never).
+bool use_synthetic = false;
+int synthetic_fps = 30;
+int synthetic_disconnect_s = 0;
+
+// Set by SIGINT/SIGTERM to stop capture and finish recordings cleanly.
+volatile std::sig_atomic_t stop_requested = 0;
+
+void requestStop(int sig) {
+    stop_requested = 1;
+    // A second signal terminates immediately, e.g. if a sink is stuck.
+    std::signal(sig, SIG_DFL);
+}
 
 // Global buffers and synchronization for video frames.
 std::mutex videoMutex;
 std::atomic<bool> newVideoFrame(false);
 std::vector<uint8_t> videoBuffer;  // Expected size: WIDTH * HEIGHT * videoChannels
+FrameInfo videoInfo;
 
 // Global buffers and synchronization for depth frames.
 std::mutex depthMutex;
 std::atomic<bool> newDepthFrame(false);
 std::vector<uint16_t> depthBuffer; // Expected size: WIDTH * HEIGHT
+FrameInfo depthInfo;
 
 // --- Callback Functions ---
 
 // Video callback (for IR or RGB).
-void VideoCallback(freenect_device* /*dev*/, void* video, uint32_t /*timestamp*/) {
+void VideoCallback(freenect_device* /*dev*/, void* video, uint32_t timestamp) {
     std::lock_guard<std::mutex> lock(videoMutex);
     size_t frameSize = WIDTH * HEIGHT * videoChannels;
     if (videoBuffer.size() != frameSize)
         videoBuffer.resize(frameSize);
     std::memcpy(videoBuffer.data(), video, frameSize);
+    videoInfo.kinect_timestamp = timestamp;
+    videoInfo.capture_ns = monotonicNanos();
+    videoInfo.sequence++;
     newVideoFrame = true;
 }
 
 // Depth callback.
-void DepthCallback(freenect_device* /*dev*/, void* depth, uint32_t /*timestamp*/) {
+void DepthCallback(freenect_device* /*dev*/, void* depth, uint32_t timestamp) {
     std::lock_guard<std::mutex> lock(depthMutex);
     size_t frameSize = WIDTH * HEIGHT;
     if (depthBuffer.size() != frameSize)
         depthBuffer.resize(frameSize);
     std::memcpy(depthBuffer.data(), depth, frameSize * sizeof(uint16_t));
+    depthInfo.kinect_timestamp = timestamp;
+    depthInfo.capture_ns = monotonicNanos();
+    depthInfo.sequence++;
     newDepthFrame = true;
 }
 
 // --- Utility Function: Print Usage ---
 void PrintUsage(const char* progName) {
-    std::cout << "Usage: " << progName << " [--ir | --rgb] [--depth] [--loopback <dev>] [--help]\n"
+    std::cout << "Usage: " << progName << " [--ir | --rgb] [--depth] [--loopback <dev>[:<f>,...]]... [--sink <spec>]... [--on-demand] [--frame-headers] [--fps <n>] [--io <m>] [--io-uring] [--denoise <1-3>] [--threads <n>]\n"
+              << "       [--output-size <WxH>] [--pixel-format <f>,...] [--mirror] [--composite <l>] [--autoframe] [--auto-ir] [--alternate-ir <dev>] [--depth-alpha] [--gamma <g>] [--saturation <s>]\n"
+              << "       [--video-filter <list>] [--depth-filter <list>] [--record <dir>] [--mcap <file> [--mcap-compression <c>]]\n"
+              << "       [--tcp-server [<addr>:]<port>] [--tcp-video <e>]\n"
+              << "       [--http-preview [<addr>:]<port> [--preview-fps <n>] [--preview-size <WxH>]] [--synthetic [--synthetic-fps <n>]] [--replay <dir>] [--help]\n"
               << "Options:\n"
               << "  --ir               Enable infrared (IR) streaming (8-bit grayscale).\n"
               << "  --rgb              Enable RGB video streaming.\n"
               << "  --depth            Enable depth streaming.\n"
-              << "  --loopback <dev>   Specify the v4l2loopback device to use (default: /dev/video2).\n"
+              << "  --loopback <dev>[:<f>[,<f>...]]  Specify a v4l2loopback device to use (default: /dev/video2),\n"
+              << "                     optionally with its own pixel format(s). Repeat to feed several devices.\n"
+              << "                     Given several formats, the one cheapest to produce is used.\n"
+              << "  --fps <n>          Pace output to a constant <n> frames per second (e.g. 30 or 15).\n"
+              << "  --io <write|mmap>  Loopback I/O method: write() or V4L2 mmap streaming (default: write).\n"
+              << "  --io-uring         Submit the writes of loopback (write I/O) and file sinks for each frame\n"
+              << "                     as one io_uring batch; falls back to write() where unavailable.\n"
+              << "  --denoise <1-3>    Enable motion-adaptive temporal denoising of the video stream.\n"
+              << "  --denoise-depth-mask  Use depth changes to mark motion for the denoiser (needs --depth).\n"
+              << "  --threads <n>      Number of worker threads for frame processing (default: all cores).\n"
+              << "  --output-size <WxH>  Scale output frames to WxH (default: 640x480).\n"
+              << "  --pixel-format <f>[,<f>...]  Output pixel format(s): grey, rgb24, bgr24, yuyv, uyvy, abgr32\n"
+              << "                     or bgr32; the default for sinks without their own.\n"
+              << "  --depth-alpha      Output RGB with registered depth in the alpha channel (abgr32/bgr32).\n"
+              << "  --depth-alpha-range <near>:<far>  Depth range in mm mapped to alpha 255..1 (default: 500:4000).\n"
+              << "  --mirror           Mirror frames horizontally.\n"
+              << "  --composite <l>    Render video and depth into one frame: sbs (side-by-side),\n"
+              << "                     tb (top-bottom) or pip (depth inset).\n"
+              << "  --sink <spec>      Add a sink to the main stream: a loopback device, shm:<name> (a\n"
+              << "                     shared-memory ring, see kinect_shm.h), unix:<path> (memfd frame\n"
+              << "                     server, see kinect_memfd.h), file:<path> (file or FIFO) or - (stdout),\n"
+              << "                     with optional :<f>[,<f>...].\n"
+              << "  --record <dir>     Record the raw RGB, IR and depth streams to <dir> (see kinect_rec.h).\n"
+              << "                     Without --loopback or --sink, frames are only recorded.\n"
+              << "  --mcap <file>      Record the raw streams to an MCAP file as ROS 2 sensor_msgs/msg/Image\n"
+              << "                     messages, readable by Foxglove and ros2 bag.\n"
+              << "  --mcap-compression <none|zstd[:<level>]>  Compression of the MCAP chunks (default: zstd\n"
+              << "                     level 1 when built with libzstd, otherwise none).\n"
+              << "  --tcp-server [<addr>:]<port>  Stream the raw capture streams to TCP clients (address default:\n"
+              << "                     127.0.0.1; see kinect_tcp.h). Depth is compressed losslessly with RVL.\n"
+              << "  --tcp-video <raw|jpeg[:<q>]>  Send RGB and IR frames raw or as JPEG of quality <q>\n"
+              << "                     (default: raw; JPEG quality 85).\n"
+              << "  --tcp-workers <n>  Encoder threads of the TCP server (default: 2).\n"
+              << "  --http-preview [<addr>:]<port>  Serve MJPEG previews of the streams at http://<addr>:<port>/\n"
+              << "                     (address default: 127.0.0.1).\n"
+              << "  --preview-fps <n>  Preview frames per second and stream (default: 5).\n"
+              << "  --preview-size <WxH>  Size of the preview frames (default: 320x240).\n"
+              << "  --on-demand        Only convert and write frames for sinks that have readers, and stop\n"
+              << "                     the Kinect streams while no sink has any.\n"
+              << "  --frame-headers    Precede each frame of file:, FIFO and stdout sinks with a header\n"
+              << "                     (see kinect_raw.h).\n"
+              << "  --alternate-ir <dev>  With --rgb, alternate RGB and IR capture (experimental); IR frames\n"
+              << "                     go to <dev>, RGB frames to --loopback. May be repeated.\n"
+              << "  --alternate-dwell <ms>  Time each mode is held when alternating (default: 1000).\n"
+              << "  --auto-ir          With --rgb, switch to IR in the dark and back when light returns.\n"
+              << "  --autoframe        Pan and zoom the video stream to follow the nearest person (uses depth).\n"
+              << "  --video-filter <list>  Neighbourhood filters for the video stream, e.g. \"median,blur:2\".\n"
+              << "  --depth-filter <list>  Neighbourhood filters for the depth stream, e.g. \"median,bilateral:2\".\n"
+              << "                     Filters: median, blur[:radius], bilateral[:radius[:sigma_space[:sigma_range]]],\n"
+              << "                     undistort[:k1[:k2]] (|k1|, |k2| <= 1). Depth filters skip pixels without a reading.\n"
+              << "  --gamma <g>        Apply a gamma curve to the output (default: 1.0).\n"
+              << "  --saturation <s>   Scale RGB colour saturation (default: 1.0).\n"
+              << "  --synthetic        Use generated test frames instead of a Kinect.\n"
+              << "  --replay <dir>     Play a --record recording instead of using a Kinect.\n"
+              << "  --replay-mode <m>  Replay pacing: realtime, fast (as fast as possible) or step (one frame\n"
+              << "                     per Enter on stdin). Default: realtime.\n"
+              << "  --replay-loop      Restart the replay at the end instead of exiting.\n"
+              << "  --synthetic-fps <n>  Frame rate of the synthetic source (default: 30, 0 = unthrottled).\n"
+              << "  --synthetic-disconnect <s>  Simulate a disconnect <s> seconds after each (re)connect.\n"
               << "  --help             Display this help message.\n"
               << "\nNotes:\n"
               << "  You can enable either --ir or --rgb for the video stream (not both simultaneously).\n"
@@ -108,48 +560,172 @@ void PrintUsage(const char* progName) {
 
 // --- Platform-specific Virtual Device Functions ---
 #ifdef __linux__
-bool initVirtualDevice() {
-    g_loopback_fd = open(loopback_device.c_str(), O_WRONLY);
-    if (g_loopback_fd < 0) {
-        perror(("Opening v4l2loopback device (" + loopback_device + ")").c_str());
+bool initVirtualDeviceStreaming(VirtualDevice& dev);
+
+bool initVirtualDevice(VirtualDevice& dev) {
+    // Non-blocking, so a stuck device makes writes fail with EAGAIN instead of
+    // hanging the sink's writer thread.
+    dev.fd = open(dev.path.c_str(), O_WRONLY | O_NONBLOCK);
+    if (dev.fd < 0) {
+        perror(("Opening v4l2loopback device (" + dev.path + ")").c_str());
         return false;
     }
 
     struct v4l2_format fmt;
     std::memset(&fmt, 0, sizeof(fmt));
     fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    fmt.fmt.pix.width = WIDTH;
-    fmt.fmt.pix.height = HEIGHT;
+    fmt.fmt.pix.width = dev.width;
+    fmt.fmt.pix.height = dev.height;
     fmt.fmt.pix.field = V4L2_FIELD_NONE;
-    if (enable_ir || (!enable_rgb && enable_depth)) {
-        // IR and depth are 8-bit grayscale.
-        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_GREY;
-    } else if (enable_rgb) {
-        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB24;
-    } else {
-        // Default fallback.
-        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_GREY;
+    switch (dev.format) {
+    case PIXFMT_GREY:  fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_GREY;  break;
+    case PIXFMT_RGB24: fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB24; break;
+    case PIXFMT_BGR24: fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_BGR24; break;
+    case PIXFMT_YUYV:  fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;  break;
+    case PIXFMT_UYVY:  fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_UYVY;  break;
+    case PIXFMT_ABGR32: fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_ABGR32; break;
+    case PIXFMT_BGR32:  fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_BGR32;  break;
     }
-    if (ioctl(g_loopback_fd, VIDIOC_S_FMT, &fmt) < 0) {
-        perror(("Setting format on v4l2loopback device (" + loopback_device + ")").c_str());
-        close(g_loopback_fd);
-        g_loopback_fd = -1;
+    fmt.fmt.pix.bytesperline = dev.width * pixelFormatBytesPerPixel(dev.format);
+    fmt.fmt.pix.sizeimage = fmt.fmt.pix.bytesperline * dev.height;
+    if (ioctl(dev.fd, VIDIOC_S_FMT, &fmt) < 0) {
+        perror(("Setting format on v4l2loopback device (" + dev.path + ")").c_str());
+        close(dev.fd);
+        dev.fd = -1;
         return false;
     }
-    std::cout << "v4l2loopback device configured: " 
+    std::cout << "v4l2loopback device " << dev.path << " configured: " 
               << fmt.fmt.pix.width << "x" << fmt.fmt.pix.height 
               << " Pixel Format: " << fmt.fmt.pix.pixelformat << std::endl;
+    if (dev.io == DEVICE_IO_MMAP && !initVirtualDeviceStreaming(dev)) {
+        std::cerr << "Streaming I/O unavailable on " << dev.path << "; falling back to write()." << std::endl;
+        dev.io = DEVICE_IO_WRITE;
+    }
     return true;
 }
 
-bool sendFrameToVirtualDevice(const uint8_t *frame, size_t size) {
-    if (g_loopback_fd < 0) {
-        std::cerr << "Loopback device not initialized." << std::endl;
+// Release the mmap'ed buffers of a device using streaming I/O.
+void releaseVirtualDeviceBuffers(VirtualDevice& dev) {
+    if (dev.stream_on) {
+        int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        ioctl(dev.fd, VIDIOC_STREAMOFF, &type);
+        dev.stream_on = false;
+    }
+    for (const auto& b : dev.buffers)
+        munmap(b.start, b.length);
+    dev.buffers.clear();
+    struct v4l2_requestbuffers req;
+    std::memset(&req, 0, sizeof(req));
+    req.count = 0;
+    req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    req.memory = V4L2_MEMORY_MMAP;
+    ioctl(dev.fd, VIDIOC_REQBUFS, &req);
+}
+
+// Request and map output buffers for V4L2 streaming I/O.
+bool initVirtualDeviceStreaming(VirtualDevice& dev) {
+    struct v4l2_requestbuffers req;
+    std::memset(&req, 0, sizeof(req));
+    req.count = 4;
+    req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (ioctl(dev.fd, VIDIOC_REQBUFS, &req) < 0 || req.count < 2) {
+        perror(("Requesting buffers on v4l2loopback device (" + dev.path + ")").c_str());
+        return false;
+    }
+    for (unsigned i = 0; i < req.count; i++) {
+        struct v4l2_buffer buf;
+        std::memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (ioctl(dev.fd, VIDIOC_QUERYBUF, &buf) < 0) {
+            perror(("Querying buffer on v4l2loopback device (" + dev.path + ")").c_str());
+            releaseVirtualDeviceBuffers(dev);
+            return false;
+        }
+        void* start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, dev.fd, buf.m.offset);
+        if (start == MAP_FAILED) {
+            perror(("Mapping buffer of v4l2loopback device (" + dev.path + ")").c_str());
+            releaseVirtualDeviceBuffers(dev);
+            return false;
+        }
+        VirtualDevice::MappedBuffer mapped = { start, buf.length, false, false };
+        dev.buffers.push_back(mapped);
+    }
+    std::cout << "v4l2loopback device " << dev.path << " using streaming I/O with "
+              << dev.buffers.size() << " mmap buffers." << std::endl;
+    return true;
+}
+
+// Get a mapped buffer to render the next frame into, or null if none is free.
+// Reclaims the oldest queued buffer when all are in use; held buffers are skipped.
+uint8_t* acquireVirtualDeviceBuffer(VirtualDevice& dev, size_t size, int& index) {
+    index = -1;
+    for (size_t i = 0; i < dev.buffers.size(); i++) {
+        if (!dev.buffers[i].queued && !dev.buffers[i].held) {
+            index = static_cast<int>(i);
+            break;
+        }
+    }
+    if (index < 0) {
+        struct v4l2_buffer buf;
+        std::memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (ioctl(dev.fd, VIDIOC_DQBUF, &buf) < 0) {
+            if (errno == EAGAIN)
+                std::cerr << "No free buffer on " << dev.path << "; consumers are not keeping up." << std::endl;
+            else
+                perror(("Dequeuing buffer from v4l2loopback device (" + dev.path + ")").c_str());
+            return nullptr;
+        }
+        index = static_cast<int>(buf.index);
+        dev.buffers[index].queued = false;
+    }
+    if (dev.buffers[index].length < size) {
+        std::cerr << "Mapped buffer of " << dev.path << " is too small for the frame." << std::endl;
+        return nullptr;
+    }
+    return static_cast<uint8_t*>(dev.buffers[index].start);
+}
+
+// Queue a filled buffer for consumers, stamped with the frame's capture time.
+bool queueVirtualDeviceBuffer(VirtualDevice& dev, int index, size_t size, uint64_t capture_ns) {
+    struct v4l2_buffer buf;
+    std::memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    buf.bytesused = size;
+    buf.field = V4L2_FIELD_NONE;
+    buf.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    buf.timestamp.tv_sec  = static_cast<time_t>(capture_ns / 1000000000ull);
+    buf.timestamp.tv_usec = static_cast<suseconds_t>((capture_ns % 1000000000ull) / 1000);
+    if (ioctl(dev.fd, VIDIOC_QBUF, &buf) < 0) {
+        perror(("Queuing buffer on v4l2loopback device (" + dev.path + ")").c_str());
         return false;
     }
-    ssize_t written = write(g_loopback_fd, frame, size);
+    dev.buffers[index].queued = true;
+    if (!dev.stream_on) {
+        int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        if (ioctl(dev.fd, VIDIOC_STREAMON, &type) < 0) {
+            perror(("Starting stream on v4l2loopback device (" + dev.path + ")").c_str());
+            return false;
+        }
+        dev.stream_on = true;
+    }
+    return true;
+}
+
+// Check the result of writing a frame of `size` bytes with write() (errno set on
+// failure), reporting errors.
+bool virtualDeviceWriteDone(VirtualDevice& dev, ssize_t written, size_t size) {
     if (written < 0) {
-        perror(("Writing to v4l2loopback device (" + loopback_device + ")").c_str());
+        if (errno == EAGAIN)
+            std::cerr << "v4l2loopback device " << dev.path << " is not accepting frames." << std::endl;
+        else
+            perror(("Writing to v4l2loopback device (" + dev.path + ")").c_str());
         return false;
     }
     if (static_cast<size_t>(written) != size) {
@@ -158,188 +734,8269 @@ bool sendFrameToVirtualDevice(const uint8_t *frame, size_t size) {
     }
     return true;
 }
+
+bool sendFrameToVirtualDevice(VirtualDevice& dev, const uint8_t *frame, size_t size, uint64_t capture_ns) {
+    if (dev.fd < 0) {
+        std::cerr << "Loopback device not initialized." << std::endl;
+        return false;
+    }
+    if (dev.io == DEVICE_IO_MMAP && !dev.buffers.empty()) {
+        int index;
+        uint8_t* mapped = acquireVirtualDeviceBuffer(dev, size, index);
+        if (!mapped)
+            return false;
+        std::memcpy(mapped, frame, size);
+        return queueVirtualDeviceBuffer(dev, index, size, capture_ns);
+    }
+    return virtualDeviceWriteDone(dev, write(dev.fd, frame, size), size);
+}
+
+// Reader notifications of recent v4l2loopback versions (from v4l2loopback.h,
+// which is usually not installed).
+#ifndef V4L2_EVENT_PRI_CLIENT_USAGE
+#define V4L2_EVENT_PRI_CLIENT_USAGE (V4L2_EVENT_PRIVATE_START + 0x08E00000 + 1)
+struct v4l2_event_client_usage {
+    __u32 count;
+};
+#endif
+
+// Ask v4l2loopback to report capture clients starting and stopping. False on
+// modules without reader notifications; dev.readers then stays unknown.
+bool watchVirtualDeviceReaders(VirtualDevice& dev) {
+    struct v4l2_event_subscription sub;
+    std::memset(&sub, 0, sizeof(sub));
+    sub.type  = V4L2_EVENT_PRI_CLIENT_USAGE;
+    sub.flags = V4L2_EVENT_SUB_FL_SEND_INITIAL;
+    return ioctl(dev.fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == 0;
+}
+
+// Apply pending reader notifications and return the reader count (-1 = unknown).
+int virtualDeviceReaders(VirtualDevice& dev) {
+    struct pollfd pfd = { dev.fd, POLLPRI, 0 };
+    while (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLPRI)) {
+        struct v4l2_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        if (ioctl(dev.fd, VIDIOC_DQEVENT, &ev) < 0)
+            break;
+        if (ev.type == V4L2_EVENT_PRI_CLIENT_USAGE) {
+            struct v4l2_event_client_usage usage;
+            std::memcpy(&usage, ev.u.data, sizeof(usage));
+            dev.readers = static_cast<int>(usage.count);
+        }
+    }
+    return dev.readers;
+}
+
+// Advertise the output frame rate to consumers of the loopback device.
+bool setVirtualDeviceFrameRate(VirtualDevice& dev, int fps) {
+    if (dev.fd < 0) {
+        return false;
+    }
+    struct v4l2_streamparm parm;
+    std::memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    parm.parm.output.capability = V4L2_CAP_TIMEPERFRAME;
+    parm.parm.output.timeperframe.numerator = 1;
+    parm.parm.output.timeperframe.denominator = fps;
+    if (ioctl(dev.fd, VIDIOC_S_PARM, &parm) < 0) {
+        perror(("Setting frame rate on v4l2loopback device (" + dev.path + ")").c_str());
+        return false;
+    }
+    std::cout << "v4l2loopback device " << dev.path << " frame rate: "
+              << parm.parm.output.timeperframe.denominator << "/"
+              << parm.parm.output.timeperframe.numerator << " fps" << std::endl;
+    return true;
+}
 #elif defined(__APPLE__)
-bool initVirtualDevice() {
+bool initVirtualDevice(VirtualDevice& /*dev*/) {
     std::cout << "Virtual camera initialization for macOS is not implemented." << std::endl;
     return false;
 }
-bool sendFrameToVirtualDevice(const uint8_t* /*frame*/, size_t /*size*/) {
+bool sendFrameToVirtualDevice(VirtualDevice& /*dev*/, const uint8_t* /*frame*/, size_t /*size*/, uint64_t /*capture_ns*/) {
+    return false;
+}
+bool setVirtualDeviceFrameRate(VirtualDevice& /*dev*/, int /*fps*/) {
     return false;
 }
 #elif defined(_WIN32)
-bool initVirtualDevice() {
+bool initVirtualDevice(VirtualDevice& /*dev*/) {
     std::cout << "Virtual camera initialization for Windows is not implemented." << std::endl;
     return false;
 }
-bool sendFrameToVirtualDevice(const uint8_t* /*frame*/, size_t /*size*/) {
+bool sendFrameToVirtualDevice(VirtualDevice& /*dev*/, const uint8_t* /*frame*/, size_t /*size*/, uint64_t /*capture_ns*/) {
+    return false;
+}
+bool setVirtualDeviceFrameRate(VirtualDevice& /*dev*/, int /*fps*/) {
     return false;
 }
 #endif
 
-// --- Main Function ---
-int main(int argc, char** argv)
-{
-    // Parse command-line arguments.
-    if (argc < 2) {
-        PrintUsage(argv[0]);
-        return 0;
+// --- Thread Pool ---
+//
+// A fixed set of workers that split a range of rows between themselves and the
+// calling thread. parallelFor() returns once every row has been processed.
+class ThreadPool {
+public:
+    typedef std::function<void(size_t, size_t)> RangeFn;
+
+    explicit ThreadPool(unsigned threads)
+        : stop_(false), generation_(0), job_(nullptr), job_rows_(0), job_chunk_(0),
+          next_chunk_(0), pending_workers_(0) {
+        for (unsigned i = 1; i < threads; i++)
+            workers_.push_back(std::thread(&ThreadPool::workerLoop, this));
     }
-    for (int i = 1; i < argc; i++) {
-        std::string arg(argv[i]);
-        if (arg == "--help" || arg == "-h") {
-            PrintUsage(argv[0]);
-            return 0;
-        } else if (arg == "--ir") {
-            enable_ir = true;
-        } else if (arg == "--rgb") {
-            enable_rgb = true;
-        } else if (arg == "--depth") {
-            enable_depth = true;
-        } else if (arg == "--loopback") {
-            if (i + 1 < argc) {
-                loopback_device = argv[++i];
-            } else {
-                std::cerr << "Error: --loopback requires a device path argument." << std::endl;
-                return 1;
-            }
-        } else {
-            std::cerr << "Unknown argument: " << arg << "\n";
-            PrintUsage(argv[0]);
-            return 1;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
         }
+        wake_.notify_all();
+        for (auto& t : workers_)
+            t.join();
     }
-    if (enable_ir && enable_rgb) {
-        std::cerr << "Error: Cannot enable both IR and RGB streaming simultaneously.\n";
-        return 1;
+
+    unsigned size() const { return static_cast<unsigned>(workers_.size()) + 1; }
+
+    // Run fn over [0, rows) in chunks of at least min_chunk rows.
+    void parallelFor(size_t rows, size_t min_chunk, const RangeFn& fn) {
+        if (workers_.empty() || rows <= min_chunk) {
+            fn(0, rows);
+            return;
+        }
+        size_t chunk = (rows + size() * 2 - 1) / (size() * 2);
+        if (chunk < min_chunk)
+            chunk = min_chunk;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = &fn;
+            job_rows_ = rows;
+            job_chunk_ = chunk;
+            next_chunk_ = 0;
+            pending_workers_ = workers_.size();
+            ++generation_;
+        }
+        wake_.notify_all();
+        runChunks();
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return pending_workers_ == 0; });
+        job_ = nullptr;
     }
-    if (!enable_ir && !enable_rgb && !enable_depth) {
-        std::cerr << "Error: No streaming mode enabled. Use --ir, --rgb, and/or --depth.\n";
-        return 1;
+
+private:
+    void runChunks() {
+        for (;;) {
+            size_t begin = next_chunk_.fetch_add(job_chunk_);
+            if (begin >= job_rows_)
+                break;
+            size_t end = begin + job_chunk_ < job_rows_ ? begin + job_chunk_ : job_rows_;
+            (*job_)(begin, end);
+        }
     }
-    videoChannels = (enable_ir ? 1 : (enable_rgb ? 3 : 0));
 
-#ifdef __linux__
-    // Initialize the virtual device once.
-    if (!initVirtualDevice()) {
-        std::cerr << "Ensure that the specified v4l2loopback device (" << loopback_device 
-                  << ") is created and accessible." << std::endl;
-        // We continue running even if virtual device initialization fails.
+    void workerLoop() {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_)
+                    return;
+                seen = generation_;
+            }
+            runChunks();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --pending_workers_;
+            }
+            done_.notify_one();
+        }
     }
-#endif
 
-    std::cout << "Starting Kinect streaming. Press Ctrl+C to exit." << std::endl;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    bool stop_;
+    uint64_t generation_;
+    const RangeFn* job_;
+    size_t job_rows_;
+    size_t job_chunk_;
+    std::atomic<size_t> next_chunk_;
+    size_t pending_workers_;
+};
 
-    // Outer loop: auto-reconnect if the Kinect disconnects.
-    while (true) {
-        freenect_context* f_ctx = nullptr;
-        freenect_device*  f_dev = nullptr;
+static std::unique_ptr<ThreadPool> g_pool;
 
-        if (freenect_init(&f_ctx, nullptr) < 0) {
-            std::cerr << "freenect_init() failed. No Kinect found. Retrying in 5 seconds..." << std::endl;
-            std::this_thread::sleep_for(std::chrono::seconds(5));
-            continue;
-        }
-        if (freenect_open_device(f_ctx, &f_dev, 0) < 0) {
-            std::cerr << "Could not open Kinect device. Retrying in 5 seconds..." << std::endl;
-            freenect_shutdown(f_ctx);
-            std::this_thread::sleep_for(std::chrono::seconds(5));
-            continue;
-        }
+// --- Temporal Denoiser ---
+//
+// Motion-adaptive recursive filter for 8-bit interleaved frames (GREY, RGB24 or
+// packed YUV). Each byte is blended towards the previous output when it changed by
+// less than the threshold, and passed through unchanged otherwise. An optional
+// motion mask (one byte per pixel, non-zero = moving) forces pass-through, which
+// lets the depth stream veto blending where objects are known to move.
+class TemporalDenoiser {
+public:
+    // strength 1..3: higher keeps more of the previous frame and tolerates more change.
+    explicit TemporalDenoiser(int strength) {
+        static const int kWeights[]    = { 128, 85, 64 };
+        static const int kThresholds[] = { 8, 12, 16 };
+        int idx = strength < 1 ? 0 : (strength > 3 ? 2 : strength - 1);
+        weight_ = kWeights[idx];
+        threshold_ = kThresholds[idx];
+    }
 
-        // Set up video stream if IR or RGB is enabled.
-        if (enable_ir || enable_rgb) {
-            freenect_set_video_callback(f_dev, VideoCallback);
-            freenect_frame_mode video_mode;
-            if (enable_ir) {
-                video_mode = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_IR_8BIT);
-            } else {
-                video_mode = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB);
-            }
-            if (freenect_set_video_mode(f_dev, video_mode) < 0) {
-                std::cerr << "Could not set video mode. Reconnecting..." << std::endl;
-                freenect_close_device(f_dev);
-                freenect_shutdown(f_ctx);
-                std::this_thread::sleep_for(std::chrono::seconds(5));
-                continue;
-            }
-            if (freenect_start_video(f_dev) < 0) {
-                std::cerr << "Could not start video stream. Reconnecting..." << std::endl;
-                freenect_close_device(f_dev);
-                freenect_shutdown(f_ctx);
-                std::this_thread::sleep_for(std::chrono::seconds(5));
-                continue;
+    // Filter frame in place. mask may be null; otherwise it holds width*height bytes.
+    void apply(uint8_t* frame, int width, int height, int channels, const uint8_t* mask) {
+        size_t size = static_cast<size_t>(width) * height * channels;
+        if (prev_.size() != size) {
+            prev_.assign(frame, frame + size);
+            return;
+        }
+        size_t row_bytes = static_cast<size_t>(width) * channels;
+        ThreadPool::RangeFn rows = [&](size_t begin, size_t end) {
+            for (size_t y = begin; y < end; y++) {
+                const uint8_t* row_mask = mask ? mask + y * width : nullptr;
+                filterRow(frame + y * row_bytes, prev_.data() + y * row_bytes,
+                          row_bytes, channels, row_mask);
             }
+        };
+        if (g_pool)
+            g_pool->parallelFor(height, 16, rows);
+        else
+            rows(0, height);
+    }
+
+private:
+    // (cur - prev) * weight / 256, rounded half to even so that blending does not
+    // drift the image up or down; the SIMD path below rounds the same way.
+    static int blendStep(int d, int weight) {
+        int x = d * weight;
+        return (x + 127 + ((x >> 8) & 1)) >> 8;
+    }
+
+    void filterRow(uint8_t* cur, uint8_t* prev, size_t n, int channels, const uint8_t* mask) const {
+        size_t i = 0;
+#if defined(__SSE2__)
+        // The mask has a byte per pixel; with several channels it is spread to a
+        // byte per sample first, so masked rows stay on the SIMD path.
+        const uint8_t* sample_mask = mask;
+        if (mask && channels > 1) {
+            static thread_local std::vector<uint8_t> spread;
+            spread.resize(n);
+            for (size_t x = 0; x < n / channels; x++)
+                std::memset(spread.data() + x * channels, mask[x], channels);
+            sample_mask = spread.data();
         }
-        // Set up depth stream if enabled.
-        if (enable_depth) {
-            freenect_set_depth_callback(f_dev, DepthCallback);
-            freenect_frame_mode depth_mode = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT);
-            if (freenect_set_depth_mode(f_dev, depth_mode) < 0) {
-                std::cerr << "Could not set depth mode. Reconnecting..." << std::endl;
-                if (enable_ir || enable_rgb) freenect_stop_video(f_dev);
-                freenect_close_device(f_dev);
-                freenect_shutdown(f_ctx);
-                std::this_thread::sleep_for(std::chrono::seconds(5));
-                continue;
+        const __m128i zero   = _mm_setzero_si128();
+        const __m128i one    = _mm_set1_epi16(1);
+        const __m128i bias   = _mm_set1_epi16(127);
+        const __m128i weight = _mm_set1_epi16(static_cast<short>(weight_));
+        const __m128i limit  = _mm_set1_epi8(static_cast<char>(threshold_ - 1));
+        for (; i + 16 <= n; i += 16) {
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cur + i));
+            __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i));
+            __m128i diff  = _mm_or_si128(_mm_subs_epu8(c, p), _mm_subs_epu8(p, c));
+            __m128i still = _mm_cmpeq_epi8(_mm_subs_epu8(diff, limit), zero);
+            if (sample_mask) {
+                __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sample_mask + i));
+                still = _mm_and_si128(still, _mm_cmpeq_epi8(m, zero));
             }
-            if (freenect_start_depth(f_dev) < 0) {
-                std::cerr << "Could not start depth stream. Reconnecting..." << std::endl;
-                if (enable_ir || enable_rgb) freenect_stop_video(f_dev);
-                freenect_close_device(f_dev);
-                freenect_shutdown(f_ctx);
-                std::this_thread::sleep_for(std::chrono::seconds(5));
-                continue;
+            // prev + blendStep(cur - prev), in 16-bit lanes.
+            __m128i c_lo = _mm_unpacklo_epi8(c, zero), c_hi = _mm_unpackhi_epi8(c, zero);
+            __m128i p_lo = _mm_unpacklo_epi8(p, zero), p_hi = _mm_unpackhi_epi8(p, zero);
+            __m128i x_lo = _mm_mullo_epi16(_mm_sub_epi16(c_lo, p_lo), weight);
+            __m128i x_hi = _mm_mullo_epi16(_mm_sub_epi16(c_hi, p_hi), weight);
+            x_lo = _mm_add_epi16(x_lo, _mm_add_epi16(bias, _mm_and_si128(_mm_srai_epi16(x_lo, 8), one)));
+            x_hi = _mm_add_epi16(x_hi, _mm_add_epi16(bias, _mm_and_si128(_mm_srai_epi16(x_hi, 8), one)));
+            __m128i b_lo = _mm_add_epi16(p_lo, _mm_srai_epi16(x_lo, 8));
+            __m128i b_hi = _mm_add_epi16(p_hi, _mm_srai_epi16(x_hi, 8));
+            __m128i blended = _mm_packus_epi16(b_lo, b_hi);
+            __m128i out = _mm_or_si128(_mm_and_si128(still, blended), _mm_andnot_si128(still, c));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(cur + i), out);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(prev + i), out);
+        }
+#endif
+        for (; i < n; i++) {
+            int c = cur[i], p = prev[i];
+            int d = c - p;
+            bool moving = (d < 0 ? -d : d) >= threshold_ || (mask && mask[i / channels]);
+            int out = moving ? c : p + blendStep(d, weight_);
+            cur[i] = prev[i] = static_cast<uint8_t>(out);
+        }
+    }
+
+    int weight_;
+    int threshold_;
+    std::vector<uint8_t> prev_;  // Previous output frame.
+};
+
+// --- Neighbourhood Filters ---
+//
+// Filters that need a window of surrounding pixels (median, blur, bilateral,
+// undistort). A FilterChain runs all of its stages strip by strip: each strip of
+// output rows is produced by running every stage over just the rows it needs
+// (the strip plus the halo rows of the stages after it), so intermediate results
+// stay in per-thread scratch buffers sized to fit in L2. Strips are also the unit
+// of work handed to the thread pool.
+
+// A window of rows of an interleaved plane. Rows outside [0, height) are clamped
+// to the edge; rows outside [first_row, first_row + rows) must not be accessed.
+template <typename T>
+struct PlaneView {
+    T* base;
+    int width;
+    int height;
+    int channels;
+    int first_row;
+
+    T* row(int y) const {
+        y = y < 0 ? 0 : (y >= height ? height - 1 : y);
+        return base + static_cast<size_t>(y - first_row) * width * channels;
+    }
+};
+
+// Filters take the sample value meaning "no reading" (2047 for raw depth, 0 for
+// depth in millimetres; -1 for video, which has none). Such samples are left out
+// of every kernel and the remaining weights renormalised, so holes never bleed
+// into valid neighbours; an output sample whose centre has no reading stays a hole.
+template <typename T>
+class NeighbourhoodFilter {
+public:
+    explicit NeighbourhoodFilter(int invalid) : invalid_(invalid) {}
+    virtual ~NeighbourhoodFilter() {}
+    virtual const char* name() const = 0;
+    // Called once per frame size before halo() and run().
+    virtual void prepare(int /*width*/, int /*height*/) {}
+    // Rows needed above and below an output row.
+    virtual int halo() const = 0;
+    // Compute output rows [y_begin, y_end) from in.
+    virtual void run(const PlaneView<const T>& in, const PlaneView<T>& out, int y_begin, int y_end) const = 0;
+
+protected:
+    bool valid(T v) const { return static_cast<int>(v) != invalid_; }
+
+    int invalid_;
+};
+
+// 3x3 median per channel.
+template <typename T>
+class MedianFilter3x3 : public NeighbourhoodFilter<T> {
+public:
+    explicit MedianFilter3x3(int invalid) : NeighbourhoodFilter<T>(invalid) {}
+    const char* name() const override { return "median"; }
+    int halo() const override { return 1; }
+    void run(const PlaneView<const T>& in, const PlaneView<T>& out, int y_begin, int y_end) const override {
+        const int w = in.width, ch = in.channels;
+        const bool holes = this->invalid_ >= 0;
+        for (int y = y_begin; y < y_end; y++) {
+            const T* rows[3] = { in.row(y - 1), in.row(y), in.row(y + 1) };
+            T* dst = out.row(y);
+            for (int x = 0; x < w; x++) {
+                int xs[3] = { x > 0 ? x - 1 : 0, x, x + 1 < w ? x + 1 : w - 1 };
+                for (int c = 0; c < ch; c++) {
+                    T v[9];
+                    int n = 0;
+                    for (int j = 0; j < 3; j++)
+                        for (int i = 0; i < 3; i++) {
+                            T s = rows[j][xs[i] * ch + c];
+                            if (!holes || this->valid(s))
+                                v[n++] = s;
+                        }
+                    T centre = rows[1][x * ch + c];
+                    if (n == 9)
+                        dst[x * ch + c] = median9(v);
+                    else if (!this->valid(centre))
+                        dst[x * ch + c] = centre;
+                    else
+                        dst[x * ch + c] = medianOf(v, n);
+                }
             }
         }
+    }
 
-        std::cout << "Kinect connected. Streaming data to virtual device (" << loopback_device << ")..." << std::endl;
+private:
+    // Median of 9 with a 19 compare-exchange network.
+    static T median9(T* p) {
+        auto sort2 = [](T& a, T& b) { if (b < a) std::swap(a, b); };
+        sort2(p[1], p[2]); sort2(p[4], p[5]); sort2(p[7], p[8]);
+        sort2(p[0], p[1]); sort2(p[3], p[4]); sort2(p[6], p[7]);
+        sort2(p[1], p[2]); sort2(p[4], p[5]); sort2(p[7], p[8]);
+        sort2(p[0], p[3]); sort2(p[5], p[8]); sort2(p[4], p[7]);
+        sort2(p[3], p[6]); sort2(p[1], p[4]); sort2(p[2], p[5]);
+        sort2(p[4], p[7]); sort2(p[4], p[2]); sort2(p[6], p[4]);
+        sort2(p[4], p[2]);
+        return p[4];
+    }
 
-        // Inner loop: process events and forward frames.
-        bool kinect_active = true;
-        while (kinect_active) {
-            int ret = freenect_process_events(f_ctx);
-            if (ret < 0) {
-                std::cerr << "Kinect disconnected or error encountered (code " << ret << "). Reconnecting..." << std::endl;
-                kinect_active = false;
-                break;
+    // Median of the n (1..8) valid samples; the lower one of the middle pair for even n.
+    static T medianOf(T* p, int n) {
+        for (int i = 1; i < n; i++)
+            for (int j = i; j > 0 && p[j] < p[j - 1]; j--)
+                std::swap(p[j], p[j - 1]);
+        return p[(n - 1) / 2];
+    }
+};
+
+// Box blur of the given radius; column sums per row, then a sliding window.
+// With holes, valid samples are counted alongside the sums and each output is
+// the mean of the valid samples in its window.
+template <typename T>
+class BoxBlurFilter : public NeighbourhoodFilter<T> {
+public:
+    BoxBlurFilter(int radius, int invalid) : NeighbourhoodFilter<T>(invalid), radius_(radius) {}
+    const char* name() const override { return "blur"; }
+    int halo() const override { return radius_; }
+    void run(const PlaneView<const T>& in, const PlaneView<T>& out, int y_begin, int y_end) const override {
+        const int w = in.width, ch = in.channels, r = radius_;
+        const int taps = 2 * r + 1;
+        const uint32_t area = static_cast<uint32_t>(taps * taps);
+        const bool holes = this->invalid_ >= 0;
+        // Column sums (and valid counts), reused across strips and frames per thread.
+        static thread_local std::vector<uint32_t> cols, counts;
+        cols.resize(static_cast<size_t>(w) * ch);
+        counts.resize(holes ? cols.size() : 0);
+        for (int y = y_begin; y < y_end; y++) {
+            std::fill(cols.begin(), cols.end(), 0u);
+            std::fill(counts.begin(), counts.end(), 0u);
+            for (int dy = -r; dy <= r; dy++) {
+                const T* src = in.row(y + dy);
+                if (!holes) {
+                    for (size_t i = 0; i < cols.size(); i++)
+                        cols[i] += src[i];
+                    continue;
+                }
+                for (size_t i = 0; i < cols.size(); i++) {
+                    if (this->valid(src[i])) {
+                        cols[i] += src[i];
+                        ++counts[i];
+                    }
+                }
             }
-            // Process video frame (IR or RGB) if available.
-            if ((enable_ir || enable_rgb) && newVideoFrame.load()) {
-                std::vector<uint8_t> outputFrame;
-                {
-                    std::lock_guard<std::mutex> lock(videoMutex);
-                    outputFrame = videoBuffer;
-                    newVideoFrame = false;
+            const T* centre = in.row(y);
+            T* dst = out.row(y);
+            for (int c = 0; c < ch; c++) {
+                uint32_t sum = 0, count = 0;
+                for (int dx = -r; dx <= r; dx++) {
+                    sum += cols[clampIndex(dx, w) * ch + c];
+                    count += holes ? counts[clampIndex(dx, w) * ch + c] : 0;
                 }
-                if (!sendFrameToVirtualDevice(outputFrame.data(), outputFrame.size())) {
-                    std::cerr << "Failed to send video frame to virtual device." << std::endl;
+                for (int x = 0; x < w; x++) {
+                    if (!holes)
+                        dst[x * ch + c] = static_cast<T>((sum + area / 2) / area);
+                    else if (!this->valid(centre[x * ch + c]) || count == 0)
+                        dst[x * ch + c] = centre[x * ch + c];
+                    else
+                        dst[x * ch + c] = static_cast<T>((sum + count / 2) / count);
+                    size_t add = clampIndex(x + r + 1, w) * ch + c, drop = clampIndex(x - r, w) * ch + c;
+                    sum += cols[add] - cols[drop];
+                    if (holes)
+                        count += counts[add] - counts[drop];
                 }
             }
-            // Process depth frame if available.
-            if (enable_depth && newDepthFrame.load()) {
-                std::vector<uint8_t> depthFrame(WIDTH * HEIGHT);
-                {
-                    std::lock_guard<std::mutex> lock(depthMutex);
-                    for (int i = 0; i < WIDTH * HEIGHT; i++) {
-                        depthFrame[i] = static_cast<uint8_t>((depthBuffer[i] * 255) / 2047);
+        }
+    }
+
+private:
+    static int clampIndex(int x, int w) { return x < 0 ? 0 : (x >= w ? w - 1 : x); }
+    int radius_;
+};
+
+// Edge-preserving bilateral filter with tabulated spatial and range weights.
+// The range distance of a multi-channel pixel is its mean absolute difference.
+template <typename T>
+class BilateralFilter : public NeighbourhoodFilter<T> {
+public:
+    BilateralFilter(int radius, double sigma_space, double sigma_range, int max_value, int invalid)
+        : NeighbourhoodFilter<T>(invalid), radius_(radius) {
+        int taps = 2 * radius + 1;
+        spatial_.resize(taps * taps);
+        for (int dy = -radius; dy <= radius; dy++)
+            for (int dx = -radius; dx <= radius; dx++)
+                spatial_[(dy + radius) * taps + dx + radius] =
+                    static_cast<float>(std::exp(-(dx * dx + dy * dy) / (2.0 * sigma_space * sigma_space)));
+        range_.resize(max_value + 1);
+        for (int d = 0; d <= max_value; d++)
+            range_[d] = static_cast<float>(std::exp(-(double)d * d / (2.0 * sigma_range * sigma_range)));
+    }
+    const char* name() const override { return "bilateral"; }
+    int halo() const override { return radius_; }
+    void run(const PlaneView<const T>& in, const PlaneView<T>& out, int y_begin, int y_end) const override {
+        const int w = in.width, ch = in.channels, r = radius_, taps = 2 * r + 1;
+        const int max_d = static_cast<int>(range_.size()) - 1;
+        const bool holes = this->invalid_ >= 0;
+        for (int y = y_begin; y < y_end; y++) {
+            T* dst = out.row(y);
+            const T* centre_row = in.row(y);
+            for (int x = 0; x < w; x++) {
+                const T* centre = centre_row + x * ch;
+                if (holes && !this->valid(centre[0])) {
+                    for (int c = 0; c < ch; c++)
+                        dst[x * ch + c] = centre[c];
+                    continue;
+                }
+                float acc[4] = { 0, 0, 0, 0 };
+                float norm = 0;
+                for (int dy = -r; dy <= r; dy++) {
+                    const T* src = in.row(y + dy);
+                    for (int dx = -r; dx <= r; dx++) {
+                        int sx = x + dx < 0 ? 0 : (x + dx >= w ? w - 1 : x + dx);
+                        const T* p = src + sx * ch;
+                        if (holes && !this->valid(p[0]))
+                            continue;
+                        int d = 0;
+                        for (int c = 0; c < ch; c++)
+                            d += std::abs(static_cast<int>(p[c]) - static_cast<int>(centre[c]));
+                        d /= ch;
+                        float wgt = spatial_[(dy + r) * taps + dx + r] * range_[d > max_d ? max_d : d];
+                        for (int c = 0; c < ch; c++)
+                            acc[c] += wgt * p[c];
+                        norm += wgt;
                     }
-                    newDepthFrame = false;
                 }
-                if (!sendFrameToVirtualDevice(depthFrame.data(), depthFrame.size())) {
-                    std::cerr << "Failed to send depth frame to virtual device." << std::endl;
+                for (int c = 0; c < ch; c++)
+                    dst[x * ch + c] = static_cast<T>(acc[c] / norm + 0.5f);
+            }
+        }
+    }
+
+private:
+    int radius_;
+    std::vector<float> spatial_;
+    std::vector<float> range_;
+};
+
+// Radial lens undistortion (Brown model, k1/k2) with bilinear sampling. The remap
+// table is built per frame size; the halo is the largest vertical displacement.
+// With holes, the bilinear weights are renormalised over the taps with a reading.
+template <typename T>
+class UndistortFilter : public NeighbourhoodFilter<T> {
+public:
+    // Coefficients accepted by parseFilterChain().
+    static constexpr double MAX_K = 1.0;
+
+    UndistortFilter(double k1, double k2, int invalid)
+        : NeighbourhoodFilter<T>(invalid), k1_(k1), k2_(k2), width_(0), height_(0), halo_(0) {}
+    const char* name() const override { return "undistort"; }
+    void prepare(int width, int height) override {
+        if (width == width_ && height == height_)
+            return;
+        width_ = width;
+        height_ = height;
+        map_.resize(static_cast<size_t>(width) * height);
+        double cx = (width - 1) * 0.5, cy = (height - 1) * 0.5;
+        double f = width * 0.9;  // Approximate Kinect focal length in pixels.
+        int max_dy = 0;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                double nx = (x - cx) / f, ny = (y - cy) / f;
+                double r2 = nx * nx + ny * ny;
+                double k = 1.0 + k1_ * r2 + k2_ * r2 * r2;
+                double sx = cx + nx * k * f, sy = cy + ny * k * f;
+                sx = sx < 0 ? 0 : (sx > width - 1 ? width - 1 : sx);
+                sy = sy < 0 ? 0 : (sy > height - 1 ? height - 1 : sy);
+                Tap& t = map_[static_cast<size_t>(y) * width + x];
+                t.x = static_cast<int>(sx);
+                t.y = static_cast<int>(sy);
+                t.wx = static_cast<int>((sx - t.x) * 256.0);
+                t.wy = static_cast<int>((sy - t.y) * 256.0);
+                int dy = std::abs(t.y - y) + 1;
+                if (dy > max_dy) max_dy = dy;
+            }
+        }
+        halo_ = max_dy;
+    }
+    int halo() const override { return halo_; }
+    void run(const PlaneView<const T>& in, const PlaneView<T>& out, int y_begin, int y_end) const override {
+        const int w = in.width, ch = in.channels;
+        const bool holes = this->invalid_ >= 0;
+        for (int y = y_begin; y < y_end; y++) {
+            T* dst = out.row(y);
+            const Tap* taps = &map_[static_cast<size_t>(y) * w];
+            for (int x = 0; x < w; x++) {
+                const Tap& t = taps[x];
+                const T* r0 = in.row(t.y);
+                const T* r1 = in.row(t.y + 1);
+                int x1 = t.x + 1 < w ? t.x + 1 : t.x;
+                for (int c = 0; c < ch; c++) {
+                    T s00 = r0[t.x * ch + c], s01 = r0[x1 * ch + c];
+                    T s10 = r1[t.x * ch + c], s11 = r1[x1 * ch + c];
+                    if (holes && !(this->valid(s00) && this->valid(s01) && this->valid(s10) && this->valid(s11))) {
+                        dst[x * ch + c] = sampleHoles(s00, s01, s10, s11, t);
+                        continue;
+                    }
+                    int top    = s00 * (256 - t.wx) + s01 * t.wx;
+                    int bottom = s10 * (256 - t.wx) + s11 * t.wx;
+                    dst[x * ch + c] = static_cast<T>((static_cast<int64_t>(top) * (256 - t.wy) +
+                                                      static_cast<int64_t>(bottom) * t.wy + 32768) >> 16);
                 }
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+private:
+    struct Tap { int x, y, wx, wy; };
+
+    // Bilinear sample over the taps with a reading; a hole if none has one.
+    T sampleHoles(T s00, T s01, T s10, T s11, const Tap& t) const {
+        const T s[4] = { s00, s01, s10, s11 };
+        const int64_t w[4] = { (256 - t.wx) * (256 - t.wy), t.wx * (256 - t.wy),
+                               (256 - t.wx) * t.wy, t.wx * t.wy };
+        int64_t sum = 0, norm = 0;
+        for (int i = 0; i < 4; i++) {
+            if (this->valid(s[i])) {
+                sum += w[i] * s[i];
+                norm += w[i];
+            }
+        }
+        return norm > 0 ? static_cast<T>((sum + norm / 2) / norm) : static_cast<T>(this->invalid_);
+    }
+
+    double k1_, k2_;
+    int width_, height_;
+    int halo_;
+    std::vector<Tap> map_;
+};
+
+// Size of the per-core L2 cache, used to size filter strips.
+size_t l2CacheBytes() {
+#if defined(__linux__) && defined(_SC_LEVEL2_CACHE_SIZE)
+    long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (size > 0)
+        return static_cast<size_t>(size);
+#endif
+    return 256 * 1024;
+}
+
+template <typename T>
+class FilterChain {
+public:
+    void add(NeighbourhoodFilter<T>* filter) { stages_.push_back(std::unique_ptr<NeighbourhoodFilter<T>>(filter)); }
+    bool empty() const { return stages_.empty(); }
+
+    std::string describe() const {
+        std::string s;
+        for (const auto& st : stages_) {
+            if (!s.empty()) s += ",";
+            s += st->name();
+        }
+        return s;
+    }
+
+    // Run all stages from src to dst (distinct width x height x channels planes).
+    void apply(const T* src, T* dst, int width, int height, int channels) {
+        const size_t n = stages_.size();
+        // halo_below[k]: rows of stage k output needed around a final output row.
+        std::vector<int> halo_below(n, 0);
+        int total_halo = 0;
+        for (size_t k = n; k-- > 0;) {
+            stages_[k]->prepare(width, height);
+            halo_below[k] = total_halo;
+            total_halo += stages_[k]->halo();
+        }
+        size_t row_bytes = static_cast<size_t>(width) * channels * sizeof(T);
+        long strip = static_cast<long>(l2CacheBytes() / 2 / (4 * row_bytes)) - 2 * total_halo;
+        const int strip_rows = strip < 8 ? 8 : static_cast<int>(strip);
+        const int strips = (height + strip_rows - 1) / strip_rows;
+
+        ThreadPool::RangeFn work = [&](size_t s_begin, size_t s_end) {
+            // Ping-pong scratch for intermediate stages, reused across frames per thread.
+            static thread_local std::vector<T> scratch[2];
+            for (size_t s = s_begin; s < s_end; s++) {
+                int y0 = static_cast<int>(s) * strip_rows;
+                int y1 = std::min(height, y0 + strip_rows);
+                PlaneView<const T> in = { src, width, height, channels, 0 };
+                for (size_t k = 0; k < n; k++) {
+                    int lo = std::max(0, y0 - halo_below[k]);
+                    int hi = std::min(height, y1 + halo_below[k]);
+                    PlaneView<T> out;
+                    if (k + 1 == n) {
+                        out = PlaneView<T>{ dst, width, height, channels, 0 };
+                    } else {
+                        std::vector<T>& buf = scratch[k % 2];
+                        buf.resize(static_cast<size_t>(hi - lo) * width * channels);
+                        out = PlaneView<T>{ buf.data(), width, height, channels, lo };
+                    }
+                    stages_[k]->run(in, out, lo, hi);
+                    in = PlaneView<const T>{ out.base, width, height, channels, out.first_row };
+                }
+            }
+        };
+        if (g_pool)
+            g_pool->parallelFor(strips, 1, work);
+        else
+            work(0, strips);
+    }
+
+private:
+    std::vector<std::unique_ptr<NeighbourhoodFilter<T>>> stages_;
+};
+
+// Parse a comma-separated filter list such as "median,blur:2,bilateral:2,undistort:-0.2:0.05".
+// invalid is the sample value without a reading, or -1 (see NeighbourhoodFilter).
+// Returns false on an unknown filter or a parameter that is not a finite number
+// in range.
+template <typename T>
+bool parseFilterChain(const std::string& spec, int max_value, int invalid, FilterChain<T>& chain) {
+    size_t pos = 0;
+    while (pos <= spec.size()) {
+        size_t end = spec.find(',', pos);
+        if (end == std::string::npos) end = spec.size();
+        std::string item = spec.substr(pos, end - pos);
+        std::vector<std::string> parts;
+        size_t p = 0;
+        for (;;) {
+            size_t colon = item.find(':', p);
+            parts.push_back(item.substr(p, colon == std::string::npos ? std::string::npos : colon - p));
+            if (colon == std::string::npos) break;
+            p = colon + 1;
+        }
+        bool numbers_ok = true;
+        auto num = [&](size_t i, double def) {
+            if (parts.size() <= i)
+                return def;
+            char* end = nullptr;
+            double value = std::strtod(parts[i].c_str(), &end);
+            if (parts[i].empty() || *end != '\0' || !std::isfinite(value)) {
+                numbers_ok = false;
+                return def;
+            }
+            return value;
+        };
+        if (parts[0] == "median" && parts.size() == 1) {
+            chain.add(new MedianFilter3x3<T>(invalid));
+        } else if (parts[0] == "blur" && parts.size() <= 2) {
+            double r = num(1, 1);
+            if (!numbers_ok || r < 1 || r > 16) return false;
+            chain.add(new BoxBlurFilter<T>(static_cast<int>(r), invalid));
+        } else if (parts[0] == "bilateral" && parts.size() <= 4) {
+            double r = num(1, 2);
+            if (!numbers_ok || r < 1 || r > 8) return false;
+            double sigma_space = num(2, static_cast<int>(r)), sigma_range = num(3, max_value / 10.0);
+            if (!numbers_ok || sigma_space <= 0 || sigma_range <= 0) return false;
+            chain.add(new BilateralFilter<T>(static_cast<int>(r), sigma_space, sigma_range, max_value, invalid));
+        } else if (parts[0] == "undistort" && parts.size() <= 3) {
+            double k1 = num(1, -0.2), k2 = num(2, 0.0);
+            if (!numbers_ok || std::fabs(k1) > UndistortFilter<T>::MAX_K || std::fabs(k2) > UndistortFilter<T>::MAX_K)
+                return false;
+            chain.add(new UndistortFilter<T>(k1, k2, invalid));
+        } else {
+            return false;
+        }
+        pos = end + 1;
+    }
+    return true;
+}
+
+// --- Fused Pixel Pipeline ---
+//
+// Per-pixel stages are composed at compile time into a single kernel, so each frame
+// is read once and the sink buffer written once no matter how many stages are
+// enabled:
+//
+//   Source -> Sampler (mirror / scale) -> Ops (LUT, matrix, clamp) -> Packer
+//
+// Every combination of source, sampler, colour ops and packer is instantiated ahead
+// of time; FramePipeline picks the one matching the runtime configuration so that
+// disabled stages cost nothing.
+
+// Working pixel inside a kernel: three channels in RGB order, nominally 0..255.
+struct Px {
+    int c[3];
+};
+
+// Runtime parameters shared by the stages of one pipeline.
+struct PipelineParams {
+    uint8_t lut[3][256];  // Per-channel tone curve (gamma).
+    int matrix[3][3];     // Colour matrix in 8.8 fixed point (saturation).
+};
+
+// Precomputed source coordinates and bilinear weights for every output column and
+// row. Mirroring is folded into the column table.
+struct ResampleTables {
+    std::vector<int> x0, x1, wx;  // Source columns and weight of x1 (0..256).
+    std::vector<int> y0, y1, wy;  // Source rows and weight of y1 (0..256).
+};
+
+// Sources: load one pixel from a source row.
+struct SrcGrey {
+    static const int kBytes = 1;
+    static void load(const uint8_t* row, int x, Px& p) {
+        p.c[0] = p.c[1] = p.c[2] = row[x];
+    }
+};
+struct SrcRGB24 {
+    static const int kBytes = 3;
+    static void load(const uint8_t* row, int x, Px& p) {
+        const uint8_t* s = row + x * 3;
+        p.c[0] = s[0]; p.c[1] = s[1]; p.c[2] = s[2];
+    }
+};
+inline int clamp255(int v) {
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+// Kinect raw YUV (packed 4:2:2, U Y0 V Y1), BT.601 limited range.
+struct SrcUYVY {
+    static const int kBytes = 2;
+    static void load(const uint8_t* row, int x, Px& p) {
+        const uint8_t* s = row + (x & ~1) * 2;
+        int c = (x & 1 ? s[3] : s[1]) - 16, d = s[0] - 128, e = s[2] - 128;
+        p.c[0] = clamp255((298 * c + 409 * e + 128) >> 8);
+        p.c[1] = clamp255((298 * c - 100 * d - 208 * e + 128) >> 8);
+        p.c[2] = clamp255((298 * c + 516 * d + 128) >> 8);
+    }
+};
+// 11-bit Kinect depth, mapped linearly to 0..255 (2047 = no reading = white).
+struct SrcDepth11 {
+    static const int kBytes = 2;
+    static void load(const uint8_t* row, int x, Px& p) {
+        int d = reinterpret_cast<const uint16_t*>(row)[x];
+        if (d > 2047) d = 2047;
+        p.c[0] = p.c[1] = p.c[2] = (d * 255) / 2047;
+    }
+};
+
+// Samplers: produce the source pixel for output column x of the current row.
+struct RowPtrs {
+    const uint8_t* r0;  // Source row y0.
+    const uint8_t* r1;  // Source row y1.
+    int wy;             // Weight of r1 (0..256).
+};
+// 1:1 copy of the source rectangle, no mirroring (x0 holds the crop offset).
+struct SampleDirect {
+    template <class Src>
+    static void sample(const RowPtrs& rows, const ResampleTables& t, int x, Px& p) {
+        Src::load(rows.r0, t.x0[x], p);
+    }
+};
+// Nearest source pixel from the tables (mirror, or scaling without filtering).
+struct SampleNearest {
+    template <class Src>
+    static void sample(const RowPtrs& rows, const ResampleTables& t, int x, Px& p) {
+        Src::load(rows.wy < 128 ? rows.r0 : rows.r1, t.wx[x] < 128 ? t.x0[x] : t.x1[x], p);
+    }
+};
+// Bilinear interpolation from the tables.
+struct SampleBilinear {
+    template <class Src>
+    static void sample(const RowPtrs& rows, const ResampleTables& t, int x, Px& p) {
+        Px a, b, c, d;
+        Src::load(rows.r0, t.x0[x], a);
+        Src::load(rows.r0, t.x1[x], b);
+        Src::load(rows.r1, t.x0[x], c);
+        Src::load(rows.r1, t.x1[x], d);
+        int wx = t.wx[x], wy = rows.wy;
+        for (int i = 0; i < 3; i++) {
+            int top    = a.c[i] * (256 - wx) + b.c[i] * wx;
+            int bottom = c.c[i] * (256 - wx) + d.c[i] * wx;
+            p.c[i] = (top * (256 - wy) + bottom * wy + 32768) >> 16;
+        }
+    }
+};
+
+// Colour ops: transform a pixel in place.
+struct OpLut {
+    static void apply(Px& p, const PipelineParams& params) {
+        for (int i = 0; i < 3; i++)
+            p.c[i] = params.lut[i][p.c[i]];
+    }
+};
+struct OpMatrix {
+    static void apply(Px& p, const PipelineParams& params) {
+        Px in = p;
+        for (int i = 0; i < 3; i++) {
+            const int* m = params.matrix[i];
+            p.c[i] = (m[0] * in.c[0] + m[1] * in.c[1] + m[2] * in.c[2] + 128) >> 8;
+        }
+    }
+};
+struct OpClamp {
+    static void apply(Px& p, const PipelineParams&) {
+        for (int i = 0; i < 3; i++)
+            p.c[i] = p.c[i] < 0 ? 0 : (p.c[i] > 255 ? 255 : p.c[i]);
+    }
+};
+
+template <class... Ops> struct OpChain;
+template <> struct OpChain<> {
+    static void apply(Px&, const PipelineParams&) {}
+};
+template <class Op, class... Rest> struct OpChain<Op, Rest...> {
+    static void apply(Px& p, const PipelineParams& params) {
+        Op::apply(p, params);
+        OpChain<Rest...>::apply(p, params);
+    }
+};
+
+// Packers: store kPixels pixels in the destination format.
+inline int lumaOf(const Px& p) {
+    return (77 * p.c[0] + 150 * p.c[1] + 29 * p.c[2] + 128) >> 8;
+}
+// BT.601 limited-range conversion; chroma is taken from the average of a pixel pair.
+inline void yuvOf(const Px& a, const Px& b, int& y0, int& y1, int& u, int& v) {
+    y0 = ((66 * a.c[0] + 129 * a.c[1] + 25 * a.c[2] + 128) >> 8) + 16;
+    y1 = ((66 * b.c[0] + 129 * b.c[1] + 25 * b.c[2] + 128) >> 8) + 16;
+    int r = (a.c[0] + b.c[0] + 1) >> 1, g = (a.c[1] + b.c[1] + 1) >> 1, bl = (a.c[2] + b.c[2] + 1) >> 1;
+    u = ((-38 * r - 74 * g + 112 * bl + 128) >> 8) + 128;
+    v = ((112 * r - 94 * g - 18 * bl + 128) >> 8) + 128;
+}
+struct PackGrey {
+    static const int kPixels = 1;
+    static const int kBytes = 1;
+    static void store(uint8_t* d, const Px* p) { d[0] = static_cast<uint8_t>(lumaOf(p[0])); }
+};
+struct PackRGB24 {
+    static const int kPixels = 1;
+    static const int kBytes = 3;
+    static void store(uint8_t* d, const Px* p) {
+        d[0] = static_cast<uint8_t>(p[0].c[0]);
+        d[1] = static_cast<uint8_t>(p[0].c[1]);
+        d[2] = static_cast<uint8_t>(p[0].c[2]);
+    }
+};
+struct PackBGR24 {
+    static const int kPixels = 1;
+    static const int kBytes = 3;
+    static void store(uint8_t* d, const Px* p) {
+        d[0] = static_cast<uint8_t>(p[0].c[2]);
+        d[1] = static_cast<uint8_t>(p[0].c[1]);
+        d[2] = static_cast<uint8_t>(p[0].c[0]);
+    }
+};
+// Opaque B, G, R, A (also used for BGR32, whose fourth byte is ignored).
+struct PackBGRA {
+    static const int kPixels = 1;
+    static const int kBytes = 4;
+    static void store(uint8_t* d, const Px* p) {
+        d[0] = static_cast<uint8_t>(p[0].c[2]);
+        d[1] = static_cast<uint8_t>(p[0].c[1]);
+        d[2] = static_cast<uint8_t>(p[0].c[0]);
+        d[3] = 255;
+    }
+};
+struct PackYUYV {
+    static const int kPixels = 2;
+    static const int kBytes = 4;
+    static void store(uint8_t* d, const Px* p) {
+        int y0, y1, u, v;
+        yuvOf(p[0], p[1], y0, y1, u, v);
+        d[0] = static_cast<uint8_t>(y0); d[1] = static_cast<uint8_t>(u);
+        d[2] = static_cast<uint8_t>(y1); d[3] = static_cast<uint8_t>(v);
+    }
+};
+struct PackUYVY {
+    static const int kPixels = 2;
+    static const int kBytes = 4;
+    static void store(uint8_t* d, const Px* p) {
+        int y0, y1, u, v;
+        yuvOf(p[0], p[1], y0, y1, u, v);
+        d[0] = static_cast<uint8_t>(u); d[1] = static_cast<uint8_t>(y0);
+        d[2] = static_cast<uint8_t>(v); d[3] = static_cast<uint8_t>(y1);
+    }
+};
+
+// Everything a kernel needs to convert a band of output rows.
+struct KernelArgs {
+    const uint8_t* src;
+    size_t src_stride;
+    uint8_t* dst;
+    size_t dst_stride;
+    int dst_width;  // Must be a multiple of the packer's pixel group.
+    // Output rectangle left untouched (another source is drawn there), empty if
+    // hole_w is 0. Column and width are multiples of the packer's pixel group.
+    int hole_x, hole_w;
+    size_t hole_y0, hole_y1;
+    const ResampleTables* tables;
+    const PipelineParams* params;
+};
+
+// Output columns [begin, end) of row y to render, as up to two spans around the
+// hole. Returns the number of spans.
+inline int rowSpans(const KernelArgs& a, size_t y, int spans[2][2]) {
+    if (a.hole_w == 0 || y < a.hole_y0 || y >= a.hole_y1) {
+        spans[0][0] = 0;
+        spans[0][1] = a.dst_width;
+        return 1;
+    }
+    spans[0][0] = 0;
+    spans[0][1] = a.hole_x;
+    spans[1][0] = a.hole_x + a.hole_w;
+    spans[1][1] = a.dst_width;
+    return 2;
+}
+
+typedef void (*FusedKernelFn)(const KernelArgs&, size_t, size_t);
+
+template <class Src, class Sampler, class Ops, class Packer>
+void fusedKernel(const KernelArgs& a, size_t row_begin, size_t row_end) {
+    const ResampleTables& t = *a.tables;
+    for (size_t y = row_begin; y < row_end; y++) {
+        RowPtrs rows;
+        rows.r0 = a.src + t.y0[y] * a.src_stride;
+        rows.r1 = a.src + t.y1[y] * a.src_stride;
+        rows.wy = t.wy[y];
+        int spans[2][2];
+        const int span_count = rowSpans(a, y, spans);
+        for (int s = 0; s < span_count; s++) {
+            uint8_t* out = a.dst + y * a.dst_stride + spans[s][0] / Packer::kPixels * Packer::kBytes;
+            Px group[Packer::kPixels];
+            for (int x = spans[s][0]; x < spans[s][1]; x += Packer::kPixels) {
+                for (int k = 0; k < Packer::kPixels; k++) {
+                    Sampler::template sample<Src>(rows, t, x + k, group[k]);
+                    Ops::apply(group[k], *a.params);
+                }
+                Packer::store(out, group);
+                out += Packer::kBytes;
+            }
+        }
+    }
+}
+
+// Colour-op variants a pipeline can be built with.
+enum ColourOps {
+    COLOUR_NONE,        // No tone or colour correction.
+    COLOUR_LUT,         // Tone curve only.
+    COLOUR_LUT_MATRIX   // Tone curve followed by colour matrix.
+};
+
+enum SamplerKind {
+    SAMPLER_DIRECT,
+    SAMPLER_NEAREST,
+    SAMPLER_BILINEAR
+};
+
+enum SourceFormat {
+    SOURCE_GREY,     // 8-bit IR.
+    SOURCE_RGB24,    // Kinect RGB.
+    SOURCE_DEPTH11,  // 11-bit depth in uint16_t.
+    SOURCE_UYVY      // Kinect raw YUV.
+};
+
+int sourceBytesPerPixel(SourceFormat src) {
+    switch (src) {
+    case SOURCE_GREY:    return 1;
+    case SOURCE_RGB24:   return 3;
+    case SOURCE_DEPTH11:
+    case SOURCE_UYVY:    return 2;
+    }
+    return 0;
+}
+
+// Conversions that need no per-pixel work when no stage is enabled: the source
+// already has the output layout (rows are copied), or only the byte order within
+// each pixel pair differs.
+enum Shortcut {
+    SHORTCUT_NONE,
+    SHORTCUT_COPY,
+    SHORTCUT_SWAP   // UYVY -> YUYV.
+};
+
+Shortcut shortcutFor(SourceFormat src, PixelFormat dst) {
+    if ((src == SOURCE_GREY && dst == PIXFMT_GREY) || (src == SOURCE_RGB24 && dst == PIXFMT_RGB24) ||
+        (src == SOURCE_UYVY && dst == PIXFMT_UYVY))
+        return SHORTCUT_COPY;
+    if (src == SOURCE_UYVY && dst == PIXFMT_YUYV)
+        return SHORTCUT_SWAP;
+    return SHORTCUT_NONE;
+}
+
+// Shortcuts copy the source rectangle starting at column x0[0] (the crop origin).
+template <int kBytes>
+void copyKernel(const KernelArgs& a, size_t row_begin, size_t row_end) {
+    const size_t x_offset = static_cast<size_t>(a.tables->x0[0]) * kBytes;
+    for (size_t y = row_begin; y < row_end; y++) {
+        int spans[2][2];
+        const int span_count = rowSpans(a, y, spans);
+        for (int s = 0; s < span_count; s++) {
+            const size_t begin = static_cast<size_t>(spans[s][0]) * kBytes;
+            std::memcpy(a.dst + y * a.dst_stride + begin, a.src + a.tables->y0[y] * a.src_stride + x_offset + begin,
+                        static_cast<size_t>(spans[s][1] - spans[s][0]) * kBytes);
+        }
+    }
+}
+
+void swapKernel(const KernelArgs& a, size_t row_begin, size_t row_end) {
+    const size_t x_offset = static_cast<size_t>(a.tables->x0[0]) * 2;
+    for (size_t y = row_begin; y < row_end; y++) {
+        int spans[2][2];
+        const int span_count = rowSpans(a, y, spans);
+        for (int sp = 0; sp < span_count; sp++) {
+            const uint8_t* s = a.src + a.tables->y0[y] * a.src_stride + x_offset + spans[sp][0] * 2;
+            uint8_t* d = a.dst + y * a.dst_stride + spans[sp][0] * 2;
+            for (int x = spans[sp][0]; x < spans[sp][1]; x += 2, s += 4, d += 4) {
+                d[0] = s[1]; d[1] = s[0];
+                d[2] = s[3]; d[3] = s[2];
+            }
+        }
+    }
+}
+
+FusedKernelFn shortcutKernel(SourceFormat src, Shortcut shortcut) {
+    if (shortcut == SHORTCUT_SWAP)
+        return &swapKernel;
+    switch (sourceBytesPerPixel(src)) {
+    case 1: return &copyKernel<1>;
+    case 2: return &copyKernel<2>;
+    case 3: return &copyKernel<3>;
+    }
+    return nullptr;
+}
+
+template <class Src, class Sampler, class Packer>
+FusedKernelFn selectKernel(ColourOps ops) {
+    switch (ops) {
+    case COLOUR_NONE:       return &fusedKernel<Src, Sampler, OpChain<>, Packer>;
+    case COLOUR_LUT:        return &fusedKernel<Src, Sampler, OpChain<OpLut>, Packer>;
+    case COLOUR_LUT_MATRIX: return &fusedKernel<Src, Sampler, OpChain<OpLut, OpMatrix, OpClamp>, Packer>;
+    }
+    return nullptr;
+}
+
+template <class Src, class Packer>
+FusedKernelFn selectKernel(SamplerKind sampler, ColourOps ops) {
+    switch (sampler) {
+    case SAMPLER_DIRECT:   return selectKernel<Src, SampleDirect, Packer>(ops);
+    case SAMPLER_NEAREST:  return selectKernel<Src, SampleNearest, Packer>(ops);
+    case SAMPLER_BILINEAR: return selectKernel<Src, SampleBilinear, Packer>(ops);
+    }
+    return nullptr;
+}
+
+template <class Src>
+FusedKernelFn selectKernel(PixelFormat dst, SamplerKind sampler, ColourOps ops) {
+    switch (dst) {
+    case PIXFMT_GREY:  return selectKernel<Src, PackGrey>(sampler, ops);
+    case PIXFMT_RGB24: return selectKernel<Src, PackRGB24>(sampler, ops);
+    case PIXFMT_BGR24: return selectKernel<Src, PackBGR24>(sampler, ops);
+    case PIXFMT_YUYV:  return selectKernel<Src, PackYUYV>(sampler, ops);
+    case PIXFMT_UYVY:  return selectKernel<Src, PackUYVY>(sampler, ops);
+    case PIXFMT_ABGR32:
+    case PIXFMT_BGR32: return selectKernel<Src, PackBGRA>(sampler, ops);
+    }
+    return nullptr;
+}
+
+FusedKernelFn selectKernel(SourceFormat src, PixelFormat dst, SamplerKind sampler, ColourOps ops) {
+    switch (src) {
+    case SOURCE_GREY:    return selectKernel<SrcGrey>(dst, sampler, ops);
+    case SOURCE_RGB24:   return selectKernel<SrcRGB24>(dst, sampler, ops);
+    case SOURCE_DEPTH11: return selectKernel<SrcDepth11>(dst, sampler, ops);
+    case SOURCE_UYVY:    return selectKernel<SrcUYVY>(dst, sampler, ops);
+    }
+    return nullptr;
+}
+
+// Rough cost of a kernel in cycles per output pixel, used to compare conversion
+// paths during format negotiation: memory traffic plus sampling, colour and
+// packing work.
+double kernelCyclesPerPixel(SourceFormat src, PixelFormat dst, SamplerKind sampler, ColourOps ops,
+                            Shortcut shortcut) {
+    double memory = 0.25 * (sourceBytesPerPixel(src) + pixelFormatBytesPerPixel(dst));
+    if (shortcut == SHORTCUT_COPY)
+        return memory;
+    if (shortcut == SHORTCUT_SWAP)
+        return memory + 0.5;
+    double load = src == SOURCE_UYVY ? 4.0 : (src == SOURCE_DEPTH11 ? 3.0 : 1.0);
+    double sample = sampler == SAMPLER_BILINEAR ? 4.0 * load + 6.0
+                  : (sampler == SAMPLER_NEAREST ? load + 1.0 : load);
+    double colour = ops == COLOUR_LUT_MATRIX ? 12.0 : (ops == COLOUR_LUT ? 3.0 : 0.0);
+    double pack = (dst == PIXFMT_YUYV || dst == PIXFMT_UYVY) ? 6.0 : (dst == PIXFMT_GREY ? 3.0 : 1.0);
+    return memory + sample + colour + pack;
+}
+
+// Pipeline configuration shared by every stream.
+struct PipelineConfig {
+    int out_width;
+    int out_height;
+    PixelFormat format;
+    bool mirror;
+    double gamma;       // 1.0 = unchanged.
+    double saturation;  // 1.0 = unchanged.
+};
+
+// Fill tables mapping an output of dst_w x dst_h onto the source rectangle
+// (crop_x, crop_y, crop_w, crop_h) with pixel-centre alignment.
+void buildResampleTables(ResampleTables& t, int crop_x, int crop_y, int crop_w, int crop_h,
+                         int dst_w, int dst_h, bool mirror) {
+    auto axis = [](std::vector<int>& i0, std::vector<int>& i1, std::vector<int>& w,
+                   int origin, int src_len, int dst_len, bool flip) {
+        i0.resize(dst_len);
+        i1.resize(dst_len);
+        w.resize(dst_len);
+        double scale = static_cast<double>(src_len) / dst_len;
+        for (int i = 0; i < dst_len; i++) {
+            int pos = flip ? dst_len - 1 - i : i;
+            double s = (pos + 0.5) * scale - 0.5;
+            if (s < 0.0) s = 0.0;
+            if (s > src_len - 1) s = src_len - 1;
+            int base = static_cast<int>(s);
+            int frac = static_cast<int>((s - base) * 256.0 + 0.5);
+            if (frac == 256) { base++; frac = 0; }
+            i0[i] = origin + base;
+            i1[i] = origin + (base + 1 < src_len ? base + 1 : base);
+            w[i]  = frac;
+        }
+    };
+    axis(t.x0, t.x1, t.wx, crop_x, crop_w, dst_w, mirror);
+    axis(t.y0, t.y1, t.wy, crop_y, crop_h, dst_h, false);
+}
+
+// Converts frames of one source format into the configured sink format with a
+// single fused, row-parallel kernel.
+class FramePipeline {
+public:
+    FramePipeline(SourceFormat src, int src_width, int src_height, const PipelineConfig& cfg)
+        : src_(src), src_width_(src_width), src_height_(src_height), cfg_(cfg),
+          crop_x_(-1), crop_y_(-1), crop_w_(-1), crop_h_(-1), hole_x_(0), hole_y_(0), hole_w_(0), hole_h_(0),
+          serial_(false) {
+        for (int c = 0; c < 3; c++) {
+            for (int v = 0; v < 256; v++) {
+                double n = std::pow(v / 255.0, 1.0 / cfg.gamma);
+                params_.lut[c][v] = static_cast<uint8_t>(n * 255.0 + 0.5);
+            }
+        }
+        // Saturation matrix around BT.601 luma, in 8.8 fixed point.
+        static const double kLuma[3] = { 0.299, 0.587, 0.114 };
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) {
+                double m = (1.0 - cfg.saturation) * kLuma[c] + (r == c ? cfg.saturation : 0.0);
+                params_.matrix[r][c] = static_cast<int>(std::lround(m * 256.0));
+            }
+        }
+        bool colour = (src == SOURCE_RGB24 || src == SOURCE_UYVY) && cfg.saturation != 1.0;
+        ops_ = colour ? COLOUR_LUT_MATRIX : (cfg.gamma != 1.0 ? COLOUR_LUT : COLOUR_NONE);
+        setCrop(0, 0, src_width, src_height);
+    }
+
+    // Restrict the pipeline to a source rectangle, scaled to the full output size.
+    // The coefficient tables are only rebuilt when the rectangle changes.
+    void setCrop(int x, int y, int w, int h) {
+        if (x == crop_x_ && y == crop_y_ && w == crop_w_ && h == crop_h_)
+            return;
+        crop_x_ = x;
+        crop_y_ = y;
+        crop_w_ = w;
+        crop_h_ = h;
+        buildResampleTables(tables_, x, y, w, h, cfg_.out_width, cfg_.out_height, cfg_.mirror);
+        bool same_size = w == cfg_.out_width && h == cfg_.out_height;
+        sampler_ = same_size ? (cfg_.mirror ? SAMPLER_NEAREST : SAMPLER_DIRECT) : SAMPLER_BILINEAR;
+        // Row copies keep UYVY pixel pairs intact only from an even column.
+        bool pairs_aligned = src_ != SOURCE_UYVY || x % 2 == 0;
+        shortcut_ = sampler_ == SAMPLER_DIRECT && ops_ == COLOUR_NONE && pairs_aligned
+                        ? shortcutFor(src_, cfg_.format) : SHORTCUT_NONE;
+        kernel_ = shortcut_ != SHORTCUT_NONE ? shortcutKernel(src_, shortcut_)
+                                             : selectKernel(src_, cfg_.format, sampler_, ops_);
+    }
+
+    // Leave an output rectangle untouched (w = 0 for none), e.g. where a
+    // picture-in-picture inset is drawn from another source, so it is not
+    // rendered twice. x and w must be even for packed 4:2:2 output.
+    void setHole(int x, int y, int w, int h) {
+        hole_x_ = x;
+        hole_y_ = y;
+        hole_w_ = w;
+        hole_h_ = h;
+    }
+
+    // Convert on the calling thread only. The worker pool serves one caller at a
+    // time, the capture loop; pipelines run from other threads must not use it.
+    void setSerial(bool serial) { serial_ = serial; }
+
+    size_t outputSize() const {
+        return static_cast<size_t>(cfg_.out_width) * cfg_.out_height * pixelFormatBytesPerPixel(cfg_.format);
+    }
+
+    size_t inputSize() const {
+        return static_cast<size_t>(src_width_) * src_height_ * sourceBytesPerPixel(src_);
+    }
+
+    // Convert one source frame into dst (outputSize() bytes).
+    void process(const void* src, uint8_t* dst) const {
+        process(src, dst, static_cast<size_t>(cfg_.out_width) * pixelFormatBytesPerPixel(cfg_.format));
+    }
+
+    // Convert one source frame into an output region whose rows are dst_stride bytes apart.
+    void process(const void* src, uint8_t* dst, size_t dst_stride) const {
+        KernelArgs args;
+        args.src = static_cast<const uint8_t*>(src);
+        args.src_stride = static_cast<size_t>(src_width_) * sourceBytesPerPixel(src_);
+        args.dst = dst;
+        args.dst_stride = dst_stride;
+        args.dst_width = cfg_.out_width;
+        args.hole_x  = hole_x_;
+        args.hole_w  = hole_w_;
+        args.hole_y0 = static_cast<size_t>(hole_y_);
+        args.hole_y1 = static_cast<size_t>(hole_y_ + hole_h_);
+        args.tables = &tables_;
+        args.params = &params_;
+        FusedKernelFn kernel = kernel_;
+        ThreadPool::RangeFn rows = [&](size_t begin, size_t end) { kernel(args, begin, end); };
+        if (g_pool && !serial_)
+            g_pool->parallelFor(cfg_.out_height, 16, rows);
+        else
+            rows(0, cfg_.out_height);
+    }
+
+    Shortcut shortcut() const { return shortcut_; }
+
+    // Estimated cycles to convert one frame (see kernelCyclesPerPixel()).
+    double estimatedCycles() const {
+        return kernelCyclesPerPixel(src_, cfg_.format, sampler_, ops_, shortcut_) *
+               cfg_.out_width * cfg_.out_height;
+    }
+
+    std::string describe() const {
+        static const char* kSources[]  = { "grey", "rgb24", "depth11", "uyvy" };
+        static const char* kSamplers[] = { "direct", "nearest", "bilinear" };
+        static const char* kOps[]      = { "none", "lut", "lut+matrix+clamp" };
+        std::string s = kSources[src_];
+        s += " -> ";
+        if (shortcut_ != SHORTCUT_NONE) {
+            s += shortcut_ == SHORTCUT_COPY ? "copy" : "byte swap";
+            s += " -> ";
+            s += pixelFormatName(cfg_.format);
+            return s;
+        }
+        s += kSamplers[sampler_];
+        s += cfg_.mirror ? " (mirrored)" : "";
+        s += " -> ";
+        s += kOps[ops_];
+        s += " -> ";
+        s += pixelFormatName(cfg_.format);
+        return s;
+    }
+
+private:
+    SourceFormat src_;
+    int src_width_;
+    int src_height_;
+    PipelineConfig cfg_;
+    int crop_x_, crop_y_, crop_w_, crop_h_;
+    int hole_x_, hole_y_, hole_w_, hole_h_;  // Output rectangle not rendered (setHole()).
+    bool serial_;                            // Never use g_pool (setSerial()).
+    PipelineParams params_;
+    ResampleTables tables_;
+    SamplerKind sampler_;
+    ColourOps ops_;
+    Shortcut shortcut_;
+    FusedKernelFn kernel_;
+};
+
+// --- Depth-Based Auto-Framing ---
+//
+// Tracks the nearest person-sized blob in the depth frame and eases a crop window
+// over the video frame towards it. Tracking runs on a 4x downsampled depth level
+// (160x120 for VGA); the crop is applied through FramePipeline::setCrop, which only
+// rebuilds the resampler's coefficient tables when the rounded window changes.
+class AutoFramer {
+public:
+    AutoFramer(int src_width, int src_height, int out_width, int out_height)
+        : src_w_(src_width), src_h_(src_height),
+          low_w_(src_width / kScale), low_h_(src_height / kScale),
+          aspect_(static_cast<double>(out_width) / out_height),
+          lost_frames_(0) {
+        low_.resize(static_cast<size_t>(low_w_) * low_h_);
+        visited_.resize(low_.size());
+        fullFrame(target_);
+        current_ = target_;
+    }
+
+    // Feed one 11-bit depth frame (src_width x src_height).
+    void update(const uint16_t* depth) {
+        downsample(depth);
+        Window found;
+        if (findSubject(found)) {
+            lost_frames_ = 0;
+            // Ignore small changes so the crop does not hunt.
+            double moved = std::fabs(found.cx - target_.cx) + std::fabs(found.cy - target_.cy);
+            if (moved > 0.05 * target_.h || std::fabs(found.h - target_.h) > 0.08 * target_.h)
+                target_ = found;
+        } else if (++lost_frames_ > kLostFrames) {
+            fullFrame(target_);
+        }
+        current_.cx += (target_.cx - current_.cx) * kEase;
+        current_.cy += (target_.cy - current_.cy) * kEase;
+        current_.h  += (target_.h - current_.h) * kEase;
+    }
+
+    // Current crop rectangle in source pixels, clamped to the frame.
+    void crop(int& x, int& y, int& w, int& h) const {
+        double ch = current_.h;
+        double cw = ch * aspect_;
+        if (cw > src_w_) { cw = src_w_; ch = cw / aspect_; }
+        if (ch > src_h_) { ch = src_h_; cw = ch * aspect_; }
+        double left = current_.cx - cw * 0.5, top = current_.cy - ch * 0.5;
+        left = std::max(0.0, std::min(left, src_w_ - cw));
+        top  = std::max(0.0, std::min(top, src_h_ - ch));
+        // Round to even pixels so sub-pixel easing does not rebuild tables every frame.
+        x = static_cast<int>(left) & ~1;
+        y = static_cast<int>(top) & ~1;
+        w = static_cast<int>(cw) & ~1;
+        h = static_cast<int>(ch) & ~1;
+    }
+
+private:
+    struct Window {
+        double cx, cy, h;  // Centre and height in source pixels.
+    };
+
+    static const int kScale = 4;
+    static const int kMinRaw = 400;      // ~0.5 m; nearer readings are treated as noise.
+    static const int kMaxRaw = 1000;     // ~3.8 m; farther subjects are not framed.
+    static const int kNeighbourTol = 12; // Raw step allowed between neighbouring blob pixels.
+    static const int kBlobDepth = 120;   // Maximum raw depth extent of a blob.
+    static const int kMinBlobArea = 150; // Low-res pixels.
+    static const int kLostFrames = 60;   // Frames without a subject before zooming out.
+    static constexpr double kEase = 0.12;
+
+    void fullFrame(Window& w) const {
+        w.cx = src_w_ * 0.5;
+        w.cy = src_h_ * 0.5;
+        w.h  = src_h_;
+    }
+
+    // Nearest valid reading of each kScale x kScale block.
+    void downsample(const uint16_t* depth) {
+        for (int ly = 0; ly < low_h_; ly++) {
+            for (int lx = 0; lx < low_w_; lx++) {
+                uint16_t best = 2047;
+                for (int dy = 0; dy < kScale; dy++) {
+                    const uint16_t* row = depth + static_cast<size_t>(ly * kScale + dy) * src_w_ + lx * kScale;
+                    for (int dx = 0; dx < kScale; dx++) {
+                        uint16_t d = row[dx];
+                        if (d >= kMinRaw && d < best)
+                            best = d;
+                    }
+                }
+                low_[static_cast<size_t>(ly) * low_w_ + lx] = best;
+            }
+        }
+    }
+
+    bool findSubject(Window& out) {
+        // Seed at the nearest depth that is backed by more than a few pixels.
+        static const int kBin = 8;
+        int hist[(kMaxRaw - kMinRaw) / kBin + 1] = { 0 };
+        for (uint16_t d : low_)
+            if (d <= kMaxRaw)
+                hist[(d - kMinRaw) / kBin]++;
+        int seed_depth = -1;
+        for (int b = 0, total = 0; b <= (kMaxRaw - kMinRaw) / kBin; b++) {
+            total += hist[b];
+            if (total >= 40) {
+                seed_depth = kMinRaw + (b + 1) * kBin;
+                break;
+            }
+        }
+        if (seed_depth < 0)
+            return false;
+        // seed_depth is the exclusive end of the bin that reached the count, so
+        // every pixel below it was counted; seed at the nearest of them.
+        size_t seed = low_.size();
+        for (size_t i = 0; i < low_.size(); i++) {
+            if (low_[i] < seed_depth && (seed == low_.size() || low_[i] < low_[seed]))
+                seed = i;
+        }
+        if (seed == low_.size())
+            return false;
+
+        // Grow the blob from the seed over smoothly connected depth.
+        std::fill(visited_.begin(), visited_.end(), 0);
+        stack_.clear();
+        stack_.push_back(static_cast<int>(seed));
+        visited_[seed] = 1;
+        int limit = low_[seed] + kBlobDepth;
+        int min_x = low_w_, max_x = -1, min_y = low_h_, max_y = -1, area = 0;
+        while (!stack_.empty()) {
+            int i = stack_.back();
+            stack_.pop_back();
+            int x = i % low_w_, y = i / low_w_;
+            area++;
+            min_x = std::min(min_x, x); max_x = std::max(max_x, x);
+            min_y = std::min(min_y, y); max_y = std::max(max_y, y);
+            const int nx[4] = { x - 1, x + 1, x, x };
+            const int ny[4] = { y, y, y - 1, y + 1 };
+            for (int k = 0; k < 4; k++) {
+                if (nx[k] < 0 || ny[k] < 0 || nx[k] >= low_w_ || ny[k] >= low_h_)
+                    continue;
+                int j = ny[k] * low_w_ + nx[k];
+                if (visited_[j] || low_[j] > limit || std::abs(low_[j] - low_[i]) > kNeighbourTol)
+                    continue;
+                visited_[j] = 1;
+                stack_.push_back(j);
+            }
+        }
+        if (area < kMinBlobArea)
+            return false;
+
+        // Frame the upper body: keep the top of the blob (the head) in view with headroom.
+        double blob_w = (max_x - min_x + 1) * kScale;
+        double blob_h = (max_y - min_y + 1) * kScale;
+        double h = std::max(blob_h * 1.2, blob_w * 1.4 / aspect_);
+        h = std::max(h, src_h_ / 3.0);
+        h = std::min(h, static_cast<double>(src_h_));
+        out.cx = (min_x + max_x + 1) * 0.5 * kScale;
+        out.cy = min_y * kScale - 0.1 * h + h * 0.5;
+        out.h  = h;
+        return true;
+    }
+
+    int src_w_, src_h_;
+    int low_w_, low_h_;
+    double aspect_;
+    std::vector<uint16_t> low_;
+    std::vector<uint8_t> visited_;
+    std::vector<int> stack_;
+    Window target_;
+    Window current_;
+    int lost_frames_;
+};
+
+// --- Composite Layouts ---
+//
+// Video and depth rendered into one sink frame. Each source's pipeline is built
+// for its region's size and writes straight into that region of the sink buffer
+// (using the sink's row stride), so no intermediate full-frame buffers are needed.
+struct Region {
+    int x, y, w, h;
+};
+
+// Split a width x height frame into video and depth regions. Offsets and widths are
+// kept even so packed 4:2:2 pixel pairs never straddle a region edge.
+void compositeRegions(CompositeLayout layout, int width, int height, Region& video, Region& depth) {
+    switch (layout) {
+    case COMPOSITE_SIDE_BY_SIDE: {
+        int half = (width / 2) & ~1;
+        video = Region{ 0, 0, half, height };
+        depth = Region{ half, 0, width - half, height };
+        break;
+    }
+    case COMPOSITE_TOP_BOTTOM: {
+        int half = height / 2;
+        video = Region{ 0, 0, width, half };
+        depth = Region{ 0, half, width, height - half };
+        break;
+    }
+    case COMPOSITE_PIP: {
+        int w = (width / 3) & ~1, h = height / 3;
+        int margin = std::min(16, std::min(width, height) / 32) & ~1;
+        video = Region{ 0, 0, width, height };
+        depth = Region{ (width - w - margin) & ~1, height - h - margin, w, h };
+        break;
+    }
+    case COMPOSITE_NONE:
+        video = depth = Region{ 0, 0, width, height };
+        break;
+    }
+}
+
+// Address of a region's top-left pixel inside a sink frame.
+uint8_t* regionOrigin(uint8_t* frame, const Region& r, int frame_width, PixelFormat fmt) {
+    size_t bpp = pixelFormatBytesPerPixel(fmt);
+    return frame + (static_cast<size_t>(r.y) * frame_width + r.x) * bpp;
+}
+
+// --- RGB + Depth Alpha Packing ---
+//
+// Writes Kinect RGB and registered depth (millimetres, aligned to the RGB image)
+// into one 32-bit B, G, R, A frame in a single pass. Depth is mapped so that the
+// near limit is 255 and the far limit is 1; pixels without a reading get 0.
+struct DepthAlphaRange {
+    int near_mm;
+    int far_mm;
+};
+
+// 0.16 fixed-point factor mapping [0, far - near] to [0, 255] (rounded up so the
+// near limit reaches 255); the range must be at least 256 mm to fit in 16 bits.
+inline uint32_t depthAlphaScale(const DepthAlphaRange& range) {
+    uint32_t span = static_cast<uint32_t>(range.far_mm - range.near_mm);
+    return (255u * 65536u + span - 1) / span;
+}
+
+// |scale| is depthAlphaScale(range), computed once by the caller.
+inline uint8_t depthToAlpha(uint16_t d, const DepthAlphaRange& range, uint32_t scale) {
+    if (d == 0)
+        return 0;
+    int t = range.far_mm - std::max(static_cast<int>(d), range.near_mm);
+    if (t < 0)
+        t = 0;
+    uint32_t a = (static_cast<uint32_t>(t) * scale) >> 16;
+    return static_cast<uint8_t>(a < 1 ? 1 : a);
+}
+
+static void packRgbDepthScalar(const uint8_t* rgb, const uint16_t* depth, uint8_t* dst,
+                               size_t pixels, const DepthAlphaRange& range) {
+    const uint32_t scale = depthAlphaScale(range);
+    for (size_t i = 0; i < pixels; i++) {
+        dst[i * 4 + 0] = rgb[i * 3 + 2];
+        dst[i * 4 + 1] = rgb[i * 3 + 1];
+        dst[i * 4 + 2] = rgb[i * 3 + 0];
+        dst[i * 4 + 3] = depthToAlpha(depth[i], range, scale);
+    }
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_SSSE3_PACK 1
+// 16 pixels per iteration: RGB triplets are split into four groups of four with
+// palignr, swizzled to B, G, R with pshufb, and the alpha bytes are shuffled into
+// every fourth lane.
+__attribute__((target("ssse3")))
+static void packRgbDepthSSSE3(const uint8_t* rgb, const uint16_t* depth, uint8_t* dst,
+                              size_t pixels, const DepthAlphaRange& range) {
+    const __m128i swizzle = _mm_setr_epi8(2, 1, 0, -128, 5, 4, 3, -128, 8, 7, 6, -128, 11, 10, 9, -128);
+    const __m128i alpha_lanes[4] = {
+        _mm_setr_epi8(-128, -128, -128, 0, -128, -128, -128, 1, -128, -128, -128, 2, -128, -128, -128, 3),
+        _mm_setr_epi8(-128, -128, -128, 4, -128, -128, -128, 5, -128, -128, -128, 6, -128, -128, -128, 7),
+        _mm_setr_epi8(-128, -128, -128, 8, -128, -128, -128, 9, -128, -128, -128, 10, -128, -128, -128, 11),
+        _mm_setr_epi8(-128, -128, -128, 12, -128, -128, -128, 13, -128, -128, -128, 14, -128, -128, -128, 15),
+    };
+    const __m128i far    = _mm_set1_epi16(static_cast<short>(range.far_mm));
+    const __m128i span   = _mm_set1_epi16(static_cast<short>(range.far_mm - range.near_mm));
+    const __m128i scale  = _mm_set1_epi16(static_cast<short>(depthAlphaScale(range)));
+    const __m128i zero   = _mm_setzero_si128();
+    const __m128i one    = _mm_set1_epi16(1);
+
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        // Alpha: min(far - d, span) * 255 / span, at least 1, 0 where there is no reading.
+        __m128i alpha16[2];
+        for (int h = 0; h < 2; h++) {
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + i + h * 8));
+            __m128i t = _mm_subs_epu16(far, d);
+            t = _mm_sub_epi16(t, _mm_subs_epu16(t, span));
+            __m128i a = _mm_mulhi_epu16(t, scale);
+            a = _mm_max_epi16(a, one);
+            alpha16[h] = _mm_andnot_si128(_mm_cmpeq_epi16(d, zero), a);
+        }
+        __m128i alpha = _mm_packus_epi16(alpha16[0], alpha16[1]);
+
+        const __m128i* src = reinterpret_cast<const __m128i*>(rgb + i * 3);
+        __m128i v0 = _mm_loadu_si128(src);
+        __m128i v1 = _mm_loadu_si128(src + 1);
+        __m128i v2 = _mm_loadu_si128(src + 2);
+        __m128i groups[4] = {
+            v0,
+            _mm_alignr_epi8(v1, v0, 12),
+            _mm_alignr_epi8(v2, v1, 8),
+            _mm_srli_si128(v2, 4),
+        };
+        __m128i* out = reinterpret_cast<__m128i*>(dst + i * 4);
+        for (int g = 0; g < 4; g++) {
+            __m128i px = _mm_or_si128(_mm_shuffle_epi8(groups[g], swizzle),
+                                      _mm_shuffle_epi8(alpha, alpha_lanes[g]));
+            _mm_storeu_si128(out + g, px);
+        }
+    }
+    packRgbDepthScalar(rgb + i * 3, depth + i, dst + i * 4, pixels - i, range);
+}
+#endif
+
+// Pack width x height RGB24 + registered depth into B, G, R, A rows (row-parallel).
+void packRgbDepth(const uint8_t* rgb, const uint16_t* depth, uint8_t* dst,
+                  int width, int height, const DepthAlphaRange& range) {
+    typedef void (*PackFn)(const uint8_t*, const uint16_t*, uint8_t*, size_t, const DepthAlphaRange&);
+    PackFn pack = packRgbDepthScalar;
+#ifdef HAVE_SSSE3_PACK
+    static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+    if (has_ssse3)
+        pack = packRgbDepthSSSE3;
+#endif
+    ThreadPool::RangeFn rows = [&](size_t begin, size_t end) {
+        size_t offset = begin * width;
+        pack(rgb + offset * 3, depth + offset, dst + offset * 4, (end - begin) * width, range);
+    };
+    if (g_pool)
+        g_pool->parallelFor(height, 16, rows);
+    else
+        rows(0, height);
+}
+
+// --- Capture Sources ---
+//
+// Where frames come from. The live Kinect, the synthetic source and recording
+// replay implement the same interface and deliver frames through VideoCallback
+// and DepthCallback, so everything downstream is identical for all of them.
+class CaptureSource {
+public:
+    virtual ~CaptureSource() {}
+
+    // Name used in log messages.
+    virtual const char* name() const = 0;
+    // Connect to the device. Failure is reported here and retried by the caller.
+    virtual bool open() = 0;
+    // Start the video stream in format; frames arrive through VideoCallback.
+    virtual bool startVideo(freenect_video_format format) = 0;
+    virtual void stopVideo() = 0;
+    // Start the depth stream in format; frames arrive through DepthCallback.
+    virtual bool startDepth(freenect_depth_format format) = 0;
+    virtual void stopDepth() = 0;
+    // Deliver pending frames. Negative on disconnect or error.
+    virtual int processEvents() = 0;
+    // Stop any running streams and disconnect.
+    virtual void close() = 0;
+    // True when processEvents() can return without waiting for a frame, so the
+    // capture loop should pause briefly between calls.
+    virtual bool needsIdleWait() const { return true; }
+    // Highest rate video is delivered at in format (640x480), 0 if unsupported.
+    // The Kinect sends raw YUV at only 15 fps.
+    virtual int maxVideoRate(freenect_video_format format) const {
+        switch (format) {
+        case FREENECT_VIDEO_RGB:
+        case FREENECT_VIDEO_IR_8BIT:  return 30;
+        case FREENECT_VIDEO_YUV_RAW:  return 15;
+        default:                      return 0;
+        }
+    }
+
+    // Restart the running video stream in another format. The video callback
+    // stays installed and the sinks are not touched.
+    bool restartVideo(freenect_video_format format) {
+        stopVideo();
+        if (!startVideo(format)) {
+            std::cerr << "Could not restart video stream in the new mode." << std::endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+// The first Kinect found by libfreenect.
+class KinectSource : public CaptureSource {
+public:
+    KinectSource() : ctx_(nullptr), dev_(nullptr), video_on_(false), depth_on_(false) {}
+    ~KinectSource() override { close(); }
+
+    const char* name() const override { return "Kinect"; }
+
+    bool open() override {
+        if (freenect_init(&ctx_, nullptr) < 0) {
+            std::cerr << "freenect_init() failed. No Kinect found. Retrying in 5 seconds..." << std::endl;
+            ctx_ = nullptr;
+            return false;
+        }
+        if (freenect_open_device(ctx_, &dev_, 0) < 0) {
+            std::cerr << "Could not open Kinect device. Retrying in 5 seconds..." << std::endl;
+            freenect_shutdown(ctx_);
+            ctx_ = nullptr;
+            dev_ = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    bool startVideo(freenect_video_format format) override {
+        freenect_set_video_callback(dev_, VideoCallback);
+        freenect_frame_mode mode = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, format);
+        if (freenect_set_video_mode(dev_, mode) < 0) {
+            std::cerr << "Could not set video mode." << std::endl;
+            return false;
+        }
+        if (freenect_start_video(dev_) < 0)
+            return false;
+        video_on_ = true;
+        return true;
+    }
+
+    void stopVideo() override {
+        if (video_on_)
+            freenect_stop_video(dev_);
+        video_on_ = false;
+    }
+
+    bool startDepth(freenect_depth_format format) override {
+        freenect_set_depth_callback(dev_, DepthCallback);
+        freenect_frame_mode mode = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, format);
+        if (freenect_set_depth_mode(dev_, mode) < 0) {
+            std::cerr << "Could not set depth mode." << std::endl;
+            return false;
+        }
+        if (freenect_start_depth(dev_) < 0)
+            return false;
+        depth_on_ = true;
+        return true;
+    }
+
+    void stopDepth() override {
+        if (depth_on_)
+            freenect_stop_depth(dev_);
+        depth_on_ = false;
+    }
+
+    int processEvents() override {
+        return freenect_process_events(ctx_);
+    }
+
+    void close() override {
+        if (!ctx_)
+            return;
+        stopVideo();
+        stopDepth();
+        freenect_close_device(dev_);
+        freenect_shutdown(ctx_);
+        ctx_ = nullptr;
+        dev_ = nullptr;
+    }
+
+private:
+    freenect_context* ctx_;
+    freenect_device* dev_;
+    bool video_on_;
+    bool depth_on_;
+};
+
+// Deterministic frames for running and benchmarking without hardware. RGB shows
+// scrolling colour bars over a grey ramp with a bouncing square, IR a moving
+// texture, and depth a tilted background with a person-sized blob sweeping
+// across it, an invalid band along the left edge (like the Kinect's shadow) and
+// an invalid patch. Every frame is a pure function of its frame number.
+//
+// Frames are delivered at fps (0 = as fast as the pipeline consumes them). Like
+// the Kinect, the source can also send raw YUV (the RGB image converted to UYVY),
+// at no more than 15 fps. With disconnect_s set, the source reports a disconnect
+// that many seconds after each open, exercising the reconnect path.
+class SyntheticSource : public CaptureSource {
+public:
+    SyntheticSource(int fps, int disconnect_s)
+        : fps_(fps), disconnect_s_(disconnect_s), video_on_(false), depth_on_(false),
+          video_format_(FREENECT_VIDEO_RGB), depth_format_(FREENECT_DEPTH_11BIT),
+          video_frame_(0), depth_frame_(0) {}
+
+    const char* name() const override { return "Synthetic source"; }
+
+    bool open() override {
+        opened_ = std::chrono::steady_clock::now();
+        std::cout << "Synthetic source: " << (fps_ > 0 ? std::to_string(fps_) + " fps" : std::string("unthrottled"));
+        if (disconnect_s_ > 0)
+            std::cout << ", disconnect every " << disconnect_s_ << " s";
+        std::cout << "." << std::endl;
+        return true;
+    }
+
+    bool startVideo(freenect_video_format format) override {
+        if (format != FREENECT_VIDEO_RGB && format != FREENECT_VIDEO_IR_8BIT && format != FREENECT_VIDEO_YUV_RAW)
+            return false;
+        video_format_ = format;
+        const int bytes = format == FREENECT_VIDEO_RGB ? 3 : (format == FREENECT_VIDEO_YUV_RAW ? 2 : 1);
+        video_.resize(static_cast<size_t>(WIDTH) * HEIGHT * bytes);
+        next_video_ = std::chrono::steady_clock::now();
+        video_on_ = true;
+        return true;
+    }
+
+    void stopVideo() override { video_on_ = false; }
+
+    bool startDepth(freenect_depth_format format) override {
+        if (format != FREENECT_DEPTH_11BIT && format != FREENECT_DEPTH_REGISTERED)
+            return false;
+        depth_format_ = format;
+        depth_.resize(static_cast<size_t>(WIDTH) * HEIGHT);
+        next_depth_ = std::chrono::steady_clock::now();
+        depth_on_ = true;
+        return true;
+    }
+
+    void stopDepth() override { depth_on_ = false; }
+
+    int processEvents() override {
+        auto now = std::chrono::steady_clock::now();
+        if (disconnect_s_ > 0 && now - opened_ >= std::chrono::seconds(disconnect_s_))
+            return -1;
+        if (!video_on_ && !depth_on_) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            return 0;
+        }
+        if (fps_ > 0) {
+            // Sleep until the next frame of either stream is due.
+            auto next = video_on_ ? next_video_ : next_depth_;
+            if (depth_on_ && next_depth_ < next)
+                next = next_depth_;
+            std::this_thread::sleep_until(next);
+            now = std::chrono::steady_clock::now();
+        }
+        const std::chrono::nanoseconds period(fps_ > 0 ? 1000000000LL / fps_ : 0);
+        if (video_on_ && now >= next_video_) {
+            const int rate = fps_ > 0 ? std::min(fps_, maxVideoRate(video_format_)) : 0;
+            const std::chrono::nanoseconds video_period(rate > 0 ? 1000000000LL / rate : 0);
+            if (video_format_ == FREENECT_VIDEO_RGB) {
+                renderRgb(video_frame_, video_.data());
+            } else if (video_format_ == FREENECT_VIDEO_YUV_RAW) {
+                rgb_.resize(static_cast<size_t>(WIDTH) * HEIGHT * 3);
+                renderRgb(video_frame_, rgb_.data());
+                rgbToUyvy(rgb_.data(), video_.data());
+            } else {
+                renderIr(video_frame_);
+            }
+            VideoCallback(nullptr, video_.data(), timestamp(video_frame_++));
+            next_video_ = std::max(next_video_ + video_period, now - video_period);
+        }
+        if (depth_on_ && now >= next_depth_) {
+            renderDepth(depth_frame_);
+            DepthCallback(nullptr, depth_.data(), timestamp(depth_frame_++));
+            next_depth_ = std::max(next_depth_ + period, now - period);
+        }
+        return 0;
+    }
+
+    void close() override {
+        video_on_ = false;
+        depth_on_ = false;
+    }
+
+    bool needsIdleWait() const override { return false; }
+
+private:
+    // Kinect-like timestamp (60 MHz clock at 30 fps).
+    static uint32_t timestamp(uint64_t frame) {
+        return static_cast<uint32_t>(frame * 2000000u);
+    }
+
+    // Triangle wave over [0, span] with the given period in frames.
+    static int sweep(uint64_t frame, int period, int span) {
+        int t = static_cast<int>(frame % period);
+        int half = period / 2;
+        return (t < half ? t : period - t) * span / half;
+    }
+
+    // Rows are built once per band and copied, so rendering stays cheap enough
+    // for unthrottled benchmarking.
+    void renderRgb(uint64_t n, uint8_t* out) {
+        static const uint8_t kBars[8][3] = {
+            {255, 255, 255}, {255, 255, 0}, {0, 255, 255}, {0, 255, 0},
+            {255, 0, 255}, {255, 0, 0}, {0, 0, 255}, {0, 0, 0}
+        };
+        const size_t stride = static_cast<size_t>(WIDTH) * 3;
+        const int bar_w = WIDTH / 8;
+        const int split = HEIGHT * 2 / 3;
+        uint8_t* bars = out;
+        uint8_t* ramp = out + split * stride;
+        for (int x = 0; x < WIDTH; x++) {
+            std::memcpy(bars + x * 3, kBars[((x + n * 4) / bar_w) % 8], 3);
+            ramp[x * 3] = ramp[x * 3 + 1] = ramp[x * 3 + 2] = static_cast<uint8_t>(x * 255 / (WIDTH - 1));
+        }
+        for (int y = 1; y < HEIGHT; y++) {
+            if (y != split)
+                std::memcpy(out + y * stride, y < split ? bars : ramp, stride);
+        }
+        const int sq = 48;
+        const int sq_x = sweep(n, 120, WIDTH - sq);
+        const int sq_y = sweep(n, 90, HEIGHT - sq);
+        for (int y = sq_y; y < sq_y + sq; y++)
+            std::memset(out + y * stride + sq_x * 3, 255, sq * 3);
+    }
+
+    static void rgbToUyvy(const uint8_t* rgb, uint8_t* uyvy) {
+        for (size_t i = 0; i < static_cast<size_t>(WIDTH) * HEIGHT; i += 2, rgb += 6, uyvy += 4) {
+            Px a = { { rgb[0], rgb[1], rgb[2] } };
+            Px b = { { rgb[3], rgb[4], rgb[5] } };
+            int y0, y1, u, v;
+            yuvOf(a, b, y0, y1, u, v);
+            uyvy[0] = static_cast<uint8_t>(u);
+            uyvy[1] = static_cast<uint8_t>(y0);
+            uyvy[2] = static_cast<uint8_t>(v);
+            uyvy[3] = static_cast<uint8_t>(y1);
+        }
+    }
+
+    void renderIr(uint64_t n) {
+        const int shift = static_cast<int>(n * 2);
+        for (int y = 0; y < HEIGHT; y++) {
+            uint8_t* row = video_.data() + static_cast<size_t>(y) * WIDTH;
+            const int base = y * 160 / HEIGHT;
+            for (int x = 0; x < WIDTH; x++)
+                row[x] = static_cast<uint8_t>((((x + shift) ^ y) & 0x3F) + base);
+        }
+    }
+
+    void renderDepth(uint64_t n) {
+        const bool registered = depth_format_ == FREENECT_DEPTH_REGISTERED;
+        const uint16_t invalid = registered ? 0 : 2047;
+        const uint16_t near = registered ? 1500 : 700;
+        const int cx = WIDTH / 4 + sweep(n, 300, WIDTH / 2);
+        const int cy = HEIGHT / 2;
+        const int rx = WIDTH / 10, ry = HEIGHT / 3;
+        for (int y = 0; y < HEIGHT; y++) {
+            uint16_t* row = depth_.data() + static_cast<size_t>(y) * WIDTH;
+            std::fill(row, row + WIDTH, registered ? static_cast<uint16_t>(4000 - y * 4)
+                                                   : static_cast<uint16_t>(1000 - y / 4));
+            // Horizontal extent of the person ellipse on this row.
+            int dy = y - cy;
+            if (dy > -ry && dy < ry) {
+                int half = static_cast<int>(rx * std::sqrt(1.0 - static_cast<double>(dy * dy) / (ry * ry)));
+                int x0 = std::max(0, cx - half), x1 = std::min(WIDTH, cx + half + 1);
+                std::fill(row + x0, row + x1, near);
+            }
+            std::fill(row, row + 8, invalid);
+            if (y >= 40 && y < 80)
+                std::fill(row + WIDTH - 120, row + WIDTH - 60, invalid);
+        }
+    }
+
+    int fps_;
+    int disconnect_s_;
+    bool video_on_;
+    bool depth_on_;
+    freenect_video_format video_format_;
+    freenect_depth_format depth_format_;
+    uint64_t video_frame_;
+    uint64_t depth_frame_;
+    std::chrono::steady_clock::time_point opened_;
+    std::chrono::steady_clock::time_point next_video_;
+    std::chrono::steady_clock::time_point next_depth_;
+    std::vector<uint8_t> video_;
+    std::vector<uint8_t> rgb_;  // RGB image converted for raw YUV.
+    std::vector<uint16_t> depth_;
+};
+
+#ifdef __linux__
+// Plays a --record recording (kinect_rec.h) back through VideoCallback and
+// DepthCallback. The chunk files are mapped read-only and frames are handed to
+// the callbacks straight from the mapping, in the order they were captured.
+// Video is taken from the rgb or ir stream depending on the mode the capture loop
+// asks for, so day/night switching and IR/RGB alternation can be replayed too.
+// Chunks whose recording was cut short (no index) are read by walking their
+// frame records.
+//
+// At the end of the recording playback starts over with loop set; otherwise the
+// program stops.
+class ReplaySource : public CaptureSource {
+public:
+    ReplaySource(const std::string& dir, ReplayMode mode, bool loop)
+        : dir_(dir), mode_(mode), loop_(loop), video_stream_(-1), depth_stream_(-1),
+          delivered_(0), started_(false), prompted_(false), start_ns_(0), playhead_ns_(0) {}
+
+    ~ReplaySource() override {
+        for (const Mapping& m : mappings_)
+            munmap(m.base, m.size);
+    }
+
+    const char* name() const override { return "Replay"; }
+
+    // Map every chunk of every stream and collect its frames. Called once, before
+    // the first open().
+    bool load() {
+        for (uint32_t stream = 0; stream < KREC_STREAM_COUNT; stream++) {
+            for (unsigned chunk = 0;; chunk++) {
+                char name[32];
+                std::snprintf(name, sizeof(name), "/%s-%04u.krec", krec_stream_name(stream), chunk);
+                std::string path = dir_ + name;
+                int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                    if (errno != ENOENT)
+                        perror(("Opening recording (" + path + ")").c_str());
+                    break;
+                }
+                bool ok = loadChunk(fd, path, stream);
+                ::close(fd);
+                if (!ok)
+                    return false;
+            }
+        }
+        size_t total = 0;
+        std::cout << "Replaying " << dir_ << " (" << replayModeName() << (loop_ ? ", looped" : "") << "):";
+        for (uint32_t stream = 0; stream < KREC_STREAM_COUNT; stream++) {
+            const Stream& s = streams_[stream];
+            if (s.frames.empty())
+                continue;
+            total += s.frames.size();
+            std::cout << " " << krec_stream_name(stream) << " " << s.frames.size() << " frames ("
+                      << (s.frames.back().capture_ns - s.frames.front().capture_ns) / 1e9 << " s)";
+        }
+        std::cout << "." << std::endl;
+        if (total == 0) {
+            std::cerr << "Error: No recorded frames found in " << dir_ << "." << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool open() override {
+        rewind();
+        video_stream_ = depth_stream_ = -1;
+        return true;
+    }
+
+    bool startVideo(freenect_video_format format) override {
+        uint32_t stream = format == FREENECT_VIDEO_RGB ? KREC_STREAM_RGB : KREC_STREAM_IR;
+        if ((format != FREENECT_VIDEO_RGB && format != FREENECT_VIDEO_IR_8BIT) || streams_[stream].frames.empty()) {
+            std::cerr << "Error: The recording has no " << krec_stream_name(stream) << " stream." << std::endl;
+            stop_requested = 1;  // Retrying cannot help.
+            return false;
+        }
+        video_stream_ = static_cast<int>(stream);
+        // Resume where playback is, e.g. after a switch between RGB and IR.
+        skipTo(streams_[stream], playhead_ns_);
+        return true;
+    }
+
+    // Recordings hold RGB and IR frames only.
+    int maxVideoRate(freenect_video_format format) const override {
+        return format == FREENECT_VIDEO_YUV_RAW ? 0 : CaptureSource::maxVideoRate(format);
+    }
+
+    void stopVideo() override { video_stream_ = -1; }
+
+    bool startDepth(freenect_depth_format format) override {
+        uint32_t wanted = format == FREENECT_DEPTH_REGISTERED ? KREC_FORMAT_DEPTH_MM : KREC_FORMAT_DEPTH11;
+        Stream& s = streams_[KREC_STREAM_DEPTH];
+        if (s.frames.empty() || s.format != wanted) {
+            std::cerr << "Error: The recording has no " << (wanted == KREC_FORMAT_DEPTH_MM ? "registered" : "11-bit")
+                      << " depth stream." << std::endl;
+            stop_requested = 1;
+            return false;
+        }
+        depth_stream_ = KREC_STREAM_DEPTH;
+        skipTo(s, playhead_ns_);
+        return true;
+    }
+
+    void stopDepth() override { depth_stream_ = -1; }
+
+    int processEvents() override {
+        Stream* s = nextStream();
+        if (!s) {
+            if (video_stream_ < 0 && depth_stream_ < 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                return 0;
+            }
+            finished();
+            if (!loop_) {
+                stop_requested = 1;
+                return 0;
+            }
+            rewind();
+            return 0;
+        }
+        const Frame& f = s->frames[s->next];
+        if (!started_) {
+            started_ = true;
+            start_ns_ = f.capture_ns;
+            start_time_ = std::chrono::steady_clock::now();
+            delivered_ = 0;
+        }
+        if (mode_ == REPLAY_REALTIME) {
+            std::this_thread::sleep_until(start_time_ + std::chrono::nanoseconds(f.capture_ns - start_ns_));
+        } else if (mode_ == REPLAY_STEP) {
+            if (!waitForStep(*s, f))
+                return 0;
+        }
+        playhead_ns_ = f.capture_ns;
+        ++s->next;
+        ++delivered_;
+        if (s == &streams_[KREC_STREAM_DEPTH])
+            DepthCallback(nullptr, const_cast<uint8_t*>(f.data), f.kinect_timestamp);
+        else
+            VideoCallback(nullptr, const_cast<uint8_t*>(f.data), f.kinect_timestamp);
+        return 0;
+    }
+
+    void close() override {
+        video_stream_ = depth_stream_ = -1;
+    }
+
+    bool needsIdleWait() const override { return false; }
+
+private:
+    struct Frame {
+        const uint8_t* data;
+        uint64_t capture_ns;
+        uint32_t kinect_timestamp;
+    };
+
+    struct Stream {
+        uint32_t format = 0;
+        std::vector<Frame> frames;
+        size_t next = 0;
+    };
+
+    struct Mapping {
+        void* base;
+        size_t size;
+    };
+
+    bool loadChunk(int fd, const std::string& path, uint32_t stream) {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(krec_chunk_header)) {
+            std::cerr << "Error: " << path << " is not a recording chunk." << std::endl;
+            return false;
+        }
+        const size_t size = static_cast<size_t>(st.st_size);
+        void* base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            perror(("Mapping recording (" + path + ")").c_str());
+            return false;
+        }
+        madvise(base, size, MADV_SEQUENTIAL);
+        mappings_.push_back(Mapping{ base, size });
+
+        const krec_chunk_header* h = static_cast<const krec_chunk_header*>(base);
+        Stream& s = streams_[stream];
+        if (h->magic != KREC_MAGIC || h->version != KREC_VERSION || h->stream != stream ||
+            h->header_size < sizeof(krec_chunk_header) || h->header_size > size) {
+            std::cerr << "Error: " << path << " is not a recording chunk of this version." << std::endl;
+            return false;
+        }
+        if (h->width != static_cast<uint32_t>(WIDTH) || h->height != static_cast<uint32_t>(HEIGHT) ||
+            (!s.frames.empty() && h->format != s.format)) {
+            std::cerr << "Error: " << path << " has an unsupported frame size or format." << std::endl;
+            return false;
+        }
+        s.format = h->format;
+        const size_t frame_size = static_cast<size_t>(WIDTH) * HEIGHT *
+            (h->format == KREC_FORMAT_RGB24 ? 3 : h->format == KREC_FORMAT_GREY8 ? 1 : 2);
+
+        const krec_index_entry* index;
+        uint64_t count;
+        if (krec_find_index(base, size, &index, &count) == 0) {
+            for (uint64_t i = 0; i < count; i++) {
+                if (index[i].size != frame_size || index[i].offset + sizeof(krec_frame_header) + frame_size > size)
+                    continue;
+                const krec_frame_header* f = krec_frame_at(base, index[i].offset);
+                s.frames.push_back(Frame{ reinterpret_cast<const uint8_t*>(f + 1), index[i].capture_ns,
+                                          index[i].kinect_timestamp });
+            }
+            return true;
+        }
+        // No index: the recording was interrupted. Walk the records that made it to disk.
+        std::cerr << "Warning: " << path << " has no index (interrupted recording); scanning it." << std::endl;
+        for (size_t offset = h->header_size; offset + sizeof(krec_frame_header) <= size;) {
+            const krec_frame_header* f = krec_frame_at(base, offset);
+            if (f->magic != KREC_FRAME_MAGIC || f->size > size - offset - sizeof(krec_frame_header))
+                break;
+            if (f->size == frame_size)
+                s.frames.push_back(Frame{ reinterpret_cast<const uint8_t*>(f + 1), f->capture_ns, f->kinect_timestamp });
+            offset += sizeof(krec_frame_header) + f->size;
+        }
+        return true;
+    }
+
+    // The running stream whose next frame was captured first.
+    Stream* nextStream() {
+        Stream* best = nullptr;
+        for (int stream : { video_stream_, depth_stream_ }) {
+            if (stream < 0)
+                continue;
+            Stream& s = streams_[stream];
+            if (s.next < s.frames.size() && (!best || s.frames[s.next].capture_ns < best->frames[best->next].capture_ns))
+                best = &s;
+        }
+        return best;
+    }
+
+    void rewind() {
+        for (auto& s : streams_)
+            s.next = 0;
+        started_ = false;
+        delivered_ = 0;
+        playhead_ns_ = 0;
+    }
+
+    static void skipTo(Stream& s, uint64_t capture_ns) {
+        while (s.next < s.frames.size() && s.frames[s.next].capture_ns < capture_ns)
+            ++s.next;
+    }
+
+    // Stepped mode: deliver the next frame once a line arrives on stdin. Polls so
+    // the capture loop still notices Ctrl+C.
+    bool waitForStep(const Stream& s, const Frame& f) {
+        if (!prompted_) {
+            std::cout << "Next: " << krec_stream_name(static_cast<uint32_t>(&s - streams_)) << " frame "
+                      << s.next + 1 << "/" << s.frames.size() << " at " << (f.capture_ns - start_ns_) / 1e9
+                      << " s. Press Enter to continue." << std::endl;
+            prompted_ = true;
+        }
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0)
+            return false;
+        char line[256];
+        if (!std::fgets(line, sizeof(line), stdin)) {
+            // stdin closed: play the rest without stepping.
+            mode_ = REPLAY_FAST;
+        }
+        prompted_ = false;
+        return true;
+    }
+
+    void finished() {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time_).count();
+        std::cout << "Replay finished: " << delivered_ << " frames in " << elapsed << " s ("
+                  << (elapsed > 0 ? delivered_ / elapsed : 0.0) << " frames/s)." << std::endl;
+    }
+
+    const char* replayModeName() const {
+        switch (mode_) {
+        case REPLAY_REALTIME: return "real time";
+        case REPLAY_FAST:     return "as fast as possible";
+        case REPLAY_STEP:     return "stepped";
+        }
+        return "unknown";
+    }
+
+    std::string dir_;
+    ReplayMode mode_;
+    bool loop_;
+    std::vector<Mapping> mappings_;
+    Stream streams_[KREC_STREAM_COUNT];
+    int video_stream_;  // KREC_STREAM_* being played as video, or -1.
+    int depth_stream_;
+    uint64_t delivered_;
+    bool started_;
+    bool prompted_;
+    uint64_t start_ns_;     // Capture time of the first frame played.
+    uint64_t playhead_ns_;  // Capture time of the last frame played.
+    std::chrono::steady_clock::time_point start_time_;
+};
+#endif
+
+// --- Day/Night Switching ---
+//
+// Watches RGB brightness and switches the open device between RGB and IR with
+// stop_video / set_video_mode / start_video, without reconnecting and without
+// touching the sinks. In IR mode the visible-light level cannot be measured, so
+// the switcher periodically probes RGB for a moment; probe frames are not output.
+class DayNightSwitcher {
+public:
+    enum Mode { MODE_RGB, MODE_IR };
+
+    explicit DayNightSwitcher(Mode initial)
+        : mode_(initial), probing_(false), probe_frames_(0), probe_sum_(0.0),
+          dark_(false), switching_(false) {
+        entered_ = std::chrono::steady_clock::now();
+    }
+
+    Mode mode() const { return mode_; }
+
+    // True while probe frames are being captured; they must not reach the sinks.
+    bool suppressOutput() const { return probing_; }
+
+    // Feed a captured video frame of the current mode.
+    void observe(const uint8_t* frame, int width, int height) {
+        auto now = std::chrono::steady_clock::now();
+        if (switching_) {
+            switching_ = false;
+            double total_ms = std::chrono::duration<double, std::milli>(now - switch_requested_).count();
+            double restart_ms = std::chrono::duration<double, std::milli>(switch_restarted_ - switch_requested_).count();
+            std::cout << "Day/night: now streaming " << (mode_ == MODE_IR ? "IR" : "RGB")
+                      << (probing_ ? " (probe)" : "") << ", switch latency " << total_ms
+                      << " ms (stop/set/start " << restart_ms << " ms, first frame "
+                      << total_ms - restart_ms << " ms)" << std::endl;
+        }
+        if (mode_ != MODE_RGB)
+            return;
+        double luma = meanLuma(frame, width, height);
+        if (probing_) {
+            // Let auto-exposure settle before sampling.
+            if (++probe_frames_ > kProbeSettleFrames)
+                probe_sum_ += luma;
+            return;
+        }
+        if (luma < kDarkLuma) {
+            if (!dark_) {
+                dark_ = true;
+                dark_since_ = now;
+            }
+        } else {
+            dark_ = false;
+        }
+    }
+
+    // Decide whether the device should change mode now; returns the wanted mode.
+    Mode wanted() {
+        auto now = std::chrono::steady_clock::now();
+        if (mode_ == MODE_RGB && probing_) {
+            if (probe_frames_ < kProbeSettleFrames + kProbeSampleFrames)
+                return MODE_RGB;
+            double luma = probe_sum_ / (probe_frames_ - kProbeSettleFrames);
+            if (luma > kBrightLuma) {
+                probing_ = false;
+                dark_ = false;
+                std::cout << "Day/night: light detected (mean luma " << luma << "), staying in RGB." << std::endl;
+                return MODE_RGB;
+            }
+            return MODE_IR;
+        }
+        if (mode_ == MODE_RGB && dark_ && now - dark_since_ >= std::chrono::seconds(kDarkSeconds))
+            return MODE_IR;
+        if (mode_ == MODE_IR && now - entered_ >= std::chrono::seconds(kProbeIntervalSeconds)) {
+            probing_ = true;
+            probe_frames_ = 0;
+            probe_sum_ = 0.0;
+            return MODE_RGB;
+        }
+        return mode_;
+    }
+
+    // Switch the running video stream of source to mode. The video callback stays installed.
+    bool switchTo(CaptureSource& source, Mode mode) {
+        switch_requested_ = std::chrono::steady_clock::now();
+        if (!source.restartVideo(mode == MODE_IR ? FREENECT_VIDEO_IR_8BIT : FREENECT_VIDEO_RGB))
+            return false;
+        switch_restarted_ = std::chrono::steady_clock::now();
+        if (mode == MODE_IR)
+            probing_ = false;
+        mode_ = mode;
+        entered_ = switch_restarted_;
+        dark_ = false;
+        switching_ = true;
+        return true;
+    }
+
+private:
+    enum {
+        kDarkLuma = 40,              // Mean luma below which RGB counts as dark.
+        kBrightLuma = 70,            // Mean probe luma above which RGB is kept.
+        kDarkSeconds = 3,            // Darkness needed before switching to IR.
+        kProbeIntervalSeconds = 30,  // Time in IR between RGB probes.
+        kProbeSettleFrames = 15,
+        kProbeSampleFrames = 5
+    };
+
+    // Mean luma of an RGB24 frame, sampled on an 8x8 grid.
+    static double meanLuma(const uint8_t* rgb, int width, int height) {
+        uint64_t sum = 0;
+        int count = 0;
+        for (int y = 0; y < height; y += 8) {
+            const uint8_t* row = rgb + static_cast<size_t>(y) * width * 3;
+            for (int x = 0; x < width; x += 8, count++) {
+                const uint8_t* p = row + x * 3;
+                sum += (77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8;
+            }
+        }
+        return count ? static_cast<double>(sum) / count : 0.0;
+    }
+
+    Mode mode_;
+    bool probing_;
+    int probe_frames_;
+    double probe_sum_;
+    bool dark_;
+    std::chrono::steady_clock::time_point dark_since_;
+    std::chrono::steady_clock::time_point entered_;
+    bool switching_;
+    std::chrono::steady_clock::time_point switch_requested_;
+    std::chrono::steady_clock::time_point switch_restarted_;
+};
+
+// --- Alternating IR/RGB Multiplexing ---
+//
+// The Kinect cannot stream IR and RGB at once, so --alternate-ir time-slices the
+// video stream: each mode is held for a dwell time, then the open device is
+// restarted in the other mode. RGB frames go to the main device and IR frames to
+// the IR device. Switch latency and per-stream frame rates are reported; when
+// switching eats too much of each slot the dwell time is raised, and if switching
+// keeps failing the multiplexer settles on RGB only.
+class VideoMultiplexer {
+public:
+    explicit VideoMultiplexer(int dwell_ms)
+        : ir_(false), dwell_ms_(dwell_ms), awaiting_first_frame_(true), failures_(0),
+          disabled_(false), switches_(0), switch_ms_sum_(0.0), switch_ms_max_(0.0) {
+        frames_[0] = frames_[1] = 0;
+        last_report_ = std::chrono::steady_clock::now();
+    }
+
+    bool irActive() const { return ir_; }
+
+    // The video stream (re)started in the current mode, e.g. after a reconnect.
+    void streamStarted() {
+        switch_started_ = std::chrono::steady_clock::now();
+        awaiting_first_frame_ = true;
+    }
+
+    // Count a frame of the current mode; the dwell time starts at the first one.
+    void frameArrived() {
+        auto now = std::chrono::steady_clock::now();
+        if (awaiting_first_frame_) {
+            awaiting_first_frame_ = false;
+            slot_started_ = now;
+            double ms = std::chrono::duration<double, std::milli>(now - switch_started_).count();
+            switches_++;
+            switch_ms_sum_ += ms;
+            switch_ms_max_ = std::max(switch_ms_max_, ms);
+        }
+        frames_[ir_ ? 1 : 0]++;
+        if (now - last_report_ >= std::chrono::seconds(10))
+            report(now);
+    }
+
+    // True when the current slot is over and the other mode should start.
+    bool due() const {
+        return !disabled_ && !awaiting_first_frame_ &&
+               std::chrono::steady_clock::now() - slot_started_ >= std::chrono::milliseconds(dwell_ms_);
+    }
+
+    // Restart the video stream of source in the other mode.
+    bool switchNext(CaptureSource& source) {
+        bool next_ir = !ir_;
+        streamStarted();
+        if (!source.restartVideo(next_ir ? FREENECT_VIDEO_IR_8BIT : FREENECT_VIDEO_RGB)) {
+            if (++failures_ >= 3) {
+                std::cerr << "Alternating IR/RGB: mode switches keep failing, staying in RGB." << std::endl;
+                disabled_ = true;
+                next_ir = false;
+                if (!source.restartVideo(FREENECT_VIDEO_RGB))
+                    return false;
+            } else {
+                // Retry the current mode so the stream keeps running.
+                next_ir = ir_;
+                if (!source.restartVideo(ir_ ? FREENECT_VIDEO_IR_8BIT : FREENECT_VIDEO_RGB))
+                    return false;
+            }
+        } else {
+            failures_ = 0;
+        }
+        ir_ = next_ir;
+        return true;
+    }
+
+private:
+    enum { kMaxDwellMs = 10000 };
+
+    void report(std::chrono::steady_clock::time_point now) {
+        double window_s = std::chrono::duration<double>(now - last_report_).count();
+        double mean_ms = switches_ ? switch_ms_sum_ / switches_ : 0.0;
+        std::cout << "Alternating IR/RGB: RGB " << frames_[0] / window_s << " fps, IR "
+                  << frames_[1] / window_s << " fps, " << switches_ << " switches, latency mean "
+                  << mean_ms << " ms, max " << switch_ms_max_ << " ms, dwell " << dwell_ms_ << " ms" << std::endl;
+        // Keep switching overhead to at most a third of the time.
+        if (switches_ && mean_ms * 2 > dwell_ms_ && dwell_ms_ < kMaxDwellMs) {
+            dwell_ms_ = std::min(static_cast<int>(kMaxDwellMs), dwell_ms_ * 2);
+            std::cout << "Alternating IR/RGB: switch latency is high, raising dwell to " << dwell_ms_ << " ms." << std::endl;
+        }
+        frames_[0] = frames_[1] = 0;
+        switches_ = 0;
+        switch_ms_sum_ = switch_ms_max_ = 0.0;
+        last_report_ = now;
+    }
+
+    bool ir_;
+    int dwell_ms_;
+    bool awaiting_first_frame_;
+    int failures_;
+    bool disabled_;
+    std::chrono::steady_clock::time_point switch_started_;
+    std::chrono::steady_clock::time_point slot_started_;
+    std::chrono::steady_clock::time_point last_report_;
+    uint64_t frames_[2];  // RGB, IR frames in the current report window.
+    int switches_;
+    double switch_ms_sum_;
+    double switch_ms_max_;
+};
+
+// --- Shared Frames ---
+//
+// Output frames are converted once per distinct sink format and then shared,
+// read-only, by every sink that takes that format. Buffers come from a FramePool
+// and return to it when the last reference is dropped, so memory grows with the
+// number of frames in flight rather than with the number of sinks.
+
+// The capture stream a sink frame was rendered from. Writers keep a pending
+// frame, and pace, per stream, so video and depth frames going to the same sink
+// never replace each other.
+enum FrameStream {
+    FRAME_VIDEO,
+    FRAME_DEPTH,
+    FRAME_STREAM_COUNT
+};
+
+struct SharedFrame {
+    std::vector<uint8_t> data;
+    FrameStream stream = FRAME_VIDEO;
+    PixelFormat format = PIXFMT_GREY;
+    int width  = 0;
+    int height = 0;
+    FrameInfo info;
+    uint64_t buffer_id = 0;  // Changes whenever data is reallocated, never reused.
+};
+typedef std::shared_ptr<const SharedFrame> FrameRef;
+
+class FramePool {
+public:
+    FramePool() : state_(std::make_shared<State>()) {}
+
+    // A writable frame of `size` bytes, recycled once every reference is gone.
+    std::shared_ptr<SharedFrame> acquire(size_t size) {
+        SharedFrame* frame = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            if (!state_->free.empty()) {
+                frame = state_->free.back().release();
+                state_->free.pop_back();
+            } else {
+                ++state_->allocated;
+            }
+        }
+        if (!frame)
+            frame = new SharedFrame();
+        const uint8_t* old_data = frame->data.data();
+        frame->data.resize(size);
+        if (frame->data.data() != old_data) {
+            static std::atomic<uint64_t> buffer_ids(0);
+            frame->buffer_id = ++buffer_ids;
+        }
+        std::shared_ptr<State> state = state_;
+        return std::shared_ptr<SharedFrame>(frame, [state](SharedFrame* f) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->free.emplace_back(f);
+        });
+    }
+
+    // Number of frame buffers created so far (in flight plus free).
+    size_t allocated() const {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->allocated;
+    }
+
+private:
+    // Shared with the deleters so frames can outlive the pool.
+    struct State {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<SharedFrame>> free;
+        size_t allocated = 0;
+    };
+    std::shared_ptr<State> state_;
+};
+
+// --- Sinks ---
+//
+// A sink consumes finished frames of one format and size. Sinks are only driven
+// from their own SinkWriter thread, so write() may block without holding up
+// capture or other sinks.
+class Sink {
+public:
+    Sink(const std::string& name, PixelFormat format, int width, int height)
+        : name_(name), format_(format), width_(width), height_(height) {}
+    virtual ~Sink() {}
+
+    const std::string& name() const { return name_; }
+    PixelFormat format() const { return format_; }
+    int width() const { return width_; }
+    int height() const { return height_; }
+    size_t frameSize() const {
+        return static_cast<size_t>(width_) * height_ * pixelFormatBytesPerPixel(format_);
+    }
+
+    // Prepare the sink for frames. Failure is reported but not fatal: the writer
+    // calls closeOutput() and open() again later (see SinkRecovery).
+    virtual bool open() = 0;
+    // Undo whatever open() set up, even partly, so that open() can be called again.
+    virtual void closeOutput() {}
+    // After a failed write: whether the output itself is gone (e.g. the loopback
+    // device was removed) rather than just this frame, so the sink must be reopened.
+    virtual bool outputLost() { return false; }
+    // Whether a whole frame can be written right now without blocking. Frames
+    // arriving while this is false are skipped for this sink.
+    virtual bool writable() { return true; }
+    // Whether anything consumes the sink's frames (--on-demand). Polled from the
+    // writer thread about every 100 ms, also while no frames arrive, so sinks can
+    // pick up new readers then. Sinks that cannot tell always report true.
+    virtual bool hasReaders() { return true; }
+    // Deliver one frame. Sinks that keep referring to the frame after returning
+    // (e.g. pages spliced into a pipe) hold on to the reference.
+    virtual bool write(const FrameRef& frame) = 0;
+    // Whether frames can go out as a single write() of the frame data to
+    // batchFd(), so the sink can be fed from a BatchWriter (--io-uring). Decided
+    // before open().
+    virtual bool batchable() const { return false; }
+    // The descriptor batched writes go to, or -1 while there is none (write()
+    // is then used, and reports why).
+    virtual int batchFd() { return -1; }
+    // Result of a batched write of frame: bytes written or -errno. Returns
+    // whether the frame was delivered.
+    virtual bool batchWritten(const FrameRef& /*frame*/, int /*result*/) { return false; }
+    // Zero-copy output (V4L2 mmap): a buffer of the output itself, frameSize()
+    // bytes, that the next frame can be rendered into, or null if none is free.
+    // It stays reserved until queueBuffer() hands it to consumers or
+    // releaseBuffer() gives it back. Writer thread only, like write().
+    virtual uint8_t* mapBuffer(int& /*index*/) { return nullptr; }
+    virtual bool queueBuffer(int /*index*/, const FrameInfo& /*info*/) { return false; }
+    virtual void releaseBuffer(int /*index*/) {}
+    // Advertise the rate frames will arrive at (--fps), where supported.
+    virtual void setFrameRate(int /*fps*/) {}
+    // Sink-specific statistics for the periodic report, reset on each call.
+    virtual std::string statusReport() { return std::string(); }
+
+protected:
+    std::string name_;
+    PixelFormat format_;
+    int width_;
+    int height_;
+};
+
+#ifdef __linux__
+// True when a write to fd would not block (or would fail straight away, which
+// the write then reports).
+bool fdWritable(int fd) {
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    return poll(&pfd, 1, 0) == 1;
+}
+#endif
+
+// A v4l2loopback device.
+class LoopbackSink : public Sink {
+public:
+    LoopbackSink(const std::string& path, PixelFormat format, int width, int height, DeviceIO io)
+        : Sink(path, format, width, height), io_(io), reader_events_(false), primed_(false), hinted_(false) {
+        dev_.path   = path;
+        dev_.format = format;
+        dev_.width  = width;
+        dev_.height = height;
+        dev_.io     = io;
+    }
+
+    ~LoopbackSink() override {
+        closeOutput();
+    }
+
+    bool open() override {
+        if (!initVirtualDevice(dev_)) {
+            if (!hinted_) {
+                std::cerr << "Ensure that the specified v4l2loopback device (" << dev_.path
+                          << ") is created and accessible." << std::endl;
+                hinted_ = true;
+            }
+            return false;
+        }
+#ifdef __linux__
+        reader_events_ = watchVirtualDeviceReaders(dev_);
+        if (!reader_events_ && on_demand_streaming) {
+            std::cerr << "v4l2loopback on " << dev_.path << " does not report readers; it is always fed."
+                      << std::endl;
+        }
+#endif
+        return true;
+    }
+
+    bool writable() override {
+#ifdef __linux__
+        // With streaming I/O, POLLOUT also means a buffer can be dequeued.
+        if (dev_.fd >= 0)
+            return fdWritable(dev_.fd);
+#endif
+        return true;
+    }
+
+    bool hasReaders() override {
+#ifdef __linux__
+        // Until the first frame is written, applications may not even list the
+        // device (exclusive_caps), so it counts as read until then.
+        if (reader_events_ && primed_)
+            return virtualDeviceReaders(dev_) != 0;
+#endif
+        return true;
+    }
+
+    bool write(const FrameRef& frame) override {
+        bool ok = sendFrameToVirtualDevice(dev_, frame->data.data(), frame->data.size(), frame->info.capture_ns);
+        primed_ = primed_ || ok;
+        return ok;
+    }
+
+#ifdef __linux__
+    bool batchable() const override { return dev_.io == DEVICE_IO_WRITE; }
+
+    int batchFd() override { return dev_.io == DEVICE_IO_WRITE ? dev_.fd : -1; }
+
+    bool batchWritten(const FrameRef& frame, int result) override {
+        if (result < 0)
+            errno = -result;
+        bool ok = virtualDeviceWriteDone(dev_, result, frame->data.size());
+        primed_ = primed_ || ok;
+        return ok;
+    }
+
+    uint8_t* mapBuffer(int& index) override {
+        if (dev_.fd < 0 || dev_.io != DEVICE_IO_MMAP || dev_.buffers.empty())
+            return nullptr;
+        uint8_t* data = acquireVirtualDeviceBuffer(dev_, frameSize(), index);
+        if (data)
+            dev_.buffers[index].held = true;
+        return data;
+    }
+
+    bool queueBuffer(int index, const FrameInfo& info) override {
+        dev_.buffers[index].held = false;
+        bool ok = queueVirtualDeviceBuffer(dev_, index, frameSize(), info.capture_ns);
+        primed_ = primed_ || ok;
+        return ok;
+    }
+
+    void releaseBuffer(int index) override {
+        dev_.buffers[index].held = false;
+    }
+#endif
+
+    void setFrameRate(int fps) override {
+        setVirtualDeviceFrameRate(dev_, fps);
+    }
+
+    void closeOutput() override {
+#ifdef __linux__
+        if (dev_.fd >= 0) {
+            if (!dev_.buffers.empty())
+                releaseVirtualDeviceBuffers(dev_);
+            ::close(dev_.fd);
+            dev_.fd = -1;
+        }
+        dev_.readers = -1;
+#endif
+        dev_.io = io_;  // open() may have fallen back to write().
+        primed_ = false;
+    }
+
+    // The device is gone once it no longer answers a format query (v4l2loopback
+    // returns ENODEV after the device is deleted).
+    bool outputLost() override {
+#ifdef __linux__
+        if (dev_.fd < 0)
+            return true;
+        struct v4l2_format fmt;
+        std::memset(&fmt, 0, sizeof(fmt));
+        fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        return ioctl(dev_.fd, VIDIOC_G_FMT, &fmt) < 0 &&
+               (errno == ENODEV || errno == ENXIO || errno == EIO || errno == EBADF);
+#else
+        return true;
+#endif
+    }
+
+private:
+    VirtualDevice dev_;
+    DeviceIO io_;         // I/O method asked for.
+    bool reader_events_;  // v4l2loopback reports readers.
+    bool primed_;         // A frame has been written.
+    bool hinted_;         // The setup hint was shown.
+};
+
+#ifdef __linux__
+// A POSIX shared-memory ring that local readers map directly (layout and reader
+// in kinect_shm.h). Each slot is guarded by a seqlock so readers never block the
+// writer and can detect torn copies.
+class ShmSink : public Sink {
+public:
+    enum { SLOT_COUNT = 4 };
+
+    ShmSink(const std::string& name, PixelFormat format, int width, int height)
+        : Sink("shm:" + name, format, width, height),
+          shm_name_(name.compare(0, 1, "/") == 0 ? name : "/" + name),
+          fd_(-1), base_(nullptr), size_(0), published_(0) {}
+
+    ~ShmSink() override {
+        closeOutput();
+    }
+
+    void closeOutput() override {
+        if (base_)
+            munmap(base_, size_);
+        if (fd_ >= 0) {
+            close(fd_);
+            shm_unlink(shm_name_.c_str());
+        }
+        base_ = nullptr;
+        fd_ = -1;
+    }
+
+    bool open() override {
+        size_t frame_size = static_cast<size_t>(width_) * height_ * pixelFormatBytesPerPixel(format_);
+        uint32_t stride = static_cast<uint32_t>((KSHM_SLOT_DATA_OFFSET + frame_size + 63) & ~static_cast<size_t>(63));
+        size_ = kshm_ring_size(SLOT_COUNT, stride);
+        // Start from a fresh object; readers still mapping an old ring keep it.
+        shm_unlink(shm_name_.c_str());
+        fd_ = shm_open(shm_name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+        if (fd_ < 0) {
+            perror(("Creating shared memory ring (" + shm_name_ + ")").c_str());
+            return false;
+        }
+        if (ftruncate(fd_, size_) < 0) {
+            perror(("Sizing shared memory ring (" + shm_name_ + ")").c_str());
+            return false;
+        }
+        void* base = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED) {
+            perror(("Mapping shared memory ring (" + shm_name_ + ")").c_str());
+            return false;
+        }
+        base_ = base;
+        kshm_header* h = static_cast<kshm_header*>(base_);
+        h->version        = KSHM_VERSION;
+        h->slot_count     = SLOT_COUNT;
+        h->slot_stride    = stride;
+        h->max_frame_size = static_cast<uint32_t>(frame_size);
+        __atomic_store_n(&h->magic, KSHM_MAGIC, __ATOMIC_RELEASE);
+        std::cout << "Shared memory ring " << shm_name_ << ": " << SLOT_COUNT << " slots of "
+                  << stride << " bytes (" << pixelFormatName(format_) << ")." << std::endl;
+        return true;
+    }
+
+    bool write(const FrameRef& ref) override {
+        const SharedFrame& frame = *ref;
+        if (!base_)
+            return false;
+        kshm_header* h = static_cast<kshm_header*>(base_);
+        if (frame.data.size() > h->max_frame_size) {
+            std::cerr << "Frame too large for shared memory ring " << shm_name_ << "." << std::endl;
+            return false;
+        }
+        uint64_t number = published_ + 1;
+        kshm_slot* slot = kshm_ring_slot(base_, static_cast<uint32_t>((number - 1) % SLOT_COUNT));
+        uint64_t seq = slot->seq;  // Only this thread writes the ring.
+        __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot->info.fourcc           = pixelFormatFourcc(frame.format);
+        slot->info.width            = frame.width;
+        slot->info.height           = frame.height;
+        slot->info.size             = static_cast<uint32_t>(frame.data.size());
+        slot->info.frame_number     = number;
+        slot->info.sequence         = frame.info.sequence;
+        slot->info.capture_ns       = frame.info.capture_ns;
+        slot->info.kinect_timestamp = frame.info.kinect_timestamp;
+        std::memcpy(reinterpret_cast<uint8_t*>(slot) + KSHM_SLOT_DATA_OFFSET, frame.data.data(), frame.data.size());
+        __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+        __atomic_store_n(&h->write_count, number, __ATOMIC_RELEASE);
+        published_ = number;
+        return true;
+    }
+
+    // Readers hold a shared flock() while they have the ring open (kinect_shm.h).
+    bool hasReaders() override {
+        if (fd_ < 0)
+            return false;
+        if (flock(fd_, LOCK_EX | LOCK_NB) == 0) {
+            flock(fd_, LOCK_UN);
+            return false;
+        }
+        return errno == EWOULDBLOCK;
+    }
+
+private:
+    std::string shm_name_;
+    int fd_;
+    void* base_;
+    size_t size_;
+    uint64_t published_;
+};
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010  // Linux 5.1; older headers lack it.
+#endif
+
+// Hands frames to local, possibly sandboxed, clients over a unix-domain socket
+// (protocol in kinect_memfd.h). Frames live in sealed memfds that each client
+// maps once; per frame only the slot index and metadata are sent. Clients get
+// read-only descriptors, and F_SEAL_FUTURE_WRITE (where the kernel has it)
+// stops anyone but the server's own mapping from writing to a slot. A slot is not
+// reused while any client holds it, and a client that has KMFD_MAX_IN_FLIGHT
+// slots outstanding or a full socket skips frames, so clients cannot slow the
+// writer or each other.
+class UnixSocketSink : public Sink {
+public:
+    UnixSocketSink(const std::string& path, PixelFormat format, int width, int height)
+        : Sink("unix:" + path, format, width, height), path_(path), listen_fd_(-1),
+          slot_size_(0), next_slot_(0), next_client_id_(1), published_(0), no_free_slot_(0) {}
+
+    ~UnixSocketSink() override {
+        closeOutput();
+    }
+
+    void closeOutput() override {
+        for (const auto& c : clients_)
+            close(c.fd);
+        clients_.clear();
+        for (const auto& s : slots_) {
+            munmap(s.data, slot_size_);
+            close(s.fd);
+            close(s.client_fd);
+        }
+        slots_.clear();
+        if (listen_fd_ >= 0) {
+            close(listen_fd_);
+            unlink(path_.c_str());
+        }
+        listen_fd_ = -1;
+    }
+
+    bool open() override {
+        slot_size_ = static_cast<size_t>(width_) * height_ * pixelFormatBytesPerPixel(format_);
+        for (int i = 0; i < KMFD_MAX_SLOTS; i++) {
+            int fd = memfd_create(("kinect-frame-" + std::to_string(i)).c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (fd < 0) {
+                perror(("Creating frame memfd (" + name_ + ")").c_str());
+                return false;
+            }
+            if (ftruncate(fd, slot_size_) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+                perror(("Sizing and sealing frame memfd (" + name_ + ")").c_str());
+                close(fd);
+                return false;
+            }
+            void* data = mmap(nullptr, slot_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED) {
+                perror(("Mapping frame memfd (" + name_ + ")").c_str());
+                close(fd);
+                return false;
+            }
+            // The mapping above stays writable; new writable mappings and write()
+            // are refused from here on. Kernels before 5.1 only get the read-only
+            // descriptors below.
+            if (fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0 &&
+                (errno != EINVAL || fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL) < 0)) {
+                perror(("Sealing frame memfd (" + name_ + ")").c_str());
+                munmap(data, slot_size_);
+                close(fd);
+                return false;
+            }
+            int client_fd = ::open(("/proc/self/fd/" + std::to_string(fd)).c_str(), O_RDONLY | O_CLOEXEC);
+            if (client_fd < 0) {
+                perror(("Reopening frame memfd read-only (" + name_ + ")").c_str());
+                munmap(data, slot_size_);
+                close(fd);
+                return false;
+            }
+            Slot slot = { fd, client_fd, static_cast<uint8_t*>(data), 0 };
+            slots_.push_back(slot);
+        }
+
+        struct sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path_.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "Socket path too long: " << path_ << std::endl;
+            return false;
+        }
+        std::memcpy(addr.sun_path, path_.c_str(), path_.size());
+        listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0) {
+            perror(("Creating frame server socket (" + path_ + ")").c_str());
+            return false;
+        }
+        unlink(path_.c_str());
+        if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            listen(listen_fd_, 8) < 0) {
+            perror(("Listening on frame server socket (" + path_ + ")").c_str());
+            close(listen_fd_);
+            listen_fd_ = -1;
+            return false;
+        }
+        std::cout << "Frame server listening on " << path_ << " (" << KMFD_MAX_SLOTS << " memfd slots of "
+                  << slot_size_ << " bytes, " << pixelFormatName(format_) << ")." << std::endl;
+        return true;
+    }
+
+    bool write(const FrameRef& ref) override {
+        const SharedFrame& frame = *ref;
+        if (listen_fd_ < 0)
+            return false;
+        acceptClients();
+        collectReleases();
+        if (clients_.empty())
+            return true;
+        if (frame.data.size() > slot_size_) {
+            std::cerr << "Frame too large for " << name_ << "." << std::endl;
+            return false;
+        }
+        int slot = freeSlot();
+        if (slot < 0)
+            return false;  // writable() said otherwise; not expected.
+        std::memcpy(slots_[slot].data, frame.data.data(), frame.data.size());
+
+        kmfd_frame msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.slot             = slot;
+        msg.size             = static_cast<uint32_t>(frame.data.size());
+        msg.frame_number     = ++published_;
+        msg.sequence         = frame.info.sequence;
+        msg.capture_ns       = frame.info.capture_ns;
+        msg.kinect_timestamp = frame.info.kinect_timestamp;
+        for (size_t i = 0; i < clients_.size();) {
+            Client& c = clients_[i];
+            if (__builtin_popcount(c.held) >= KMFD_MAX_IN_FLIGHT) {
+                ++c.skipped;
+            } else if (send(c.fd, &msg, sizeof(msg), MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(msg)) {
+                c.held |= 1u << slot;
+                ++slots_[slot].refs;
+                ++c.sent;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ++c.skipped;
+            } else {
+                disconnect(i);
+                continue;
+            }
+            ++i;
+        }
+        return true;
+    }
+
+    // With every slot held by clients the frame is skipped, and counted as such,
+    // rather than reported as written.
+    bool writable() override {
+        if (listen_fd_ < 0 || slots_.empty())
+            return true;  // write() reports the closed server.
+        acceptClients();
+        collectReleases();
+        if (clients_.empty())
+            return true;
+        for (const auto& s : slots_) {
+            if (s.refs == 0)
+                return true;
+        }
+        ++no_free_slot_;
+        return false;
+    }
+
+    bool hasReaders() override {
+        if (listen_fd_ < 0)
+            return false;
+        acceptClients();
+        collectReleases();
+        return !clients_.empty();
+    }
+
+    std::string statusReport() override {
+        std::string report = std::to_string(clients_.size()) + " clients";
+        for (auto& c : clients_) {
+            report += ", client " + std::to_string(c.id) + " sent " + std::to_string(c.sent) +
+                      " skipped " + std::to_string(c.skipped);
+            c.sent = c.skipped = 0;
+        }
+        if (no_free_slot_) {
+            report += ", no free slot " + std::to_string(no_free_slot_);
+            no_free_slot_ = 0;
+        }
+        return report;
+    }
+
+private:
+    struct Slot {
+        int fd;
+        int client_fd;  // Read-only descriptor of the same memfd, sent to clients.
+        uint8_t* data;
+        int refs;  // Clients currently holding the slot.
+    };
+    struct Client {
+        int fd;
+        int id;
+        uint32_t held;  // Bit per slot the client has not released yet.
+        uint64_t sent;
+        uint64_t skipped;
+    };
+
+    void acceptClients() {
+        while (true) {
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+            if (!sendHello(fd)) {
+                close(fd);
+                continue;
+            }
+            Client c = { fd, next_client_id_++, 0, 0, 0 };
+            clients_.push_back(c);
+            std::cout << "Frame server " << path_ << ": client " << c.id << " connected." << std::endl;
+        }
+    }
+
+    bool sendHello(int fd) {
+        kmfd_hello hello;
+        std::memset(&hello, 0, sizeof(hello));
+        hello.magic      = KMFD_MAGIC;
+        hello.version    = KMFD_VERSION;
+        hello.slot_count = static_cast<uint32_t>(slots_.size());
+        hello.slot_size  = static_cast<uint32_t>(slot_size_);
+        hello.fourcc     = pixelFormatFourcc(format_);
+        hello.width      = width_;
+        hello.height     = height_;
+
+        char control[CMSG_SPACE(sizeof(int) * KMFD_MAX_SLOTS)];
+        std::memset(control, 0, sizeof(control));
+        struct iovec iov = { &hello, sizeof(hello) };
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * slots_.size());
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * slots_.size());
+        int* fds = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+        for (size_t i = 0; i < slots_.size(); i++)
+            fds[i] = slots_[i].client_fd;
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+            perror(("Sending frame slots to client (" + path_ + ")").c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Apply the releases clients have sent and drop clients that hung up.
+    void collectReleases() {
+        for (size_t i = 0; i < clients_.size();) {
+            Client& c = clients_[i];
+            bool gone = false;
+            while (true) {
+                kmfd_release release;
+                ssize_t n = recv(c.fd, &release, sizeof(release), MSG_DONTWAIT);
+                if (n == sizeof(release)) {
+                    if (release.slot < slots_.size() && (c.held & (1u << release.slot))) {
+                        c.held &= ~(1u << release.slot);
+                        --slots_[release.slot].refs;
+                    }
+                    continue;
+                }
+                gone = n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+                break;
+            }
+            if (gone) {
+                disconnect(i);
+                continue;
+            }
+            ++i;
+        }
+    }
+
+    void disconnect(size_t index) {
+        Client& c = clients_[index];
+        for (size_t s = 0; s < slots_.size(); s++) {
+            if (c.held & (1u << s))
+                --slots_[s].refs;
+        }
+        close(c.fd);
+        std::cout << "Frame server " << path_ << ": client " << c.id << " disconnected." << std::endl;
+        clients_.erase(clients_.begin() + index);
+    }
+
+    // Next slot no client holds, round robin so recently sent slots are reused last.
+    int freeSlot() {
+        for (size_t n = 0; n < slots_.size(); n++) {
+            size_t s = (next_slot_ + n) % slots_.size();
+            if (slots_[s].refs == 0) {
+                next_slot_ = (s + 1) % slots_.size();
+                return static_cast<int>(s);
+            }
+        }
+        return -1;
+    }
+
+    std::string path_;
+    int listen_fd_;
+    size_t slot_size_;
+    std::vector<Slot> slots_;
+    std::vector<Client> clients_;
+    size_t next_slot_;
+    int next_client_id_;
+    uint64_t published_;
+    uint64_t no_free_slot_;
+};
+
+// Raw frames to a regular file, a FIFO or stdout, optionally each preceded by a
+// kraw_frame_header (--frame-headers, see kinect_raw.h). When the output is a
+// pipe the frame pages are vmsplice()d into it instead of copied; since the pipe
+// then refers to the pool buffer, the frame reference is held until the reader
+// has consumed those bytes.
+//
+// Pipes are written non-blocking. A frame is only started when the pipe has room
+// for all of it, otherwise it is skipped, so a slow reader costs frames rather
+// than stalling the writer, and frames are never torn. A FIFO without a reader
+// is reopened as frames arrive, without waiting for one.
+class RawSink : public Sink {
+public:
+    enum { STALL_TIMEOUT_MS = 1000 };  // Longest wait to finish a frame already started.
+
+    // Write to `path`, or to `fd` when it is not negative (stdout).
+    RawSink(const std::string& name, const std::string& path, int fd, PixelFormat format,
+            int width, int height, bool headers)
+        : Sink(name, format, width, height), path_(path), fd_(fd), headers_(headers),
+          is_pipe_(false), pipe_size_(0), waiting_(false), spliced_bytes_(0) {}
+
+    ~RawSink() override {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    bool open() override {
+        if (fd_ < 0) {
+            fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NONBLOCK, 0644);
+            if (fd_ < 0) {
+                if (errno == ENXIO) {
+                    // A FIFO nobody reads yet; writable() retries as frames arrive.
+                    if (!waiting_)
+                        std::cout << "Raw output " << name_ << ": waiting for a reader." << std::endl;
+                    waiting_ = true;
+                    is_pipe_ = true;
+                    return true;
+                }
+                perror(("Opening output file (" + path_ + ")").c_str());
+                return false;
+            }
+        }
+        waiting_ = false;
+        struct stat st;
+        is_pipe_ = fstat(fd_, &st) == 0 && S_ISFIFO(st.st_mode);
+        if (is_pipe_) {
+            // Room for two frames, so the reader can work on one while the next is
+            // queued; fall back to one frame if that exceeds the pipe size limit.
+            size_t record = frameBytes();
+            if (fcntl(fd_, F_SETPIPE_SZ, static_cast<int>(2 * record)) < 0)
+                fcntl(fd_, F_SETPIPE_SZ, static_cast<int>(record));
+            pipe_size_ = std::max(fcntl(fd_, F_GETPIPE_SZ), 0);
+            // Only set on pipes: on a terminal the flag would outlive the process.
+            fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+        }
+        std::cout << "Raw output " << name_ << ": " << (is_pipe_ ? "pipe (vmsplice)" : "file")
+                  << (headers_ ? ", with frame headers" : "") << "." << std::endl;
+        return true;
+    }
+
+    bool writable() override {
+        if (fd_ < 0) {
+            // A FIFO whose reader went away is reopened once a new reader shows up.
+            if (path_.empty() || !is_pipe_ || !open() || fd_ < 0)
+                return false;
+        }
+        if (!is_pipe_)
+            return true;
+        struct pollfd pfd = { fd_, POLLOUT, 0 };
+        if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLERR))
+            return true;  // The reader is gone; the write reports it and the FIFO is reopened.
+        int unread = 0;
+        if (ioctl(fd_, FIONREAD, &unread) < 0)
+            return pfd.revents != 0;
+        // A frame larger than the pipe can only be started into an empty pipe.
+        size_t needed = std::min(frameBytes(), static_cast<size_t>(pipe_size_));
+        return static_cast<size_t>(pipe_size_ - unread) >= needed;
+    }
+
+    bool hasReaders() override {
+        if (fd_ >= 0 && !is_pipe_)
+            return true;
+        if (fd_ >= 0) {
+            struct pollfd pfd = { fd_, POLLOUT, 0 };
+            if (poll(&pfd, 1, 0) < 1 || !(pfd.revents & POLLERR))
+                return true;
+            // The reader is gone. stdout cannot get a new one; a FIFO is reopened.
+            if (path_.empty())
+                return false;
+            errno = EPIPE;
+            fail();
+        }
+        return !path_.empty() && is_pipe_ && open() && fd_ >= 0;
+    }
+
+    bool write(const FrameRef& frame) override {
+        if (fd_ < 0)
+            return false;
+        if (headers_) {
+            kraw_frame_header h;
+            std::memset(&h, 0, sizeof(h));
+            h.magic            = KRAW_MAGIC;
+            h.header_size      = sizeof(h);
+            h.fourcc           = pixelFormatFourcc(frame->format);
+            h.width            = frame->width;
+            h.height           = frame->height;
+            h.size             = static_cast<uint32_t>(frame->data.size());
+            h.sequence         = frame->info.sequence;
+            h.capture_ns       = frame->info.capture_ns;
+            h.kinect_timestamp = frame->info.kinect_timestamp;
+            if (!writeAll(reinterpret_cast<const uint8_t*>(&h), sizeof(h)))
+                return fail();
+            if (is_pipe_)
+                trackSpliced(FrameRef(), sizeof(h));
+        }
+        bool ok = is_pipe_ ? spliceAll(frame) : writeAll(frame->data.data(), frame->data.size());
+        return ok ? true : fail();
+    }
+
+    // Plain files without frame headers; pipes keep vmsplice().
+    bool batchable() const override {
+        struct stat st;
+        return !headers_ && !path_.empty() && !(stat(path_.c_str(), &st) == 0 && S_ISFIFO(st.st_mode));
+    }
+
+    int batchFd() override { return is_pipe_ ? -1 : fd_; }
+
+    bool batchWritten(const FrameRef& frame, int result) override {
+        if (result < 0) {
+            errno = -result;
+            return fail();
+        }
+        // A short write to a file (e.g. a full disk) is finished, or failed, here.
+        size_t done = static_cast<size_t>(result);
+        return writeAll(frame->data.data() + done, frame->data.size() - done) || fail();
+    }
+
+private:
+    // Bytes one frame occupies in the output, including its header.
+    size_t frameBytes() const {
+        return static_cast<size_t>(width_) * height_ * pixelFormatBytesPerPixel(format_) +
+               (headers_ ? sizeof(kraw_frame_header) : 0);
+    }
+
+    // The rest of a frame that did not fit: wait a bounded time for the reader.
+    bool waitWritable() {
+        struct pollfd pfd = { fd_, POLLOUT, 0 };
+        int ret;
+        do {
+            ret = poll(&pfd, 1, STALL_TIMEOUT_MS);
+        } while (ret < 0 && errno == EINTR);
+        if (ret == 0) {
+            std::cerr << "Reader of " << name_ << " stalled in the middle of a frame." << std::endl;
+            errno = ETIMEDOUT;
+        }
+        return ret > 0;
+    }
+
+    bool writeAll(const uint8_t* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::write(fd_, data, size);
+            if (n < 0) {
+                if (errno == EINTR || (errno == EAGAIN && waitWritable()))
+                    continue;
+                return false;
+            }
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool spliceAll(const FrameRef& frame) {
+        const uint8_t* data = frame->data.data();
+        size_t size = frame->data.size();
+        while (size > 0) {
+            struct iovec iov = { const_cast<uint8_t*>(data), size };
+            ssize_t n = vmsplice(fd_, &iov, 1, SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR || (errno == EAGAIN && waitWritable()))
+                    continue;
+                return false;
+            }
+            trackSpliced(frame, n);
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // Remember what the pipe still refers to, and release frames whose bytes the
+    // reader has consumed.
+    void trackSpliced(const FrameRef& frame, size_t bytes) {
+        in_pipe_.push_back(std::make_pair(frame, bytes));
+        spliced_bytes_ += bytes;
+        int unread = 0;
+        if (ioctl(fd_, FIONREAD, &unread) < 0)
+            return;
+        while (!in_pipe_.empty() && spliced_bytes_ - in_pipe_.front().second >= static_cast<size_t>(unread)) {
+            spliced_bytes_ -= in_pipe_.front().second;
+            in_pipe_.pop_front();
+        }
+    }
+
+    // Close after an error; a FIFO is reopened once it has a reader again.
+    bool fail() {
+        if (errno == EPIPE)
+            std::cerr << "Reader of " << name_ << " went away." << std::endl;
+        else if (errno != ETIMEDOUT)
+            perror(("Writing raw output (" + name_ + ")").c_str());
+        if (!path_.empty()) {
+            close(fd_);
+            fd_ = -1;
+        }
+        in_pipe_.clear();
+        spliced_bytes_ = 0;
+        return false;
+    }
+
+    std::string path_;
+    int fd_;
+    bool headers_;
+    bool is_pipe_;
+    int pipe_size_;
+    bool waiting_;                                     // FIFO opened before it had a reader.
+    std::deque<std::pair<FrameRef, size_t>> in_pipe_;  // Spliced chunks, oldest first.
+    size_t spliced_bytes_;                             // Total bytes in in_pipe_.
+};
+#endif
+
+// Where each sink's frames go: "<target>[:<format>[,<format>...]]", where the
+// target is a loopback device path, "shm:<name>", "unix:<socket path>",
+// "file:<path>" (file or FIFO) or "-" (stdout). The formats are the ones the
+// sink accepts (every sink type can take any PixelFormat, so this is up to the
+// consumer); they default to the stream's output formats, and planFormats()
+// picks the cheapest.
+struct SinkSpec {
+    std::string target;
+    std::vector<PixelFormat> formats;  // Accepted formats.
+    PixelFormat format = PIXFMT_GREY;  // The one frames are delivered in.
+    bool format_set = false;
+};
+
+// Split an optional trailing ":<format>[,<format>...]" off a sink argument.
+SinkSpec parseSinkSpec(const std::string& arg) {
+    SinkSpec spec;
+    spec.target = arg;
+    size_t colon = arg.rfind(':');
+    if (colon != std::string::npos && parsePixelFormatList(arg.substr(colon + 1), spec.formats)) {
+        spec.target = arg.substr(0, colon);
+        spec.format = spec.formats.front();
+        spec.format_set = true;
+    }
+    return spec;
+}
+
+// Create the sink named by a spec, or null if it is not supported here.
+std::unique_ptr<Sink> createSink(const SinkSpec& spec, int width, int height) {
+    if (spec.target.compare(0, 4, "shm:") == 0) {
+#ifdef __linux__
+        return std::unique_ptr<Sink>(new ShmSink(spec.target.substr(4), spec.format, width, height));
+#else
+        std::cerr << "Shared memory sinks are only supported on Linux." << std::endl;
+        return nullptr;
+#endif
+    }
+    if (spec.target.compare(0, 5, "file:") == 0 || spec.target == "-") {
+#ifdef __linux__
+        int fd = -1;
+        if (spec.target == "-") {
+            static bool stdout_taken = false;
+            if (stdout_taken) {
+                std::cerr << "Error: stdout can only be used by one sink." << std::endl;
+                return nullptr;
+            }
+            stdout_taken = true;
+            // Frames own stdout from now on; log messages go to stderr instead.
+            fd = dup(STDOUT_FILENO);
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        }
+        std::string path = spec.target == "-" ? std::string() : spec.target.substr(5);
+        return std::unique_ptr<Sink>(new RawSink(spec.target == "-" ? "stdout" : spec.target, path, fd,
+                                                 spec.format, width, height, frame_headers));
+#else
+        std::cerr << "File and pipe sinks are only supported on Linux." << std::endl;
+        return nullptr;
+#endif
+    }
+    if (spec.target.compare(0, 5, "unix:") == 0) {
+#ifdef __linux__
+        return std::unique_ptr<Sink>(new UnixSocketSink(spec.target.substr(5), spec.format, width, height));
+#else
+        std::cerr << "Unix socket sinks are only supported on Linux." << std::endl;
+        return nullptr;
+#endif
+    }
+    return std::unique_ptr<Sink>(new LoopbackSink(spec.target, spec.format, width, height, device_io));
+}
+
+// CPU time consumed by the calling thread, in nanoseconds.
+uint64_t threadCpuNanos() {
+#ifdef __linux__
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+#endif
+    return 0;
+}
+
+#ifdef __linux__
+// A timerfd expiring fps times per second, or -1 on error.
+int createPacingTimer(int fps, const std::string& name) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fd < 0) {
+        perror(("Creating pacer timer (" + name + ")").c_str());
+        return -1;
+    }
+    long period_ns = 1000000000L / fps;
+    struct itimerspec its;
+    std::memset(&its, 0, sizeof(its));
+    its.it_interval.tv_sec  = period_ns / 1000000000L;
+    its.it_interval.tv_nsec = period_ns % 1000000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(fd, 0, &its, nullptr) < 0) {
+        perror(("Arming pacer timer (" + name + ")").c_str());
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+// --- Sink Recovery ---
+//
+// A sink that cannot be opened, or whose output goes away while in use (a
+// loopback device being deleted, say), is not given up on: its writer thread
+// closes it and calls open() again after RETRY_FIRST_MS, doubling the wait after
+// every failed attempt up to RETRY_MAX_MS. Capture and the other sinks carry on
+// meanwhile, and frames that arrive for the sink while it is down are discarded
+// and counted. Reopening goes through open(), so a loopback device gets its
+// format, frame rate, buffers and reader notifications set up again.
+class SinkRecovery {
+public:
+    enum {
+        RETRY_FIRST_MS = 250,
+        RETRY_MAX_MS   = 30000
+    };
+
+    SinkRecovery() : down_(false), delay_ms_(RETRY_FIRST_MS), attempts_(0), discarded_(0) {}
+
+    bool down() const { return down_; }
+
+    // First open of the sink; on failure, retries are scheduled.
+    void open(Sink& sink, int fps) {
+        if (sink.open()) {
+            if (fps > 0)
+                sink.setFrameRate(fps);
+            return;
+        }
+        std::cerr << "Sink " << sink.name() << ": not available; retrying in the background." << std::endl;
+        goDown();
+    }
+
+    // A write failed; take the sink down if its output is gone.
+    void writeFailed(Sink& sink) {
+        if (down_ || !sink.outputLost())
+            return;
+        std::cerr << "Sink " << sink.name() << ": output lost; reopening in the background." << std::endl;
+        sink.closeOutput();
+        goDown();
+    }
+
+    // Count frames that could not be delivered because the sink is down.
+    void discard(uint64_t frames = 1) { discarded_ += frames; }
+
+    // Reopen the sink if a retry is due. Returns whether it is back.
+    bool retry(Sink& sink, int fps, std::chrono::steady_clock::time_point now) {
+        if (!down_ || now < next_attempt_)
+            return false;
+        ++attempts_;
+        sink.closeOutput();
+        if (!sink.open()) {
+            delay_ms_ = std::min(delay_ms_ * 2, static_cast<int>(RETRY_MAX_MS));
+            next_attempt_ = now + std::chrono::milliseconds(delay_ms_);
+            std::cerr << "Sink " << sink.name() << ": still not available; next attempt in "
+                      << delay_ms_ / 1000.0 << " s." << std::endl;
+            return false;
+        }
+        if (fps > 0)
+            sink.setFrameRate(fps);
+        std::cout << "Sink " << sink.name() << ": back after "
+                  << std::chrono::duration<double>(now - down_since_).count() << " s (" << attempts_
+                  << " attempts, " << discarded_ << " frames discarded)." << std::endl;
+        down_ = false;
+        return true;
+    }
+
+private:
+    void goDown() {
+        down_ = true;
+        down_since_ = std::chrono::steady_clock::now();
+        delay_ms_ = RETRY_FIRST_MS;
+        next_attempt_ = down_since_ + std::chrono::milliseconds(delay_ms_);
+        attempts_ = 0;
+        discarded_ = 0;
+    }
+
+    bool down_;
+    int delay_ms_;
+    unsigned attempts_;
+    uint64_t discarded_;  // Since the sink went down.
+    std::chrono::steady_clock::time_point down_since_;
+    std::chrono::steady_clock::time_point next_attempt_;
+};
+
+// --- Sink Writer ---
+//
+// Owns one sink and the thread that feeds it. submit() only replaces the pending
+// frame of the frame's stream (latest frame wins), so a slow sink drops frames
+// instead of blocking the capture loop or other sinks; replaced frames are
+// counted as dropped. Video and depth frames sent to the same sink each have
+// their own pending frame and never replace each other. Sinks
+// are written non-blocking: a frame arriving while the sink reports it cannot
+// take one (a full pipe, a device not accepting frames) is skipped and counted,
+// so the writer never hangs on a stuck consumer.
+//
+// With --fps the writer also paces the sink: a timerfd drives it at a constant
+// rate, and on every tick each stream sends its newest frame or repeats its
+// previous one if nothing new arrived, so one stream's rate never holds back the
+// other's. Without it, frames are written as soon as they are submitted.
+// A sink that is down is reopened in the background (SinkRecovery).
+//
+// Unpaced sinks with buffers of their own (a loopback device with --io mmap) can
+// also skip the frame copy: the writer dequeues a buffer and offers it, the
+// capture loop renders the next frame straight into it (acquireDirect(),
+// commitDirect()), and the writer queues it. All device calls stay on the writer
+// thread, and the offer is taken back before the sink can be closed.
+// Throughput, drops, CPU time per frame and (when paced) jitter are printed every
+// 10 seconds.
+class SinkWriter {
+public:
+    SinkWriter(std::unique_ptr<Sink> sink, int fps)
+        : sink_(std::move(sink)), fps_(fps), timer_fd_(-1), running_(false),
+          has_readers_(true), down_(false), missed_(0), pending_fresh_(), direct_state_(DIRECT_NONE),
+          direct_data_(nullptr), direct_index_(-1), direct_size_(0) {}
+
+    ~SinkWriter() { stop(); }
+
+    Sink& sink() { return *sink_; }
+
+    // Whether the sink had readers when last checked (always true without --on-demand).
+    bool hasReaders() const { return has_readers_; }
+    // Whether the sink is down and waiting to be reopened (SinkRecovery). Frames
+    // are neither rendered nor submitted for it meanwhile.
+    bool down() const { return down_; }
+    // Count a frame not rendered for the sink because it is down.
+    void discard() { ++missed_; }
+
+    bool start() {
+#ifdef __linux__
+        if (fps_ > 0) {
+            if (!startTimer()) {
+                std::cerr << "Output pacing disabled for " << sink_->name()
+                          << "; forwarding frames as they arrive." << std::endl;
+                fps_ = 0;
+            }
+        }
+#else
+        fps_ = 0;
+#endif
+        running_ = true;
+        thread_ = std::thread(&SinkWriter::run, this);
+        return true;
+    }
+
+    void stop() {
+        if (!running_.exchange(false))
+            return;
+        cond_.notify_all();
+        if (thread_.joinable())
+            thread_.join();
+#ifdef __linux__
+        if (timer_fd_ >= 0)
+            close(timer_fd_);
+        timer_fd_ = -1;
+#endif
+    }
+
+    // Hand a frame to the writer. Never blocks on the sink.
+    void submit(const FrameRef& frame) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_fresh_[frame->stream])
+                ++stats_.dropped;
+            pending_[frame->stream] = frame;
+            pending_fresh_[frame->stream] = true;
+        }
+        cond_.notify_one();
+    }
+
+    // The output buffer offered for the next frame, to render a frame of size
+    // bytes into and pass back with commitDirect(); null if none is offered
+    // (the frame then goes through submit()). Capture loop only.
+    uint8_t* acquireDirect(size_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (direct_state_ != DIRECT_OFFERED || size != direct_size_)
+            return nullptr;
+        direct_state_ = DIRECT_FILLING;
+        return direct_data_;
+    }
+
+    // The frame is in the acquired buffer; the writer queues it. A submitted
+    // frame of the same stream not yet written is older, and dropped.
+    void commitDirect(FrameStream stream, const FrameInfo& info) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            direct_state_ = DIRECT_FILLED;
+            direct_info_ = info;
+            if (pending_fresh_[stream]) {
+                ++stats_.dropped;
+                pending_[stream].reset();
+                pending_fresh_[stream] = false;
+            }
+        }
+        cond_.notify_all();
+    }
+
+private:
+    enum DirectState {
+        DIRECT_NONE,     // No buffer offered.
+        DIRECT_OFFERED,  // Reserved in the sink, waiting for acquireDirect().
+        DIRECT_FILLING,  // The capture loop is rendering into it.
+        DIRECT_FILLED    // Rendered, waiting to be queued by the writer.
+    };
+
+    struct Stats {
+        uint64_t written  = 0;
+        uint64_t failed   = 0;
+        uint64_t repeated = 0;
+        uint64_t dropped  = 0;
+        uint64_t skipped  = 0;
+        uint64_t discarded = 0;
+        uint64_t missed_ticks = 0;
+        uint64_t cpu_ns = 0;
+        uint64_t intervals = 0;
+        double   jitter_sum_us = 0.0;
+        double   jitter_sq_sum_us = 0.0;
+        double   jitter_max_us = 0.0;
+    };
+
+#ifdef __linux__
+    bool startTimer() {
+        timer_fd_ = createPacingTimer(fps_, sink_->name());
+        return timer_fd_ >= 0;
+    }
+
+    // Block until the next pacing tick; false on timeout.
+    bool waitTick() {
+        struct pollfd pfd = { timer_fd_, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0)
+            return false;
+        uint64_t expirations = 0;
+        if (read(timer_fd_, &expirations, sizeof(expirations)) != sizeof(expirations))
+            return false;
+        if (expirations > 1) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stats_.missed_ticks += expirations - 1;
+        }
+        return true;
+    }
+#endif
+
+    bool anyPending() const {
+        for (int i = 0; i < FRAME_STREAM_COUNT; i++) {
+            if (pending_fresh_[i])
+                return true;
+        }
+        return false;
+    }
+
+    // Move the pending frames into current, marking the streams that got one.
+    // Called with mutex_ held.
+    void takePending(FrameRef* current, bool* fresh) {
+        for (int i = 0; i < FRAME_STREAM_COUNT; i++) {
+            if (!pending_fresh_[i])
+                continue;
+            current[i].swap(pending_[i]);
+            pending_[i].reset();
+            pending_fresh_[i] = false;
+            fresh[i] = true;
+        }
+    }
+
+    // Write one frame to the sink, or account why it was not. Returns whether
+    // it was written.
+    bool deliver(const FrameRef& frame, bool fresh) {
+        if (fresh && recovery_.down()) {
+            recovery_.discard();
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++stats_.discarded;
+            return false;
+        }
+        if (!has_readers_ || recovery_.down())
+            return false;  // Nobody is reading; frames normally stop arriving shortly.
+        if (!sink_->writable()) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++stats_.skipped;
+            return false;
+        }
+        uint64_t cpu_start = threadCpuNanos();
+        bool ok = sink_->write(frame);
+        uint64_t cpu_ns = threadCpuNanos() - cpu_start;
+        if (!ok) {
+            withdrawDirect();
+            recovery_.writeFailed(*sink_);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++(ok ? stats_.written : stats_.failed);
+        stats_.cpu_ns += cpu_ns;
+        if (!fresh)
+            ++stats_.repeated;
+        return true;
+    }
+
+    // Reserve an output buffer for the capture loop to render into, if the sink
+    // has one free. Not while paced: repeats need the frame in a FrameRef.
+    void offerDirect() {
+        if (fps_ > 0 || !has_readers_ || recovery_.down())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (direct_state_ != DIRECT_NONE)
+                return;
+        }
+        if (!sink_->writable())
+            return;
+        int index;
+        uint8_t* data = sink_->mapBuffer(index);
+        if (!data)
+            return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        direct_data_ = data;
+        direct_index_ = index;
+        direct_size_ = sink_->frameSize();
+        direct_state_ = DIRECT_OFFERED;
+    }
+
+    // Queue a buffer the capture loop has filled (DIRECT_FILLED).
+    bool deliverDirect(int index, const FrameInfo& info) {
+        if (!has_readers_ || recovery_.down()) {
+            sink_->releaseBuffer(index);
+            return false;
+        }
+        uint64_t cpu_start = threadCpuNanos();
+        bool ok = sink_->queueBuffer(index, info);
+        uint64_t cpu_ns = threadCpuNanos() - cpu_start;
+        if (!ok) {
+            sink_->releaseBuffer(index);
+            recovery_.writeFailed(*sink_);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++(ok ? stats_.written : stats_.failed);
+        stats_.cpu_ns += cpu_ns;
+        return true;
+    }
+
+    // Take back the offered buffer before the sink may be closed, waiting for a
+    // render into it to finish; a frame rendered but not yet queued is dropped.
+    void withdrawDirect() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return direct_state_ != DIRECT_FILLING; });
+        if (direct_state_ == DIRECT_NONE)
+            return;
+        if (direct_state_ == DIRECT_FILLED)
+            ++stats_.dropped;
+        direct_state_ = DIRECT_NONE;
+        sink_->releaseBuffer(direct_index_);
+    }
+
+    void run() {
+        const double period_us = fps_ > 0 ? 1e6 / fps_ : 0.0;
+        std::chrono::steady_clock::time_point last_emit;
+        std::chrono::steady_clock::time_point last_report = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point last_demand_check;
+        bool have_last_emit = false;
+        // Last frame written per stream, kept for repeats when paced.
+        FrameRef current[FRAME_STREAM_COUNT];
+
+        // Opened here so a slow open (e.g. a FIFO waiting for its reader) never
+        // delays startup or the other sinks.
+        recovery_.open(*sink_, fps_);
+        down_ = recovery_.down();
+        offerDirect();
+
+        while (running_) {
+            bool fresh[FRAME_STREAM_COUNT] = {};
+            bool direct = false;  // A buffer the capture loop filled is to be queued.
+            int direct_index = -1;
+            FrameInfo direct_info;
+#ifdef __linux__
+            if (fps_ > 0) {
+                if (!waitTick())
+                    continue;
+                std::lock_guard<std::mutex> lock(mutex_);
+                takePending(current, fresh);
+            } else
+#endif
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait_for(lock, std::chrono::milliseconds(100),
+                               [this] { return anyPending() || direct_state_ == DIRECT_FILLED || !running_; });
+                takePending(current, fresh);
+                if (direct_state_ == DIRECT_FILLED) {
+                    direct = true;
+                    direct_index = direct_index_;
+                    direct_info = direct_info_;
+                    direct_state_ = DIRECT_NONE;
+                }
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (uint64_t missed = missed_.exchange(0)) {
+                recovery_.discard(missed);
+                std::lock_guard<std::mutex> lock(mutex_);
+                stats_.discarded += missed;
+            }
+            recovery_.retry(*sink_, fps_, now);
+            if (on_demand_streaming && now - last_demand_check >= std::chrono::milliseconds(100)) {
+                // A sink that is down has no readers, and frames stop being rendered for it.
+                bool readers = !recovery_.down() && sink_->hasReaders();
+                if (readers != has_readers_) {
+                    if (!recovery_.down()) {
+                        std::cout << "Sink " << sink_->name() << (readers ? ": reader connected." : ": no readers.")
+                                  << std::endl;
+                    }
+                    has_readers_ = readers;
+                }
+                last_demand_check = now;
+            }
+            // Each stream on its own: a paced tick sends every stream's newest
+            // frame, or repeats it. A frame rendered in place is older than a
+            // pending frame submitted after it, so it goes first.
+            bool emitted = direct && deliverDirect(direct_index, direct_info);
+            for (int i = 0; i < FRAME_STREAM_COUNT; i++) {
+                if (current[i] && (fresh[i] || fps_ > 0))
+                    emitted = deliver(current[i], fresh[i]) || emitted;
+            }
+            down_ = recovery_.down();
+            offerDirect();
+            if (emitted) {
+                if (fps_ > 0 && have_last_emit) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    double interval_us = std::chrono::duration<double, std::micro>(now - last_emit).count();
+                    double jitter_us = std::fabs(interval_us - period_us);
+                    ++stats_.intervals;
+                    stats_.jitter_sum_us += jitter_us;
+                    stats_.jitter_sq_sum_us += jitter_us * jitter_us;
+                    if (jitter_us > stats_.jitter_max_us)
+                        stats_.jitter_max_us = jitter_us;
+                }
+                last_emit = now;
+                have_last_emit = true;
+            }
+
+            if (now - last_report >= std::chrono::seconds(10)) {
+                report(std::chrono::duration<double>(now - last_report).count());
+                last_report = now;
+            }
+        }
+        withdrawDirect();
+    }
+
+    // Print and reset the statistics for the last reporting window.
+    void report(double window_s) {
+        Stats s;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            s = stats_;
+            stats_ = Stats();
+        }
+        uint64_t attempts = s.written + s.failed;
+        std::cout << "Sink " << sink_->name() << ": " << (s.written / window_s) << " fps"
+                  << ", " << (attempts ? s.cpu_ns / attempts / 1000.0 : 0.0) << " us CPU per frame"
+                  << ", dropped " << s.dropped
+                  << ", skipped " << s.skipped
+                  << ", failed " << s.failed
+                  << ", discarded " << s.discarded << (recovery_.down() ? " (down)" : "");
+        if (fps_ > 0) {
+            double mean = s.intervals ? s.jitter_sum_us / s.intervals : 0.0;
+            double var  = s.intervals ? s.jitter_sq_sum_us / s.intervals - mean * mean : 0.0;
+            std::cout << ", jitter mean " << mean << " us"
+                      << ", stddev " << std::sqrt(var > 0.0 ? var : 0.0) << " us"
+                      << ", max " << s.jitter_max_us << " us"
+                      << ", repeated " << s.repeated
+                      << ", missed ticks " << s.missed_ticks;
+        }
+        std::string extra = sink_->statusReport();
+        if (!extra.empty())
+            std::cout << ", " << extra;
+        std::cout << std::endl;
+    }
+
+    std::unique_ptr<Sink> sink_;
+    int fps_;
+    int timer_fd_;
+    std::atomic<bool> running_;
+    std::atomic<bool> has_readers_;
+    std::atomic<bool> down_;        // Mirrors recovery_ for the capture thread.
+    std::atomic<uint64_t> missed_;  // Frames discard()ed, not yet in the statistics.
+    std::thread thread_;
+    SinkRecovery recovery_;  // Writer thread only.
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    FrameRef pending_[FRAME_STREAM_COUNT];  // Latest submitted frame per stream, guarded by mutex_.
+    bool pending_fresh_[FRAME_STREAM_COUNT];
+    Stats stats_;
+    // The buffer offered for rendering in place, guarded by mutex_. Only the
+    // writer moves it out of DIRECT_NONE or DIRECT_FILLED.
+    DirectState direct_state_;
+    uint8_t* direct_data_;
+    int direct_index_;
+    size_t direct_size_;
+    FrameInfo direct_info_;
+};
+
+// --- Batched Sink Writes ---
+//
+// With --io-uring, the sinks that take a frame in a single write() (loopback
+// devices using write I/O, plain files) are fed by one BatchWriter per stream
+// instead of a SinkWriter each. For every frame set (the frames of all formats
+// rendered from one capture) it queues one write per sink and hands them all to
+// the kernel with a single io_uring_enter(), so the syscalls per frame no longer
+// grow with the number of sinks. Frame pool buffers are registered with the ring
+// the first time they are seen; as the pool recycles a handful of buffers, after
+// the first frames writes use IORING_OP_WRITE_FIXED and the kernel no longer
+// maps the buffer for every write.
+//
+// Completions are signalled on an eventfd and go through the sink's own error
+// handling; the time from submission to completion is reported per sink. A sink
+// still busy with its previous write, or not writable, skips the frame as it
+// would with a SinkWriter, and a sink that is down is reopened in the background
+// (SinkRecovery). Without io_uring (old kernels, seccomp) the sinks get a
+// SinkWriter each instead.
+#ifdef __linux__
+// The parts of io_uring a BatchWriter needs, on the raw system calls.
+class IoUring {
+public:
+    IoUring()
+        : fd_(-1), event_fd_(-1), sq_ring_(MAP_FAILED), cq_ring_(MAP_FAILED), sqes_(nullptr),
+          sq_ring_size_(0), cq_ring_size_(0), sq_entries_(0) {}
+
+    ~IoUring() {
+        if (sqes_)
+            munmap(sqes_, sq_entries_ * sizeof(struct io_uring_sqe));
+        if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+            munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ != MAP_FAILED)
+            munmap(sq_ring_, sq_ring_size_);
+        if (event_fd_ >= 0)
+            close(event_fd_);
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    // Create a ring for up to `entries` writes in flight, with completions
+    // signalled on eventFd(). False with errno set on failure.
+    bool init(unsigned entries) {
+        struct io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+        if (fd_ < 0)
+            return false;
+        // Writes at offset -1 append at the file position (Linux 5.6).
+        if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+            errno = ENOSYS;
+            return false;
+        }
+        sq_entries_   = p.sq_entries;
+        sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED)
+            return false;
+        cq_ring_ = sq_ring_;
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+            cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            fd_, IORING_OFF_CQ_RING);
+            if (cq_ring_ == MAP_FAILED)
+                return false;
+        }
+        void* sqes = mmap(nullptr, sq_entries_ * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+        sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+        uint8_t* sq = static_cast<uint8_t*>(sq_ring_);
+        uint8_t* cq = static_cast<uint8_t*>(cq_ring_);
+        sq_head_  = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sq_tail_  = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask_  = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        cq_head_  = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail_  = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask_  = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes_     = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+        event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (event_fd_ < 0)
+            return false;
+        return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_EVENTFD, &event_fd_, 1) == 0;
+    }
+
+    // Readable whenever completions were posted.
+    int eventFd() const { return event_fd_; }
+
+    // Reserve an empty table of `count` registered buffers, filled by setBuffer().
+    bool registerBufferTable(unsigned count) {
+#ifdef IORING_RSRC_REGISTER_SPARSE
+        struct io_uring_rsrc_register reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.nr    = count;
+        reg.flags = IORING_RSRC_REGISTER_SPARSE;
+        return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0;
+#else
+        (void)count;
+        errno = ENOSYS;
+        return false;
+#endif
+    }
+
+    // Register memory as buffer `slot`, replacing what was there. Writes already
+    // submitted keep the buffer they were submitted with.
+    bool setBuffer(unsigned slot, const void* base, size_t length) {
+#ifdef IORING_RSRC_REGISTER_SPARSE
+        struct iovec iov = { const_cast<void*>(base), length };
+        struct io_uring_rsrc_update2 update;
+        std::memset(&update, 0, sizeof(update));
+        update.offset = slot;
+        update.data   = reinterpret_cast<uintptr_t>(&iov);
+        update.nr     = 1;
+        return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) == 1;
+#else
+        (void)slot;
+        (void)base;
+        (void)length;
+        errno = ENOSYS;
+        return false;
+#endif
+    }
+
+    // The next submission entry, cleared, or null if the queue is full.
+    struct io_uring_sqe* nextSqe() {
+        unsigned tail = *sq_tail_;
+        if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+            return nullptr;
+        unsigned index = tail & sq_mask_;
+        std::memset(&sqes_[index], 0, sizeof(sqes_[index]));
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        return &sqes_[index];
+    }
+
+    // Hand every queued entry to the kernel with one system call. Entries it
+    // did not take stay queued for the next call.
+    int submit() {
+        unsigned queued = *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (queued == 0)
+            return 0;
+        int ret;
+        do {
+            ret = static_cast<int>(syscall(__NR_io_uring_enter, fd_, queued, 0, 0, nullptr, 0));
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    bool popCompletion(struct io_uring_cqe& cqe) {
+        unsigned head = *cq_head_;
+        if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+            return false;
+        cqe = cqes_[head & cq_mask_];
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    int fd_;
+    int event_fd_;
+    void* sq_ring_;
+    void* cq_ring_;
+    struct io_uring_sqe* sqes_;
+    size_t sq_ring_size_;
+    size_t cq_ring_size_;
+    unsigned sq_entries_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    struct io_uring_cqe* cqes_;
+};
+
+class BatchWriter {
+public:
+    enum { BUFFER_SLOTS = 16 };  // Registered buffers, reused least recently used first.
+
+    explicit BatchWriter(int fps)
+        : fps_(fps), wake_fd_(-1), timer_fd_(-1), running_(false), fixed_buffers_(false),
+          use_clock_(0), pending_fresh_() {}
+
+    ~BatchWriter() {
+        stop();
+        if (wake_fd_ >= 0)
+            close(wake_fd_);
+    }
+
+    void add(std::unique_ptr<Sink> sink) { entries_.emplace_back(new Entry(std::move(sink))); }
+
+    // Set up the ring. On failure the sinks can be taken back with releaseSinks().
+    bool init() {
+        unsigned entries = 1;
+        while (entries < entries_.size())
+            entries <<= 1;
+        if (!ring_.init(entries)) {
+            perror("Setting up io_uring");
+            return false;
+        }
+        wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (wake_fd_ < 0) {
+            perror("Creating eventfd");
+            return false;
+        }
+        fixed_buffers_ = ring_.registerBufferTable(BUFFER_SLOTS);
+        if (!fixed_buffers_)
+            perror("Reserving io_uring buffer table; writing from unregistered buffers");
+        buffers_.assign(BUFFER_SLOTS, RegisteredBuffer());
+        std::cout << "io_uring batching writes to " << describe()
+                  << (fixed_buffers_ ? " from registered buffers." : ".") << std::endl;
+        return true;
+    }
+
+    std::vector<std::unique_ptr<Sink>> releaseSinks() {
+        std::vector<std::unique_ptr<Sink>> sinks;
+        for (auto& e : entries_)
+            sinks.push_back(std::move(e->sink));
+        entries_.clear();
+        return sinks;
+    }
+
+    void start() {
+        if (fps_ > 0) {
+            timer_fd_ = createPacingTimer(fps_, "io_uring batch");
+            if (timer_fd_ < 0) {
+                std::cerr << "Output pacing disabled for " << describe()
+                          << "; forwarding frames as they arrive." << std::endl;
+                fps_ = 0;
+            }
+        }
+        running_ = true;
+        thread_ = std::thread(&BatchWriter::run, this);
+    }
+
+    void stop() {
+        if (!running_.exchange(false))
+            return;
+        wake();
+        if (thread_.joinable())
+            thread_.join();
+        if (timer_fd_ >= 0)
+            close(timer_fd_);
+        timer_fd_ = -1;
+    }
+
+    // Whether any sink has readers / any sink with readers takes format.
+    bool hasReaders() const {
+        for (const auto& e : entries_) {
+            if (e->has_readers)
+                return true;
+        }
+        return false;
+    }
+
+    // Sinks that are down do not count; see SinkWriter::down().
+    bool wants(PixelFormat format) const {
+        for (const auto& e : entries_) {
+            if (e->has_readers && !e->down && e->sink->format() == format)
+                return true;
+        }
+        return false;
+    }
+
+    // Count a frame of format not rendered for the sinks taking it that are down.
+    void discard(PixelFormat format) {
+        for (auto& e : entries_) {
+            if (e->down && e->sink->format() == format)
+                ++e->missed;
+        }
+    }
+
+    // Hand over a frame set (one frame per format, all of one stream). Never
+    // blocks on the sinks; a set of the same stream not yet taken is replaced and
+    // counted as dropped.
+    void submit(const std::vector<FrameRef>& frames) {
+        const FrameStream stream = frames.front()->stream;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_fresh_[stream]) {
+                for (auto& e : entries_) {
+                    if (e->has_readers && !e->down && frameFor(pending_[stream], e->sink->format()))
+                        ++e->stats.dropped;
+                }
+            }
+            pending_[stream] = frames;
+            pending_fresh_[stream] = true;
+        }
+        wake();
+    }
+
+    std::string describe() const {
+        std::string names;
+        for (const auto& e : entries_)
+            names += (names.empty() ? "" : ", ") + e->sink->name();
+        return names;
+    }
+
+private:
+    struct Stats {
+        uint64_t written = 0;
+        uint64_t failed  = 0;
+        uint64_t dropped = 0;
+        uint64_t skipped = 0;
+        uint64_t discarded = 0;
+        uint64_t completions = 0;
+        uint64_t latency_sum_ns = 0;
+        uint64_t latency_max_ns = 0;
+    };
+
+    struct Entry {
+        explicit Entry(std::unique_ptr<Sink> s)
+            : sink(std::move(s)), has_readers(true), down(false), missed(0), submitted_ns(0) {}
+        std::unique_ptr<Sink> sink;
+        std::atomic<bool> has_readers;
+        std::atomic<bool> down;        // Mirrors recovery for the capture thread.
+        std::atomic<uint64_t> missed;  // Frames discard()ed, not yet in the statistics.
+        FrameRef in_flight;     // Frame the kernel is writing, held until it completes.
+        FrameRef waiting;       // Fresh frame of another stream, written once in_flight completes.
+        uint64_t submitted_ns;
+        SinkRecovery recovery;  // Writer thread only.
+        Stats stats;            // Guarded by mutex_.
+    };
+
+    struct BatchStats {
+        uint64_t submissions = 0;
+        uint64_t writes = 0;
+        uint64_t fixed  = 0;
+        uint64_t repeated = 0;
+        uint64_t missed_ticks = 0;
+        uint64_t cpu_ns = 0;
+        uint64_t intervals = 0;
+        double   jitter_sum_us = 0.0;
+        double   jitter_sq_sum_us = 0.0;
+        double   jitter_max_us = 0.0;
+    };
+
+    struct RegisteredBuffer {
+        uint64_t buffer_id = 0;  // SharedFrame::buffer_id, 0 = empty slot.
+        uint64_t last_used = 0;
+    };
+
+    static FrameRef frameFor(const std::vector<FrameRef>& frames, PixelFormat format) {
+        for (const auto& f : frames) {
+            if (f->format == format)
+                return f;
+        }
+        return FrameRef();
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        if (wake_fd_ >= 0 && ::write(wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("Waking io_uring batch writer");
+    }
+
+    static void drain(int fd) {
+        uint64_t count;
+        while (read(fd, &count, sizeof(count)) == sizeof(count)) {
+        }
+    }
+
+    // Registered buffer slot holding frame's memory, registering it if needed;
+    // -1 to write it unregistered. batch_start is the use clock when the current
+    // batch began: slots already used by it are not replaced.
+    int fixedBuffer(const SharedFrame& frame, uint64_t batch_start) {
+        if (!fixed_buffers_)
+            return -1;
+        size_t victim = 0;
+        for (size_t i = 0; i < buffers_.size(); i++) {
+            if (buffers_[i].buffer_id == frame.buffer_id) {
+                buffers_[i].last_used = ++use_clock_;
+                return static_cast<int>(i);
+            }
+            if (buffers_[i].last_used < buffers_[victim].last_used)
+                victim = i;
+        }
+        if (buffers_[victim].last_used > batch_start)
+            return -1;
+        // The whole allocation, so the slot stays valid if the frame is reused at
+        // a larger size without reallocating.
+        if (!ring_.setBuffer(static_cast<unsigned>(victim), frame.data.data(), frame.data.capacity())) {
+            perror("Registering frame buffer with io_uring; writing from unregistered buffers");
+            fixed_buffers_ = false;
+            return -1;
+        }
+        buffers_[victim].buffer_id = frame.buffer_id;
+        buffers_[victim].last_used = ++use_clock_;
+        return static_cast<int>(victim);
+    }
+
+    // Queue a write of frame to entry i, or write it directly when the ring
+    // cannot take it. Returns whether the write was queued, and sets `fixed`
+    // when it uses a registered buffer.
+    bool queueWrite(size_t i, const FrameRef& frame, uint64_t batch_start, bool& fixed) {
+        Entry& e = *entries_[i];
+        int fd = e.sink->batchFd();
+        struct io_uring_sqe* sqe = fd >= 0 ? ring_.nextSqe() : nullptr;
+        fixed = false;
+        if (!sqe) {
+            // Not open (the sink's own write() reports why) or no room in the ring.
+            bool ok = e.sink->write(frame);
+            if (!ok)
+                e.recovery.writeFailed(*e.sink);
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++(ok ? e.stats.written : e.stats.failed);
+            return false;
+        }
+        int slot = fixedBuffer(*frame, batch_start);
+        sqe->opcode = slot >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd     = fd;
+        sqe->addr   = reinterpret_cast<uintptr_t>(frame->data.data());
+        sqe->len    = static_cast<uint32_t>(frame->data.size());
+        sqe->off    = static_cast<uint64_t>(-1);  // The file position; ignored by devices.
+        sqe->user_data = i;
+        if (slot >= 0) {
+            sqe->buf_index = static_cast<uint16_t>(slot);
+            fixed = true;
+        }
+        e.in_flight = frame;
+        e.submitted_ns = monotonicNanos();
+        return true;
+    }
+
+    // Queue a write of its frame for every sink that can take one now, and
+    // submit them together. A sink still writing a frame of the other stream
+    // keeps a fresh frame as waiting instead of skipping it, so video and depth
+    // going to the same sink do not crowd each other out.
+    void submitSet(const std::vector<FrameRef>& frames, bool fresh) {
+        uint64_t cpu_start = threadCpuNanos();
+        uint64_t batch_start = use_clock_;
+        unsigned queued = 0, fixed = 0;
+        for (size_t i = 0; i < entries_.size(); i++) {
+            Entry& e = *entries_[i];
+            FrameRef frame = frameFor(frames, e.sink->format());
+            if (frame && fresh && e.recovery.down()) {
+                e.recovery.discard();
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++e.stats.discarded;
+                continue;
+            }
+            if (!frame || !e.has_readers || e.recovery.down())
+                continue;
+            if (e.in_flight && fresh && e.in_flight->stream != frame->stream) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (e.waiting)
+                    ++e.stats.dropped;
+                e.waiting = frame;
+                continue;
+            }
+            if (e.in_flight || !e.sink->writable()) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++e.stats.skipped;
+                continue;
+            }
+            bool fixed_write;
+            if (queueWrite(i, frame, batch_start, fixed_write)) {
+                ++queued;
+                fixed += fixed_write ? 1 : 0;
+            }
+        }
+        finishBatch(queued, fixed, fresh, threadCpuNanos() - cpu_start);
+    }
+
+    // Queue the waiting frames of sinks whose previous write has completed.
+    void submitWaiting() {
+        uint64_t cpu_start = threadCpuNanos();
+        uint64_t batch_start = use_clock_;
+        unsigned queued = 0, fixed = 0;
+        for (size_t i = 0; i < entries_.size(); i++) {
+            Entry& e = *entries_[i];
+            if (!e.waiting || e.in_flight)
+                continue;
+            FrameRef frame;
+            frame.swap(e.waiting);
+            if (!e.has_readers || e.recovery.down())
+                continue;
+            if (!e.sink->writable()) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++e.stats.skipped;
+                continue;
+            }
+            bool fixed_write;
+            if (queueWrite(i, frame, batch_start, fixed_write)) {
+                ++queued;
+                fixed += fixed_write ? 1 : 0;
+            }
+        }
+        if (queued > 0)
+            finishBatch(queued, fixed, true, threadCpuNanos() - cpu_start);
+    }
+
+    // Submit the writes queued for one batch and account for it.
+    void finishBatch(unsigned queued, unsigned fixed, bool fresh, uint64_t cpu_ns) {
+        if (queued > 0 && ring_.submit() < 0)
+            perror("Submitting writes to io_uring");  // Still queued; retried with the next set.
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queued > 0) {
+            ++batch_.submissions;
+            batch_.writes += queued;
+            batch_.fixed  += fixed;
+            if (!fresh)
+                ++batch_.repeated;
+        }
+        batch_.cpu_ns += cpu_ns;
+    }
+
+    // Hand finished writes back to their sinks.
+    void reapCompletions() {
+        struct io_uring_cqe cqe;
+        while (ring_.popCompletion(cqe)) {
+            if (cqe.user_data >= entries_.size())
+                continue;
+            Entry& e = *entries_[cqe.user_data];
+            if (!e.in_flight)
+                continue;
+            uint64_t latency_ns = monotonicNanos() - e.submitted_ns;
+            bool ok = e.sink->batchWritten(e.in_flight, cqe.res);
+            e.in_flight.reset();
+            if (!ok)
+                e.recovery.writeFailed(*e.sink);
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++(ok ? e.stats.written : e.stats.failed);
+            ++e.stats.completions;
+            e.stats.latency_sum_ns += latency_ns;
+            e.stats.latency_max_ns = std::max(e.stats.latency_max_ns, latency_ns);
+        }
+    }
+
+    bool anyInFlight() const {
+        for (const auto& e : entries_) {
+            if (e->in_flight)
+                return true;
+        }
+        return false;
+    }
+
+    void run() {
+        const double period_us = fps_ > 0 ? 1e6 / fps_ : 0.0;
+        std::chrono::steady_clock::time_point last_emit;
+        std::chrono::steady_clock::time_point last_report = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point last_demand_check;
+        bool have_last_emit = false;
+        // Last frame set submitted per stream, kept for repeats when paced.
+        std::vector<FrameRef> current[FRAME_STREAM_COUNT];
+
+        for (auto& e : entries_) {
+            e->recovery.open(*e->sink, fps_);
+            e->down = e->recovery.down();
+        }
+
+        while (running_) {
+            struct pollfd pfds[3] = {
+                { wake_fd_, POLLIN, 0 },
+                { ring_.eventFd(), POLLIN, 0 },
+                { timer_fd_, POLLIN, 0 },
+            };
+            if (poll(pfds, timer_fd_ >= 0 ? 3 : 2, 100) < 0 && errno != EINTR) {
+                perror("Waiting in io_uring batch writer");
+                break;
+            }
+            if (pfds[1].revents & POLLIN) {
+                drain(ring_.eventFd());
+                reapCompletions();
+            }
+            if (pfds[0].revents & POLLIN)
+                drain(wake_fd_);
+            bool tick = false;
+            if (timer_fd_ >= 0 && (pfds[2].revents & POLLIN)) {
+                uint64_t expirations = 0;
+                if (read(timer_fd_, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                    tick = true;
+                    if (expirations > 1) {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        batch_.missed_ticks += expirations - 1;
+                    }
+                }
+            }
+            bool fresh[FRAME_STREAM_COUNT] = {};
+            if (fps_ == 0 || tick) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (int i = 0; i < FRAME_STREAM_COUNT; i++) {
+                    if (!pending_fresh_[i])
+                        continue;
+                    current[i].swap(pending_[i]);
+                    pending_[i].clear();
+                    pending_fresh_[i] = false;
+                    fresh[i] = true;
+                }
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            for (auto& e : entries_) {
+                if (uint64_t missed = e->missed.exchange(0)) {
+                    e->recovery.discard(missed);
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    e->stats.discarded += missed;
+                }
+                if (!e->in_flight)
+                    e->recovery.retry(*e->sink, fps_, now);
+            }
+            if (on_demand_streaming && now - last_demand_check >= std::chrono::milliseconds(100)) {
+                for (auto& e : entries_) {
+                    bool readers = !e->recovery.down() && e->sink->hasReaders();
+                    if (readers != e->has_readers) {
+                        if (!e->recovery.down()) {
+                            std::cout << "Sink " << e->sink->name()
+                                      << (readers ? ": reader connected." : ": no readers.") << std::endl;
+                        }
+                        e->has_readers = readers;
+                    }
+                }
+                last_demand_check = now;
+            }
+            submitWaiting();
+            // Each stream on its own: a paced tick submits every stream's newest
+            // set, or repeats it.
+            bool emitted = false;
+            for (int i = 0; i < FRAME_STREAM_COUNT; i++) {
+                if (!current[i].empty() && (fresh[i] || tick)) {
+                    submitSet(current[i], fresh[i]);
+                    emitted = true;
+                }
+            }
+            for (auto& e : entries_)
+                e->down = e->recovery.down();
+            if (emitted) {
+                if (fps_ > 0 && have_last_emit) {
+                    double interval_us = std::chrono::duration<double, std::micro>(now - last_emit).count();
+                    double jitter_us = std::fabs(interval_us - period_us);
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    ++batch_.intervals;
+                    batch_.jitter_sum_us += jitter_us;
+                    batch_.jitter_sq_sum_us += jitter_us * jitter_us;
+                    batch_.jitter_max_us = std::max(batch_.jitter_max_us, jitter_us);
+                }
+                last_emit = now;
+                have_last_emit = true;
+            }
+
+            if (now - last_report >= std::chrono::seconds(10)) {
+                report(std::chrono::duration<double>(now - last_report).count());
+                last_report = now;
+            }
+        }
+
+        // Let writes in flight finish (briefly) before the sinks are closed.
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (anyInFlight() && std::chrono::steady_clock::now() < deadline) {
+            struct pollfd pfd = { ring_.eventFd(), POLLIN, 0 };
+            if (poll(&pfd, 1, 100) > 0)
+                drain(ring_.eventFd());
+            reapCompletions();
+        }
+    }
+
+    // Print and reset the statistics for the last reporting window.
+    void report(double window_s) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& e : entries_) {
+            const Stats& s = e->stats;
+            std::cout << "Sink " << e->sink->name() << ": " << (s.written / window_s) << " fps"
+                      << ", dropped " << s.dropped
+                      << ", skipped " << s.skipped
+                      << ", failed " << s.failed
+                      << ", discarded " << s.discarded << (e->recovery.down() ? " (down)" : "")
+                      << ", write latency mean "
+                      << (s.completions ? s.latency_sum_ns / s.completions / 1000.0 : 0.0) << " us"
+                      << ", max " << s.latency_max_ns / 1000.0 << " us";
+            std::string extra = e->sink->statusReport();
+            if (!extra.empty())
+                std::cout << ", " << extra;
+            std::cout << std::endl;
+            e->stats = Stats();
+        }
+        const BatchStats& b = batch_;
+        std::cout << "io_uring batches: " << (b.submissions / window_s) << " submissions/s"
+                  << ", " << (b.submissions ? static_cast<double>(b.writes) / b.submissions : 0.0)
+                  << " writes each"
+                  << ", " << (b.writes ? 100.0 * b.fixed / b.writes : 0.0) << "% from registered buffers"
+                  << ", " << (b.submissions ? b.cpu_ns / b.submissions / 1000.0 : 0.0) << " us CPU per batch";
+        if (fps_ > 0) {
+            double mean = b.intervals ? b.jitter_sum_us / b.intervals : 0.0;
+            double var  = b.intervals ? b.jitter_sq_sum_us / b.intervals - mean * mean : 0.0;
+            std::cout << ", jitter mean " << mean << " us"
+                      << ", stddev " << std::sqrt(var > 0.0 ? var : 0.0) << " us"
+                      << ", max " << b.jitter_max_us << " us"
+                      << ", repeated " << b.repeated
+                      << ", missed ticks " << b.missed_ticks;
+        }
+        std::cout << std::endl;
+        batch_ = BatchStats();
+    }
+
+    std::vector<std::unique_ptr<Entry>> entries_;
+    IoUring ring_;
+    int fps_;
+    int wake_fd_;   // eventfd signalled by submit() and stop().
+    int timer_fd_;
+    std::atomic<bool> running_;
+    std::thread thread_;
+
+    // Writer thread only.
+    bool fixed_buffers_;
+    std::vector<RegisteredBuffer> buffers_;
+    uint64_t use_clock_;
+
+    std::mutex mutex_;
+    std::vector<FrameRef> pending_[FRAME_STREAM_COUNT];  // Latest submitted set per stream, guarded by mutex_.
+    bool pending_fresh_[FRAME_STREAM_COUNT];
+    BatchStats batch_;
+};
+#endif
+
+// --- Stream Output ---
+//
+// The sinks fed by one stream. Frames are converted once per distinct format in
+// formats() and published to every sink taking that format. With --io-uring,
+// sinks that can be batched share a BatchWriter, which gets each frame set at
+// flush().
+class StreamOutput {
+public:
+    void add(std::unique_ptr<Sink> sink) {
+        PixelFormat format = sink->format();
+        if (std::find(formats_.begin(), formats_.end(), format) == formats_.end())
+            formats_.push_back(format);
+#ifdef __linux__
+        if (use_io_uring && sink->batchable()) {
+            if (!batch_)
+                batch_.reset(new BatchWriter(output_fps));
+            batch_->add(std::move(sink));
+            return;
+        }
+#endif
+        writers_.emplace_back(new SinkWriter(std::move(sink), output_fps));
+    }
+
+    void start() {
+#ifdef __linux__
+        if (batch_ && !batch_->init()) {
+            std::cerr << "io_uring unavailable; writing " << batch_->describe() << " with write()." << std::endl;
+            for (auto& sink : batch_->releaseSinks())
+                writers_.emplace_back(new SinkWriter(std::move(sink), output_fps));
+            batch_.reset();
+        }
+        if (batch_)
+            batch_->start();
+#endif
+        for (auto& w : writers_)
+            w->start();
+    }
+
+    bool empty() const {
+#ifdef __linux__
+        if (batch_)
+            return false;
+#endif
+        return writers_.empty();
+    }
+    const std::vector<PixelFormat>& formats() const { return formats_; }
+
+    // Whether any sink has readers, i.e. the stream is worth capturing.
+    bool active() const {
+        for (const auto& w : writers_) {
+            if (w->hasReaders())
+                return true;
+        }
+#ifdef __linux__
+        if (batch_ && batch_->hasReaders())
+            return true;
+#endif
+        return false;
+    }
+
+    // Whether any sink with readers that is not down takes format, i.e. it is
+    // worth converting to. Called once per frame and format; sinks taking format
+    // that are down count the frame as discarded.
+    bool wants(PixelFormat format) {
+        bool wanted = false;
+        for (auto& w : writers_) {
+            if (w->sink().format() != format)
+                continue;
+            if (w->down())
+                w->discard();
+            else if (w->hasReaders())
+                wanted = true;
+        }
+#ifdef __linux__
+        if (batch_) {
+            batch_->discard(format);
+            wanted = batch_->wants(format) || wanted;
+        }
+#endif
+        return wanted;
+    }
+
+    // The writer to render a frame of format into in place (SinkWriter::
+    // acquireDirect()): only when a single sink takes the format, since any other
+    // would need a copy of the frame anyway.
+    SinkWriter* directWriter(PixelFormat format) {
+        SinkWriter* direct = nullptr;
+        for (auto& w : writers_) {
+            if (w->sink().format() != format || !w->hasReaders() || w->down())
+                continue;
+            if (direct)
+                return nullptr;
+            direct = w.get();
+        }
+#ifdef __linux__
+        if (batch_ && batch_->wants(format))
+            return nullptr;
+#endif
+        return direct;
+    }
+
+    void publish(const FrameRef& frame) {
+        for (auto& w : writers_) {
+            if (w->sink().format() == frame->format && w->hasReaders() && !w->down())
+                w->submit(frame);
+        }
+#ifdef __linux__
+        if (batch_ && batch_->wants(frame->format))
+            staged_.push_back(frame);
+#endif
+    }
+
+    // Marks the end of a frame set: everything published since the last call
+    // goes to the batched sinks in one submission.
+    void flush() {
+#ifdef __linux__
+        if (batch_ && !staged_.empty()) {
+            batch_->submit(staged_);
+            staged_.clear();
+        }
+#endif
+    }
+
+    // Comma-separated sink names, for log messages.
+    std::string describe() const {
+        std::string names;
+        for (const auto& w : writers_)
+            names += (names.empty() ? "" : ", ") + w->sink().name();
+#ifdef __linux__
+        if (batch_)
+            names += (names.empty() ? "" : ", ") + batch_->describe();
+#endif
+        return names;
+    }
+
+private:
+    std::vector<std::unique_ptr<SinkWriter>> writers_;
+    std::vector<PixelFormat> formats_;
+#ifdef __linux__
+    std::unique_ptr<BatchWriter> batch_;
+    std::vector<FrameRef> staged_;  // Published since the last flush().
+#endif
+};
+
+// One frame being rendered for a format of a stream: straight into the output
+// buffer of the only sink taking the format when its writer offers one, else into
+// a pool frame published to every sink taking the format.
+class OutputFrame {
+public:
+    OutputFrame(StreamOutput& output, FramePool& pool, PixelFormat format, size_t size)
+        : output_(output), format_(format), direct_(output.directWriter(format)), data_(nullptr) {
+        if (direct_)
+            data_ = direct_->acquireDirect(size);
+        if (!data_) {
+            direct_ = nullptr;
+            frame_ = pool.acquire(size);
+            data_ = frame_->data.data();
+        }
+    }
+
+    uint8_t* data() const { return data_; }
+
+    // Hand the rendered frame to the sinks.
+    void finish(FrameStream stream, int width, int height, const FrameInfo& info) {
+        if (direct_) {
+            direct_->commitDirect(stream, info);
+            return;
+        }
+        frame_->stream = stream;
+        frame_->format = format_;
+        frame_->width  = width;
+        frame_->height = height;
+        frame_->info   = info;
+        output_.publish(frame_);
+    }
+
+private:
+    StreamOutput& output_;
+    PixelFormat format_;
+    SinkWriter* direct_;
+    std::shared_ptr<SharedFrame> frame_;
+    uint8_t* data_;
+};
+
+// Converts captured frames into one sink format: a video pipeline per capture
+// mode and a depth pipeline, each sized to its region of the output frame. The
+// colour pipeline reads colour, the source format of the RGB capture mode.
+struct FormatRenderer {
+    PixelFormat format;
+    std::unique_ptr<FramePipeline> rgb, ir, depth;
+};
+
+FormatRenderer makeRenderer(PixelFormat format, const PipelineConfig& base,
+                            const Region& videoRegion, const Region& depthRegion,
+                            SourceFormat colour, bool rgb, bool ir, bool depth) {
+    FormatRenderer r;
+    r.format = format;
+    PipelineConfig videoConfig = base;
+    videoConfig.format     = format;
+    videoConfig.out_width  = videoRegion.w;
+    videoConfig.out_height = videoRegion.h;
+    if (rgb) {
+        r.rgb.reset(new FramePipeline(colour, WIDTH, HEIGHT, videoConfig));
+        std::cout << "Video pipeline: " << r.rgb->describe() << std::endl;
+    }
+    if (ir) {
+        r.ir.reset(new FramePipeline(SOURCE_GREY, WIDTH, HEIGHT, videoConfig));
+        std::cout << "Video pipeline" << (rgb ? " (IR)" : "") << ": " << r.ir->describe() << std::endl;
+    }
+    if (depth) {
+        // Tone and colour correction are meant for the camera image, not the depth map.
+        PipelineConfig depthConfig = videoConfig;
+        depthConfig.gamma = 1.0;
+        depthConfig.saturation = 1.0;
+        depthConfig.out_width  = depthRegion.w;
+        depthConfig.out_height = depthRegion.h;
+        r.depth.reset(new FramePipeline(SOURCE_DEPTH11, WIDTH, HEIGHT, depthConfig));
+        std::cout << "Depth pipeline: " << r.depth->describe() << std::endl;
+    }
+    return r;
+}
+
+// --- Format Negotiation ---
+//
+// A sink may accept several formats (--sink <target>:yuyv,uyvy). planFormats()
+// picks one per sink, and the mode --rgb captures in, so that the pipelines the
+// chosen formats need cost the least: each stream converts a frame once per
+// distinct format, so sinks settling on a shared format save whole conversions,
+// and a format the capture already has is a plain copy. Costs are static
+// estimates (kernelCyclesPerPixel() plus the capture itself), good enough to rank
+// paths, not to predict CPU load.
+//
+// Besides RGB, the Kinect can send its raw UYVY, which skips the Bayer conversion
+// in libfreenect and feeds UYVY sinks by copying and YUYV sinks by swapping bytes.
+// It only runs at 15 fps and bypasses the stages that expect RGB24 frames, so it is
+// only considered when nothing needs more.
+struct FormatPlan {
+    freenect_video_format colour_mode = FREENECT_VIDEO_RGB;  // Capture mode for --rgb.
+    SourceFormat colour_source = SOURCE_RGB24;
+    double cycles = 0;                                       // Estimated per frame set.
+};
+
+// Estimated cycles to capture one frame in mode, per pixel: libfreenect converts
+// Bayer data to RGB itself, and unpacks 10-bit IR to 8 bits.
+double captureCyclesPerPixel(freenect_video_format mode) {
+    switch (mode) {
+    case FREENECT_VIDEO_RGB:     return 9.5;
+    case FREENECT_VIDEO_YUV_RAW: return 1.0;
+    case FREENECT_VIDEO_IR_8BIT: return 2.5;
+    default:                     return 0.0;
+    }
+}
+
+const char* captureModeName(freenect_video_format mode) {
+    switch (mode) {
+    case FREENECT_VIDEO_RGB:     return "rgb";
+    case FREENECT_VIDEO_YUV_RAW: return "yuv-raw";
+    case FREENECT_VIDEO_IR_8BIT: return "ir";
+    default:                     return "unknown";
+    }
+}
+
+// Picks a format for each sink from its accepted list so that the summed cost of
+// the distinct formats is lowest; ties go to the earlier formats in each list.
+// Returns that cost. Large sink sets fall back to each sink's cheapest format.
+double chooseSinkFormats(std::vector<SinkSpec>& sinks, const std::function<double(PixelFormat)>& cost) {
+    std::vector<double> costs(PIXFMT_BGR32 + 1, -1.0);  // Per format, -1 until computed.
+    auto costOf = [&](PixelFormat f) {
+        if (costs[f] < 0)
+            costs[f] = cost(f);
+        return costs[f];
+    };
+    auto total = [&](const std::vector<PixelFormat>& chosen) {
+        bool seen[PIXFMT_BGR32 + 1] = {};
+        double sum = 0;
+        for (PixelFormat f : chosen) {
+            if (!seen[f])
+                sum += costOf(f);
+            seen[f] = true;
+        }
+        return sum;
+    };
+    double combinations = 1;
+    for (const auto& spec : sinks)
+        combinations *= spec.formats.size();
+    std::vector<PixelFormat> chosen(sinks.size());
+    if (combinations > 100000) {
+        for (size_t i = 0; i < sinks.size(); i++) {
+            chosen[i] = sinks[i].formats.front();
+            for (PixelFormat f : sinks[i].formats) {
+                if (costOf(f) < costOf(chosen[i]))
+                    chosen[i] = f;
+            }
+            sinks[i].format = chosen[i];
+        }
+        return total(chosen);
+    }
+    std::vector<size_t> pick(sinks.size(), 0);
+    std::vector<PixelFormat> best;
+    double bestCost = 0;
+    for (;;) {
+        for (size_t i = 0; i < sinks.size(); i++)
+            chosen[i] = sinks[i].formats[pick[i]];
+        double c = total(chosen);
+        if (best.empty() || c < bestCost) {
+            best = chosen;
+            bestCost = c;
+        }
+        size_t i = sinks.size();
+        while (i > 0 && ++pick[i - 1] == sinks[i - 1].formats.size())
+            pick[--i] = 0;
+        if (i == 0)
+            break;
+    }
+    for (size_t i = 0; i < sinks.size(); i++)
+        sinks[i].format = best[i];
+    return bestCost;
+}
+
+// "<sink> <- <format> (<path>)" for every sink, as planned with colour.
+std::string describeSinkFormats(const std::vector<SinkSpec>& sinks, SourceFormat colour, bool rgb,
+                                const PipelineConfig& base, const Region& videoRegion) {
+    std::string s;
+    for (const auto& spec : sinks) {
+        PipelineConfig cfg = base;
+        cfg.format = spec.format;
+        cfg.out_width  = videoRegion.w;
+        cfg.out_height = videoRegion.h;
+        FramePipeline pipeline(rgb ? colour : SOURCE_GREY, WIDTH, HEIGHT, cfg);
+        Shortcut shortcut = pipeline.shortcut();
+        s += (s.empty() ? "" : ", ") + spec.target + " <- " + pixelFormatName(spec.format) + " (" +
+             (shortcut == SHORTCUT_COPY ? "copy" : (shortcut == SHORTCUT_SWAP ? "byte swap" : "convert")) + ")";
+    }
+    return s;
+}
+
+// Settle the format of every sink and the RGB capture mode, and log the choice.
+// Sinks keep the formats usable with the output geometry and --depth-alpha; a
+// sink left with none keeps its first so the caller reports it.
+FormatPlan planFormats(std::vector<SinkSpec>& videoSinks, std::vector<SinkSpec>& irSinks,
+                       const CaptureSource& source, const PipelineConfig& base,
+                       const Region& videoRegion, const Region& depthRegion) {
+    bool acceptsYuv = false;
+    for (auto* sinks : { &videoSinks, &irSinks }) {
+        for (auto& spec : *sinks) {
+            std::vector<PixelFormat> usable;
+            for (PixelFormat f : spec.formats) {
+                bool packed = f == PIXFMT_YUYV || f == PIXFMT_UYVY;
+                acceptsYuv = acceptsYuv || (packed && sinks == &videoSinks);
+                if (packed && output_width % 2 != 0)
+                    continue;
+                if (enable_depth_alpha && f != PIXFMT_ABGR32 && f != PIXFMT_BGR32)
+                    continue;
+                usable.push_back(f);
+            }
+            if (usable.empty())
+                usable.push_back(spec.formats.front());
+            spec.formats = usable;
+            spec.format = usable.front();
+        }
+    }
+
+    // Raw YUV only helps RGB capture, and only when no stage needs RGB24 frames
+    // and 15 fps is enough.
+    std::string yuvUnusable;
+    const int wantedRate = output_fps > 0 ? output_fps : 30;
+    if (!enable_rgb)
+        yuvUnusable = "not capturing RGB";
+    else if (source.maxVideoRate(FREENECT_VIDEO_YUV_RAW) == 0)
+        yuvUnusable = std::string("not offered by ") + source.name();
+    else if (source.maxVideoRate(FREENECT_VIDEO_YUV_RAW) < wantedRate)
+        yuvUnusable = "runs at " + std::to_string(source.maxVideoRate(FREENECT_VIDEO_YUV_RAW)) +
+                      " fps, below the " + std::to_string(wantedRate) + " fps wanted";
+    else if (enable_auto_ir || !ir_sink_specs.empty())
+        yuvUnusable = "switching to IR needs RGB capture";
+    else if (enable_depth_alpha)
+        yuvUnusable = "--depth-alpha needs RGB24 frames";
+    else if (denoise_strength > 0 || !video_filter_spec.empty())
+        yuvUnusable = "denoising and video filters need RGB24 frames";
+    else if (!record_dir.empty() || !mcap_path.empty() || tcp_port)
+        yuvUnusable = "recordings and the TCP server take RGB24 frames";
+
+    std::vector<FormatPlan> candidates(1);
+    if (yuvUnusable.empty()) {
+        FormatPlan yuv;
+        yuv.colour_mode = FREENECT_VIDEO_YUV_RAW;
+        yuv.colour_source = SOURCE_UYVY;
+        candidates.push_back(yuv);
+    }
+    const size_t pixels = static_cast<size_t>(WIDTH) * HEIGHT;
+    std::vector<std::vector<SinkSpec>> videoChoices, irChoices;
+    for (auto& plan : candidates) {
+        // Per format: the pipeline of the main capture mode, plus depth when it is
+        // drawn into the same frame.
+        auto videoCost = [&](PixelFormat f) {
+            PipelineConfig cfg = base;
+            cfg.format = f;
+            cfg.out_width  = videoRegion.w;
+            cfg.out_height = videoRegion.h;
+            double c = 0;
+            if (enable_rgb || enable_ir)
+                c += FramePipeline(enable_rgb ? plan.colour_source : SOURCE_GREY, WIDTH, HEIGHT, cfg).estimatedCycles();
+            if (enable_depth && !enable_depth_alpha) {
+                cfg.gamma = 1.0;
+                cfg.saturation = 1.0;
+                cfg.out_width  = depthRegion.w;
+                cfg.out_height = depthRegion.h;
+                c += FramePipeline(SOURCE_DEPTH11, WIDTH, HEIGHT, cfg).estimatedCycles();
+            }
+            return c;
+        };
+        auto irCost = [&](PixelFormat f) {
+            PipelineConfig cfg = base;
+            cfg.format = f;
+            cfg.out_width  = videoRegion.w;
+            cfg.out_height = videoRegion.h;
+            return FramePipeline(SOURCE_GREY, WIDTH, HEIGHT, cfg).estimatedCycles();
+        };
+        videoChoices.push_back(videoSinks);
+        irChoices.push_back(irSinks);
+        plan.cycles = chooseSinkFormats(videoChoices.back(), videoCost) +
+                      chooseSinkFormats(irChoices.back(), irCost);
+        if (enable_rgb || enable_ir)
+            plan.cycles += captureCyclesPerPixel(enable_rgb ? plan.colour_mode : FREENECT_VIDEO_IR_8BIT) * pixels;
+    }
+    size_t best = 0;
+    for (size_t i = 1; i < candidates.size(); i++) {
+        if (candidates[i].cycles < candidates[best].cycles)
+            best = i;
+    }
+    videoSinks = videoChoices[best];
+    irSinks = irChoices[best];
+
+    auto describePlan = [&](size_t i) {
+        const FormatPlan& plan = candidates[i];
+        std::string s;
+        if (enable_rgb || enable_ir)
+            s += std::string("capture ") + captureModeName(enable_rgb ? plan.colour_mode : FREENECT_VIDEO_IR_8BIT);
+        for (const std::string& sinks : { describeSinkFormats(videoChoices[i], plan.colour_source, enable_rgb, base, videoRegion),
+                                          describeSinkFormats(irChoices[i], plan.colour_source, false, base, videoRegion) }) {
+            if (!sinks.empty())
+                s += (s.empty() ? "" : ", ") + sinks;
+        }
+        char cycles[64];
+        std::snprintf(cycles, sizeof(cycles), "; estimated %.1f Mcycles per frame.", plan.cycles / 1e6);
+        return s + cycles;
+    };
+    std::cout << "Format plan: " << describePlan(best) << std::endl;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (i != best)
+            std::cout << "  Alternative: " << describePlan(i) << std::endl;
+    }
+    if (!yuvUnusable.empty() && enable_rgb && acceptsYuv)
+        std::cout << "  Not considered: capture yuv-raw (" << yuvUnusable << ")." << std::endl;
+    return candidates[best];
+}
+
+// --- Recording ---
+//
+// --record <dir> saves the raw capture streams with their frame metadata, before
+// any filtering or conversion, in the chunked container described in
+// kinect_rec.h. Every stream has its own writer thread. The capture loop only
+// copies a frame into a pooled buffer and queues it; if the disk falls more than
+// MAX_QUEUED frames behind, new frames are dropped and counted rather than
+// delaying capture.
+#ifdef __linux__
+class StreamRecorder {
+public:
+    enum {
+        MAX_QUEUED    = 60,       // About two seconds of frames.
+        STAGING_BYTES = 8 << 20,  // Size of each write; a multiple of the O_DIRECT alignment.
+        DIRECT_ALIGN  = 4096,
+        CHUNK_BYTES   = 1 << 30   // A new chunk file is started once a chunk passes this size.
+    };
+
+    StreamRecorder(const std::string& dir, uint32_t stream, uint32_t format, int width, int height)
+        : dir_(dir), stream_(stream), format_(format), width_(width), height_(height),
+          running_(false), fd_(-1), direct_(false), failed_(false), staging_(nullptr),
+          staged_(0), chunk_(0), chunk_bytes_(0), chunk_dropped_(0) {}
+
+    ~StreamRecorder() {
+        stop();
+        std::free(staging_);
+    }
+
+    bool start() {
+        if (posix_memalign(reinterpret_cast<void**>(&staging_), DIRECT_ALIGN, STAGING_BYTES) != 0) {
+            staging_ = nullptr;
+            failed_ = true;
+            std::cerr << "Could not allocate the recording buffer for " << krec_stream_name(stream_) << "." << std::endl;
+            return false;
+        }
+        running_ = true;
+        thread_ = std::thread(&StreamRecorder::run, this);
+        return true;
+    }
+
+    // Write out everything still queued, finish the open chunk and stop the thread.
+    void stop() {
+        if (!running_.exchange(false))
+            return;
+        cond_.notify_all();
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    // Queue a copy of a frame. Never waits for the disk.
+    void submit(const void* data, size_t size, const FrameInfo& info) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.size() >= MAX_QUEUED || failed_) {
+                ++stats_.dropped;
+                ++chunk_dropped_;
+                return;
+            }
+        }
+        std::shared_ptr<SharedFrame> frame = pool_.acquire(size);
+        std::memcpy(frame->data.data(), data, size);
+        frame->width  = width_;
+        frame->height = height_;
+        frame->info   = info;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(frame);
+        }
+        cond_.notify_one();
+    }
+
+private:
+    struct Stats {
+        uint64_t frames  = 0;
+        uint64_t bytes   = 0;
+        uint64_t dropped = 0;
+    };
+
+    void run() {
+        auto last_report = std::chrono::steady_clock::now();
+        while (true) {
+            FrameRef frame;
+            size_t queued = 0;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait_for(lock, std::chrono::seconds(1), [this] { return !queue_.empty() || !running_; });
+                if (queue_.empty() && !running_)
+                    break;
+                if (!queue_.empty()) {
+                    frame = queue_.front();
+                    queue_.pop_front();
+                }
+                queued = queue_.size();
+            }
+            if (frame && !failed_ && !writeFrame(*frame)) {
+                perror(("Writing recording (" + chunkPath() + ")").c_str());
+                std::cerr << "Recording of the " << krec_stream_name(stream_) << " stream stopped; "
+                          << "further frames are dropped." << std::endl;
+                closeChunk();
+                std::lock_guard<std::mutex> lock(mutex_);
+                failed_ = true;
+                queue_.clear();
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_report >= std::chrono::seconds(10)) {
+                report(std::chrono::duration<double>(now - last_report).count(), queued);
+                last_report = now;
+            }
+        }
+        if (fd_ >= 0 && !closeChunk())
+            perror(("Finishing recording (" + chunkPath() + ")").c_str());
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::cout << "Recorded " << krec_stream_name(stream_) << ": " << totals_.frames << " frames in "
+                  << chunk_ << " chunk(s), dropped " << totals_.dropped + stats_.dropped << "." << std::endl;
+    }
+
+    void report(double window_s, size_t queued) {
+        Stats s;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            s = stats_;
+            stats_ = Stats();
+            totals_.dropped += s.dropped;
+        }
+        std::cout << "Recording " << krec_stream_name(stream_) << ": " << (s.frames / window_s) << " fps, "
+                  << (s.bytes / window_s / 1e6) << " MB/s" << (direct_ ? " (O_DIRECT)" : "")
+                  << ", queued " << queued << ", dropped " << s.dropped;
+        if (s.dropped)
+            std::cout << " (disk not keeping up)";
+        std::cout << std::endl;
+    }
+
+    std::string chunkPath() const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/%s-%04u.krec", krec_stream_name(stream_), chunk_);
+        return dir_ + name;
+    }
+
+    bool openChunk() {
+        std::string path = chunkPath();
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            return false;
+        // Bypass the page cache where the filesystem allows it (not tmpfs, for one).
+        direct_ = fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_DIRECT) == 0;
+        krec_chunk_header h;
+        std::memset(&h, 0, sizeof(h));
+        h.magic       = KREC_MAGIC;
+        h.version     = KREC_VERSION;
+        h.header_size = sizeof(h);
+        h.stream      = stream_;
+        h.format      = format_;
+        h.width       = width_;
+        h.height      = height_;
+        h.chunk       = chunk_;
+        h.start_realtime_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+        index_.clear();
+        staged_ = 0;
+        chunk_bytes_ = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            chunk_dropped_ = 0;
+        }
+        return append(&h, sizeof(h));
+    }
+
+    // Flush the staged tail, then append the index and footer.
+    bool closeChunk() {
+        if (fd_ < 0)
+            return true;
+        bool ok = true;
+        if (direct_) {
+            // The tail is not a whole number of blocks; finish it through the page cache.
+            ok = fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT) == 0;
+            direct_ = false;
+        }
+        ok = ok && writeAll(staging_, staged_);
+        krec_footer footer;
+        std::memset(&footer, 0, sizeof(footer));
+        footer.magic        = KREC_INDEX_MAGIC;
+        footer.entry_size   = sizeof(krec_index_entry);
+        footer.index_offset = chunk_bytes_;
+        footer.count        = index_.size();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            footer.dropped = chunk_dropped_;
+        }
+        ok = ok && writeAll(index_.data(), index_.size() * sizeof(krec_index_entry));
+        ok = ok && writeAll(&footer, sizeof(footer));
+        close(fd_);
+        fd_ = -1;
+        staged_ = 0;
+        ++chunk_;
+        return ok;
+    }
+
+    bool writeFrame(const SharedFrame& frame) {
+        const size_t record_size = sizeof(krec_frame_header) + frame.data.size();
+        if (fd_ >= 0 && chunk_bytes_ + record_size > static_cast<uint64_t>(CHUNK_BYTES) && !closeChunk())
+            return false;
+        if (fd_ < 0 && !openChunk())
+            return false;
+        krec_frame_header h;
+        std::memset(&h, 0, sizeof(h));
+        h.magic            = KREC_FRAME_MAGIC;
+        h.size             = static_cast<uint32_t>(frame.data.size());
+        h.sequence         = frame.info.sequence;
+        h.capture_ns       = frame.info.capture_ns;
+        h.kinect_timestamp = frame.info.kinect_timestamp;
+        krec_index_entry e;
+        e.offset           = chunk_bytes_;
+        e.sequence         = h.sequence;
+        e.capture_ns       = h.capture_ns;
+        e.kinect_timestamp = h.kinect_timestamp;
+        e.size             = h.size;
+        if (!append(&h, sizeof(h)) || !append(frame.data.data(), frame.data.size()))
+            return false;
+        index_.push_back(e);
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.frames;
+        ++totals_.frames;
+        stats_.bytes += record_size;
+        return true;
+    }
+
+    // Copy into the staging buffer, writing it out each time it fills up so every
+    // write is large and block-aligned.
+    bool append(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        chunk_bytes_ += size;
+        while (size > 0) {
+            size_t n = std::min(size, static_cast<size_t>(STAGING_BYTES) - staged_);
+            std::memcpy(staging_ + staged_, p, n);
+            staged_ += n;
+            p += n;
+            size -= n;
+            if (staged_ == static_cast<size_t>(STAGING_BYTES)) {
+                if (!writeAll(staging_, staged_))
+                    return false;
+                staged_ = 0;
+            }
+        }
+        return true;
+    }
+
+    bool writeAll(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (size > 0) {
+            ssize_t n = ::write(fd_, p, size);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    std::string dir_;
+    uint32_t stream_;
+    uint32_t format_;
+    int width_;
+    int height_;
+
+    std::atomic<bool> running_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<FrameRef> queue_;  // Guarded by mutex_, as are the stats and failed_.
+    FramePool pool_;
+    Stats stats_;                 // Current reporting window.
+    Stats totals_;                // Whole recording (frames; dropped as of the last report).
+
+    // Writer thread state.
+    int fd_;
+    bool direct_;
+    bool failed_;
+    uint8_t* staging_;
+    size_t staged_;
+    unsigned chunk_;
+    uint64_t chunk_bytes_;        // Bytes of the open chunk, including what is still staged.
+    uint64_t chunk_dropped_;      // Guarded by mutex_.
+    std::vector<krec_index_entry> index_;
+};
+
+// The streams of one recording, created as their first frames arrive.
+class Recorder {
+public:
+    explicit Recorder(const std::string& dir) : dir_(dir) {}
+
+    bool open() {
+        if (mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST) {
+            perror(("Creating recording directory (" + dir_ + ")").c_str());
+            return false;
+        }
+        struct stat st;
+        if (stat(dir_.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+            std::cerr << "Error: " << dir_ << " is not a directory." << std::endl;
+            return false;
+        }
+        std::cout << "Recording raw streams to " << dir_ << "." << std::endl;
+        return true;
+    }
+
+    void submit(uint32_t stream, uint32_t format, const void* data, size_t size, const FrameInfo& info) {
+        std::unique_ptr<StreamRecorder>& r = streams_[stream];
+        if (!r) {
+            r.reset(new StreamRecorder(dir_, stream, format, WIDTH, HEIGHT));
+            if (!r->start())
+                return;
+        }
+        r->submit(data, size, info);
+    }
+
+    void stop() {
+        for (auto& r : streams_) {
+            if (r)
+                r->stop();
+        }
+    }
+
+private:
+    std::string dir_;
+    std::unique_ptr<StreamRecorder> streams_[KREC_STREAM_COUNT];
+};
+#else
+class Recorder {
+public:
+    explicit Recorder(const std::string& /*dir*/) {}
+    bool open() {
+        std::cerr << "Recording is only supported on Linux." << std::endl;
+        return false;
+    }
+    void submit(uint32_t, uint32_t, const void*, size_t, const FrameInfo&) {}
+    void stop() {}
+};
+#endif
+
+// --- MCAP Recording ---
+//
+// --mcap <file> records the raw capture streams as ROS 2 sensor_msgs/msg/Image
+// messages (CDR) in an indexed MCAP file (https://mcap.dev/spec), which Foxglove
+// and the ROS 2 bag tools open directly. The capture loop queues frames exactly as
+// for --record. A writer thread packs them into chunks and hands each full chunk
+// to a small pool of compression threads. Chunks are written back in order,
+// followed by their message indexes. The summary (schemas, channels, statistics
+// and chunk indexes) is added when the recording stops. Message times are the
+// frames' capture times, moved to the realtime clock.
+enum McapOpcode {
+    MCAP_OP_HEADER         = 0x01,
+    MCAP_OP_FOOTER         = 0x02,
+    MCAP_OP_SCHEMA         = 0x03,
+    MCAP_OP_CHANNEL        = 0x04,
+    MCAP_OP_MESSAGE        = 0x05,
+    MCAP_OP_CHUNK          = 0x06,
+    MCAP_OP_MESSAGE_INDEX  = 0x07,
+    MCAP_OP_CHUNK_INDEX    = 0x08,
+    MCAP_OP_STATISTICS     = 0x0B,
+    MCAP_OP_SUMMARY_OFFSET = 0x0E,
+    MCAP_OP_DATA_END       = 0x0F
+};
+
+static const uint8_t MCAP_MAGIC[8] = { 0x89, 'M', 'C', 'A', 'P', '0', '\r', '\n' };
+
+// The sensor_msgs/msg/Image definition with its dependencies, as ros2msg schemas carry it.
+static const char MCAP_IMAGE_SCHEMA[] =
+    "std_msgs/Header header\n"
+    "uint32 height\n"
+    "uint32 width\n"
+    "string encoding\n"
+    "uint8 is_bigendian\n"
+    "uint32 step\n"
+    "uint8[] data\n"
+    "================================================================================\n"
+    "MSG: std_msgs/Header\n"
+    "builtin_interfaces/Time stamp\n"
+    "string frame_id\n"
+    "================================================================================\n"
+    "MSG: builtin_interfaces/Time\n"
+    "int32 sec\n"
+    "uint32 nanosec\n";
+
+// CRC-32 (ISO-HDLC, as in zlib), eight bytes per step.
+uint32_t crc32Update(uint32_t crc, const void* data, size_t size) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(8 * 256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c >> 1) ^ (0xEDB88320u & (0u - (c & 1)));
+            t[i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int s = 1; s < 8; s++)
+                t[s * 256 + i] = (t[(s - 1) * 256 + i] >> 8) ^ t[t[(s - 1) * 256 + i] & 0xFF];
+        }
+        return t;
+    }();
+    const uint32_t* t = table.data();
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    while (size >= 8) {
+        uint32_t lo, hi;
+        std::memcpy(&lo, p, 4);
+        std::memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = t[7 * 256 + (lo & 0xFF)] ^ t[6 * 256 + ((lo >> 8) & 0xFF)] ^ t[5 * 256 + ((lo >> 16) & 0xFF)] ^
+              t[4 * 256 + (lo >> 24)] ^ t[3 * 256 + (hi & 0xFF)] ^ t[2 * 256 + ((hi >> 8) & 0xFF)] ^
+              t[1 * 256 + ((hi >> 16) & 0xFF)] ^ t[hi >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size--)
+        crc = (crc >> 8) ^ t[(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+
+// Little-endian serialization of MCAP records and fields.
+struct McapBuffer {
+    std::vector<uint8_t> bytes;
+
+    size_t size() const { return bytes.size(); }
+    void append(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        bytes.insert(bytes.end(), p, p + size);
+    }
+    void u8(uint8_t v) { bytes.push_back(v); }
+    void u16(uint16_t v) { append(&v, sizeof(v)); }
+    void u32(uint32_t v) { append(&v, sizeof(v)); }
+    void u64(uint64_t v) { append(&v, sizeof(v)); }
+    void str(const std::string& s) {
+        u32(static_cast<uint32_t>(s.size()));
+        append(s.data(), s.size());
+    }
+    // Reserve a uint32 byte count (of a map or array) to be filled in by end32().
+    size_t begin32() {
+        u32(0);
+        return bytes.size();
+    }
+    void end32(size_t start) {
+        uint32_t n = static_cast<uint32_t>(bytes.size() - start);
+        std::memcpy(&bytes[start - 4], &n, 4);
+    }
+    // Start a record; endRecord() fills in its length.
+    size_t beginRecord(uint8_t opcode) {
+        u8(opcode);
+        u64(0);
+        return bytes.size();
+    }
+    void endRecord(size_t start) {
+        uint64_t n = bytes.size() - start;
+        std::memcpy(&bytes[start - 8], &n, 8);
+    }
+};
+
+// The CDR (XCDR1, little-endian) encoding of a sensor_msgs/msg/Image up to its pixel
+// data, which follows directly. Alignment counts from after the 4-byte encapsulation header.
+void cdrImagePrefix(McapBuffer& out, uint64_t stamp_ns, const std::string& frame_id, uint32_t width,
+                    uint32_t height, const std::string& encoding, uint32_t step, uint32_t data_size) {
+    const size_t origin = out.size() + 4;
+    auto align4 = [&] {
+        while ((out.size() - origin) % 4)
+            out.u8(0);
+    };
+    auto cdrString = [&](const std::string& s) {
+        align4();
+        out.u32(static_cast<uint32_t>(s.size() + 1));
+        out.append(s.c_str(), s.size() + 1);
+    };
+    const uint8_t encapsulation[4] = { 0x00, 0x01, 0x00, 0x00 };  // CDR_LE
+    out.append(encapsulation, sizeof(encapsulation));
+    out.u32(static_cast<uint32_t>(stamp_ns / 1000000000ull));
+    out.u32(static_cast<uint32_t>(stamp_ns % 1000000000ull));
+    cdrString(frame_id);
+    align4();
+    out.u32(height);
+    out.u32(width);
+    cdrString(encoding);
+    out.u8(0);  // is_bigendian
+    align4();
+    out.u32(step);
+    out.u32(data_size);
+}
+
+#ifdef __linux__
+class McapRecorder {
+public:
+    enum {
+        MAX_QUEUED        = 60,       // About one second of RGB and depth frames.
+        CHUNK_BYTES       = 4 << 20,  // A chunk is closed once its messages pass this size.
+        MAX_CHUNKS        = 6,        // Chunks being compressed or waiting to be written.
+        COMPRESS_WORKERS  = 2,
+        REPORT_INTERVAL_S = 10
+    };
+
+    McapRecorder(const std::string& path, McapCompression compression, int level)
+        : path_(path), compression_(compression), level_(level), running_(false), workers_running_(false),
+          fd_(-1), failed_(false), offset_(0), data_crc_(0), flushed_(0), realtime_offset_ns_(0),
+          message_count_(0), chunk_count_(0), start_ns_(0), end_ns_(0) {
+        for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++) {
+            format_[s] = 0;
+            channel_messages_[s] = 0;
+        }
+    }
+
+    ~McapRecorder() {
+        stop();
+    }
+
+    bool open() {
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            perror(("Creating MCAP file (" + path_ + ")").c_str());
+            return false;
+        }
+        realtime_offset_ns_ = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count()) - monotonicNanos();
+        McapBuffer head;
+        head.append(MCAP_MAGIC, sizeof(MCAP_MAGIC));
+        size_t record = head.beginRecord(MCAP_OP_HEADER);
+        head.str("ros2");
+        head.str("freenectVirtualCamera");
+        head.endRecord(record);
+        if (!writeOut(head.bytes.data(), head.size())) {
+            perror(("Writing MCAP file (" + path_ + ")").c_str());
+            return false;
+        }
+        running_ = workers_running_ = true;
+        writer_ = std::thread(&McapRecorder::run, this);
+        for (int i = 0; i < COMPRESS_WORKERS; i++)
+            workers_.push_back(std::thread(&McapRecorder::workerLoop, this));
+        std::cout << "Recording MCAP to " << path_ << " (chunks "
+                  << (compression_ == MCAP_COMPRESSION_ZSTD ? "zstd" : "uncompressed") << ")." << std::endl;
+        return true;
+    }
+
+    // Write out everything still queued, add the summary and stop the threads.
+    void stop() {
+        if (!running_.exchange(false))
+            return;
+        cond_.notify_all();
+        writer_.join();
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex_);
+            workers_running_ = false;
+        }
+        jobs_cond_.notify_all();
+        for (auto& t : workers_)
+            t.join();
+        workers_.clear();
+    }
+
+    // Queue a copy of a frame. Never waits for the disk or the compressors.
+    void submit(uint32_t stream, uint32_t format, const void* data, size_t size, const FrameInfo& info) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.size() >= MAX_QUEUED || failed_) {
+                ++stats_.dropped;
+                return;
+            }
+        }
+        std::shared_ptr<SharedFrame> frame = pool_.acquire(size);
+        std::memcpy(frame->data.data(), data, size);
+        frame->width  = WIDTH;
+        frame->height = HEIGHT;
+        frame->info   = info;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(Queued{ frame, stream, format });
+        }
+        cond_.notify_one();
+    }
+
+private:
+    struct Queued {
+        FrameRef frame;
+        uint32_t stream;
+        uint32_t format;
+    };
+    struct Chunk {
+        McapBuffer records;                // Message records, uncompressed.
+        std::vector<uint8_t> compressed;
+        std::vector<std::pair<uint64_t, uint64_t>> index[KREC_STREAM_COUNT];  // Log time, offset in records.
+        uint64_t start_ns = 0;
+        uint64_t end_ns = 0;
+        uint32_t crc = 0;
+        uint64_t compress_ns = 0;
+        bool done = false;                 // Guarded by mutex_.
+        bool ok = true;
+    };
+    struct Stats {
+        uint64_t frames = 0;
+        uint64_t bytes = 0;                // Written to the file.
+        uint64_t raw_bytes = 0;            // Message records before compression.
+        uint64_t chunks = 0;
+        uint64_t compress_ns = 0;
+        uint64_t dropped = 0;
+    };
+
+    static uint16_t channelId(uint32_t stream) {
+        return static_cast<uint16_t>(stream + 1);
+    }
+
+    void run() {
+        auto last_report = std::chrono::steady_clock::now();
+        while (true) {
+            Queued item;
+            size_t queued = 0;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait_for(lock, std::chrono::seconds(1), [this] {
+                    return !queue_.empty() || !running_ || (!pending_.empty() && pending_.front()->done);
+                });
+                if (queue_.empty() && !running_)
+                    break;
+                if (!queue_.empty()) {
+                    item = queue_.front();
+                    queue_.pop_front();
+                }
+                queued = queue_.size();
+            }
+            if (!failed_ && !writeChunks(false))
+                fail();
+            if (item.frame && !failed_)
+                addMessage(item);
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_report >= std::chrono::seconds(REPORT_INTERVAL_S)) {
+                report(std::chrono::duration<double>(now - last_report).count(), queued);
+                last_report = now;
+            }
+        }
+        if (!failed_) {
+            if (open_ && open_->records.size())
+                seal();
+            if (!writeChunks(true) || !finish())
+                fail();
+        }
+        close(fd_);
+        fd_ = -1;
+        std::lock_guard<std::mutex> lock(mutex_);
+        totals_.dropped += stats_.dropped;
+        std::cout << "Recorded MCAP " << path_ << ": " << message_count_ << " messages in " << chunk_count_
+                  << " chunk(s), dropped " << totals_.dropped << "." << std::endl;
+    }
+
+    void fail() {
+        perror(("Writing MCAP file (" + path_ + ")").c_str());
+        std::cerr << "MCAP recording stopped; further frames are dropped." << std::endl;
+        std::lock_guard<std::mutex> lock(mutex_);
+        failed_ = true;
+        queue_.clear();
+    }
+
+    void report(double window_s, size_t queued) {
+        Stats s;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            s = stats_;
+            stats_ = Stats();
+            totals_.dropped += s.dropped;
+        }
+        std::cout << "Recording MCAP: " << (s.frames / window_s) << " fps, " << (s.bytes / window_s / 1e6)
+                  << " MB/s";
+        if (compression_ == MCAP_COMPRESSION_ZSTD && s.bytes)
+            std::cout << " (zstd " << (static_cast<double>(s.raw_bytes) / s.bytes) << ":1, "
+                      << (s.chunks ? s.compress_ns / 1e6 / s.chunks : 0.0) << " ms per chunk)";
+        std::cout << ", queued " << queued << ", dropped " << s.dropped;
+        if (s.dropped)
+            std::cout << " (disk or compression not keeping up)";
+        std::cout << std::endl;
+    }
+
+    // Announce the schema and the channel of a stream before its first message.
+    bool addChannel(uint32_t stream, uint32_t format) {
+        McapBuffer out;
+        if (schemas_.size() == 0) {
+            size_t record = schemas_.beginRecord(MCAP_OP_SCHEMA);
+            schemas_.u16(1);
+            schemas_.str("sensor_msgs/msg/Image");
+            schemas_.str("ros2msg");
+            schemas_.u32(sizeof(MCAP_IMAGE_SCHEMA) - 1);
+            schemas_.append(MCAP_IMAGE_SCHEMA, sizeof(MCAP_IMAGE_SCHEMA) - 1);
+            schemas_.endRecord(record);
+            out.append(schemas_.bytes.data(), schemas_.size());
+        }
+        const char* topic = "/kinect/rgb/image_raw";
+        const char* kinect_format = "rgb24";
+        if (format == KREC_FORMAT_GREY8) {
+            topic = "/kinect/ir/image_raw";
+            kinect_format = "grey8";
+        } else if (format == KREC_FORMAT_DEPTH11) {
+            topic = "/kinect/depth/image_raw";
+            kinect_format = "depth11 (11-bit disparity, 2047 = no reading)";
+        } else if (format == KREC_FORMAT_DEPTH_MM) {
+            topic = "/kinect/depth_registered/image_raw";
+            kinect_format = "depth_mm (millimetres registered to rgb, 0 = no reading)";
+        }
+        const size_t first = channels_.size();
+        size_t record = channels_.beginRecord(MCAP_OP_CHANNEL);
+        channels_.u16(channelId(stream));
+        channels_.u16(1);
+        channels_.str(topic);
+        channels_.str("cdr");
+        size_t map = channels_.begin32();
+        channels_.str("kinect_format");
+        channels_.str(kinect_format);
+        channels_.end32(map);
+        channels_.endRecord(record);
+        out.append(channels_.bytes.data() + first, channels_.size() - first);
+        format_[stream] = format;
+        return writeOut(out.bytes.data(), out.size());
+    }
+
+    void addMessage(const Queued& item) {
+        const SharedFrame& frame = *item.frame;
+        if (!format_[item.stream] && !addChannel(item.stream, item.format)) {
+            fail();
+            return;
+        }
+        if (!open_) {
+            open_ = takeChunk();
+            open_->start_ns = UINT64_MAX;
+        }
+        Chunk& c = *open_;
+        const uint64_t time_ns = frame.info.capture_ns + realtime_offset_ns_;
+        const char* encoding = "rgb8";
+        const char* frame_id = "kinect_rgb_optical_frame";
+        uint32_t bytes_per_pixel = 3;
+        if (item.format == KREC_FORMAT_GREY8) {
+            encoding = "mono8";
+            frame_id = "kinect_ir_optical_frame";
+            bytes_per_pixel = 1;
+        } else if (item.format == KREC_FORMAT_DEPTH11 || item.format == KREC_FORMAT_DEPTH_MM) {
+            encoding = "16UC1";
+            frame_id = item.format == KREC_FORMAT_DEPTH_MM ? "kinect_rgb_optical_frame" : "kinect_depth_optical_frame";
+            bytes_per_pixel = 2;
+        }
+        c.index[item.stream].push_back(std::make_pair(time_ns, static_cast<uint64_t>(c.records.size())));
+        size_t record = c.records.beginRecord(MCAP_OP_MESSAGE);
+        c.records.u16(channelId(item.stream));
+        c.records.u32(static_cast<uint32_t>(frame.info.sequence));
+        c.records.u64(time_ns);
+        c.records.u64(time_ns);
+        cdrImagePrefix(c.records, time_ns, frame_id, frame.width, frame.height, encoding,
+                       frame.width * bytes_per_pixel, static_cast<uint32_t>(frame.data.size()));
+        c.records.append(frame.data.data(), frame.data.size());
+        c.records.endRecord(record);
+        c.start_ns = std::min(c.start_ns, time_ns);
+        c.end_ns = std::max(c.end_ns, time_ns);
+        if (!message_count_ || time_ns < start_ns_)
+            start_ns_ = time_ns;
+        end_ns_ = std::max(end_ns_, time_ns);
+        ++message_count_;
+        ++channel_messages_[item.stream];
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++stats_.frames;
+        }
+        if (c.records.size() >= static_cast<size_t>(CHUNK_BYTES))
+            seal();
+    }
+
+    // Hand the open chunk to the compression threads, first making room if too
+    // many chunks are still in flight.
+    void seal() {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (pending_.size() >= MAX_CHUNKS && !pending_.front()->done)
+                cond_.wait(lock);
+        }
+        if (!writeChunks(false)) {
+            fail();
+            return;
+        }
+        Chunk* c = open_.get();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.push_back(std::move(open_));
+        }
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex_);
+            jobs_.push_back(c);
+        }
+        jobs_cond_.notify_one();
+    }
+
+    std::unique_ptr<Chunk> takeChunk() {
+        std::unique_ptr<Chunk> c;
+        if (!spare_.empty()) {
+            c = std::move(spare_.back());
+            spare_.pop_back();
+        } else {
+            c.reset(new Chunk());
+            c->records.bytes.reserve(CHUNK_BYTES + WIDTH * HEIGHT * 4);
+        }
+        return c;
+    }
+
+    void workerLoop() {
+#ifdef HAVE_ZSTD
+        ZSTD_CCtx* cctx = ZSTD_createCCtx();
+#endif
+        while (true) {
+            Chunk* c;
+            {
+                std::unique_lock<std::mutex> lock(jobs_mutex_);
+                jobs_cond_.wait(lock, [this] { return !jobs_.empty() || !workers_running_; });
+                if (jobs_.empty())
+                    break;
+                c = jobs_.front();
+                jobs_.pop_front();
+            }
+            const uint64_t start = monotonicNanos();
+            c->crc = crc32Update(0, c->records.bytes.data(), c->records.size());
+#ifdef HAVE_ZSTD
+            if (compression_ == MCAP_COMPRESSION_ZSTD) {
+                c->compressed.resize(ZSTD_compressBound(c->records.size()));
+                size_t n = ZSTD_compressCCtx(cctx, c->compressed.data(), c->compressed.size(),
+                                             c->records.bytes.data(), c->records.size(), level_);
+                if (ZSTD_isError(n)) {
+                    std::cerr << "MCAP: zstd compression failed: " << ZSTD_getErrorName(n) << std::endl;
+                    c->ok = false;
+                } else {
+                    c->compressed.resize(n);
+                }
+            }
+#endif
+            c->compress_ns = monotonicNanos() - start;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                c->done = true;
+            }
+            cond_.notify_all();
+        }
+#ifdef HAVE_ZSTD
+        ZSTD_freeCCtx(cctx);
+#endif
+    }
+
+    // Write the finished chunks at the front of the queue, in order (or, with
+    // wait set, all of them).
+    bool writeChunks(bool wait) {
+        while (true) {
+            std::unique_ptr<Chunk> c;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (wait) {
+                    while (!pending_.empty() && !pending_.front()->done)
+                        cond_.wait(lock);
+                }
+                if (pending_.empty() || !pending_.front()->done)
+                    return true;
+                c = std::move(pending_.front());
+                pending_.pop_front();
+            }
+            if (!c->ok || !writeChunk(*c))
+                return false;
+            c->records.bytes.clear();
+            c->compressed.clear();
+            for (auto& entries : c->index)
+                entries.clear();
+            c->start_ns = c->end_ns = 0;
+            c->done = false;
+            spare_.push_back(std::move(c));
+        }
+    }
+
+    bool writeChunk(const Chunk& c) {
+        const bool zstd = compression_ == MCAP_COMPRESSION_ZSTD;
+        const std::string compression = zstd ? "zstd" : "";
+        const uint8_t* payload = zstd ? c.compressed.data() : c.records.bytes.data();
+        const size_t payload_size = zstd ? c.compressed.size() : c.records.size();
+        const uint64_t chunk_start = offset_;
+
+        McapBuffer head;
+        size_t record = head.beginRecord(MCAP_OP_CHUNK);
+        head.u64(c.start_ns);
+        head.u64(c.end_ns);
+        head.u64(c.records.size());
+        head.u32(c.crc);
+        head.str(compression);
+        head.u64(payload_size);
+        uint64_t length = head.size() - record + payload_size;
+        std::memcpy(&head.bytes[record - 8], &length, 8);
+        const uint64_t chunk_length = head.size() + payload_size;
+
+        // Message indexes follow the chunk, one record per channel in it.
+        McapBuffer indexes;
+        std::vector<std::pair<uint16_t, uint64_t>> index_offsets;
+        for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++) {
+            if (c.index[s].empty())
+                continue;
+            index_offsets.push_back(std::make_pair(channelId(s), chunk_start + chunk_length + indexes.size()));
+            size_t r = indexes.beginRecord(MCAP_OP_MESSAGE_INDEX);
+            indexes.u16(channelId(s));
+            size_t array = indexes.begin32();
+            for (const auto& e : c.index[s]) {
+                indexes.u64(e.first);
+                indexes.u64(e.second);
+            }
+            indexes.end32(array);
+            indexes.endRecord(r);
+        }
+        struct iovec iov[3] = {
+            { head.bytes.data(), head.size() },
+            { const_cast<uint8_t*>(payload), payload_size },
+            { indexes.bytes.data(), indexes.size() }
+        };
+        if (!writeOut(iov, 3))
+            return false;
+
+        record = chunk_indexes_.beginRecord(MCAP_OP_CHUNK_INDEX);
+        chunk_indexes_.u64(c.start_ns);
+        chunk_indexes_.u64(c.end_ns);
+        chunk_indexes_.u64(chunk_start);
+        chunk_indexes_.u64(chunk_length);
+        size_t map = chunk_indexes_.begin32();
+        for (const auto& e : index_offsets) {
+            chunk_indexes_.u16(e.first);
+            chunk_indexes_.u64(e.second);
+        }
+        chunk_indexes_.end32(map);
+        chunk_indexes_.u64(indexes.size());
+        chunk_indexes_.str(compression);
+        chunk_indexes_.u64(payload_size);
+        chunk_indexes_.u64(c.records.size());
+        chunk_indexes_.endRecord(record);
+        ++chunk_count_;
+
+        // Keep the page cache from filling with dirty recording data: start writing
+        // this chunk back now, then wait for the previous one and drop it from the cache.
+        sync_file_range(fd_, chunk_start, offset_ - chunk_start, SYNC_FILE_RANGE_WRITE);
+        if (chunk_start > flushed_) {
+            sync_file_range(fd_, flushed_, chunk_start - flushed_,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd_, flushed_, chunk_start - flushed_, POSIX_FADV_DONTNEED);
+            flushed_ = chunk_start;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.chunks;
+        stats_.bytes += offset_ - chunk_start;
+        stats_.raw_bytes += c.records.size();
+        stats_.compress_ns += c.compress_ns;
+        return true;
+    }
+
+    // Close the data section and append the summary, its offsets and the footer.
+    bool finish() {
+        McapBuffer tail;
+        size_t record = tail.beginRecord(MCAP_OP_DATA_END);
+        tail.u32(data_crc_);
+        tail.endRecord(record);
+        const uint64_t summary_start = offset_ + tail.size();
+
+        struct Group {
+            uint8_t opcode;
+            uint64_t start;
+            uint64_t length;
+        };
+        std::vector<Group> groups;
+        auto addGroup = [&](uint8_t opcode, const McapBuffer& records) {
+            if (!records.size())
+                return;
+            groups.push_back(Group{ opcode, offset_ + tail.size(), records.size() });
+            tail.append(records.bytes.data(), records.size());
+        };
+        addGroup(MCAP_OP_SCHEMA, schemas_);
+        addGroup(MCAP_OP_CHANNEL, channels_);
+        McapBuffer statistics;
+        record = statistics.beginRecord(MCAP_OP_STATISTICS);
+        statistics.u64(message_count_);
+        statistics.u16(schemas_.size() ? 1 : 0);
+        uint32_t channel_count = 0;
+        for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++)
+            channel_count += format_[s] ? 1 : 0;
+        statistics.u32(channel_count);
+        statistics.u32(0);  // Attachments.
+        statistics.u32(0);  // Metadata.
+        statistics.u32(static_cast<uint32_t>(chunk_count_));
+        statistics.u64(start_ns_);
+        statistics.u64(end_ns_);
+        size_t map = statistics.begin32();
+        for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++) {
+            if (!format_[s])
+                continue;
+            statistics.u16(channelId(s));
+            statistics.u64(channel_messages_[s]);
+        }
+        statistics.end32(map);
+        statistics.endRecord(record);
+        addGroup(MCAP_OP_STATISTICS, statistics);
+        addGroup(MCAP_OP_CHUNK_INDEX, chunk_indexes_);
+
+        const uint64_t summary_offset_start = offset_ + tail.size();
+        for (const auto& g : groups) {
+            record = tail.beginRecord(MCAP_OP_SUMMARY_OFFSET);
+            tail.u8(g.opcode);
+            tail.u64(g.start);
+            tail.u64(g.length);
+            tail.endRecord(record);
+        }
+        // The summary CRC covers the footer's own opcode and length, so those go in first.
+        tail.u8(MCAP_OP_FOOTER);
+        tail.u64(8 + 8 + 4);
+        tail.u64(summary_start);
+        tail.u64(summary_offset_start);
+        const size_t summary_from = summary_start - offset_;
+        tail.u32(crc32Update(0, tail.bytes.data() + summary_from, tail.size() - summary_from));
+        tail.append(MCAP_MAGIC, sizeof(MCAP_MAGIC));
+        return writeOut(tail.bytes.data(), tail.size());
+    }
+
+    bool writeOut(const void* data, size_t size) {
+        struct iovec iov = { const_cast<void*>(data), size };
+        return writeOut(&iov, 1);
+    }
+
+    // Write iovecs in full, keeping the file offset and the data section CRC.
+    bool writeOut(struct iovec* iov, int count) {
+        for (int i = 0; i < count; i++) {
+            data_crc_ = crc32Update(data_crc_, iov[i].iov_base, iov[i].iov_len);
+            offset_ += iov[i].iov_len;
+        }
+        while (count > 0) {
+            ssize_t n = ::writev(fd_, iov, count);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            while (count > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+                n -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + n;
+                iov->iov_len -= n;
+            }
+        }
+        return true;
+    }
+
+    std::string path_;
+    McapCompression compression_;
+    int level_;
+
+    std::atomic<bool> running_;
+    std::thread writer_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<Queued> queue_;                    // Guarded by mutex_, as are pending_, the stats and failed_.
+    std::deque<std::unique_ptr<Chunk>> pending_;  // Sealed chunks in file order.
+    FramePool pool_;
+    Stats stats_;                                 // Current reporting window.
+    Stats totals_;                                // Dropped frames as of the last report.
+
+    std::vector<std::thread> workers_;
+    std::mutex jobs_mutex_;
+    std::condition_variable jobs_cond_;
+    std::deque<Chunk*> jobs_;                     // Chunks waiting for a compression thread.
+    bool workers_running_;                        // Guarded by jobs_mutex_.
+
+    // Writer thread state.
+    int fd_;
+    bool failed_;
+    uint64_t offset_;
+    uint32_t data_crc_;
+    uint64_t flushed_;                            // Bytes known to be on disk and out of the page cache.
+    uint64_t realtime_offset_ns_;
+    std::unique_ptr<Chunk> open_;
+    std::vector<std::unique_ptr<Chunk>> spare_;
+    uint32_t format_[KREC_STREAM_COUNT];          // KREC_FORMAT_* of each announced channel, 0 = none yet.
+    uint64_t channel_messages_[KREC_STREAM_COUNT];
+    McapBuffer schemas_;
+    McapBuffer channels_;
+    McapBuffer chunk_indexes_;
+    uint64_t message_count_;
+    uint64_t chunk_count_;
+    uint64_t start_ns_;
+    uint64_t end_ns_;
+};
+#else
+class McapRecorder {
+public:
+    McapRecorder(const std::string& /*path*/, McapCompression, int) {}
+    bool open() {
+        std::cerr << "MCAP recording is only supported on Linux." << std::endl;
+        return false;
+    }
+    void submit(uint32_t, uint32_t, const void*, size_t, const FrameInfo&) {}
+    void stop() {}
+};
+#endif
+
+// --- TCP Streaming Server ---
+//
+// --tcp-server [<address>:]<port> streams the raw capture streams, as recorded by
+// --record, to TCP clients, for consumers (e.g. in containers) that can open
+// neither devices nor shared memory. The wire format is in kinect_tcp.h. Depth is
+// compressed losslessly with RVL; RGB and IR go out raw or as JPEG (--tcp-video).
+//
+// While clients are connected, the capture loop copies each frame and queues it
+// for a pool of encoder threads; if they fall behind, the oldest waiting frame is
+// dropped. Each frame is encoded once and shared by every client. A client queues
+// at most CLIENT_QUEUE encoded frames; when it is full the oldest frame not yet
+// being sent is dropped, so a slow client gets newer frames instead of growing
+// latency and never holds up capture or other clients. One network thread accepts
+// clients and writes to their non-blocking sockets as they have room.
+
+// Largest RVL encoding of `pixels` depth values (a valid pixel costs at most
+// 6 nibbles for its delta, plus run lengths).
+size_t rvlMaxBytes(size_t pixels) {
+    return pixels * 4 + 8;
+}
+
+// Compress a depth frame with RVL (see kinect_tcp.h) into out, which must have room
+// for rvlMaxBytes(pixels) and be 4-byte aligned. Returns the bytes written.
+size_t rvlEncode(const uint16_t* depth, size_t pixels, uint32_t format, uint8_t* out) {
+    uint32_t* words = reinterpret_cast<uint32_t*>(out);
+    size_t count = 0;
+    uint32_t word = 0;
+    int nibbles = 0;
+    auto put = [&](uint32_t value) {
+        do {
+            uint32_t nibble = value & 7;
+            value >>= 3;
+            if (value)
+                nibble |= 8;
+            word = (word << 4) | nibble;
+            if (++nibbles == 8) {
+                words[count++] = word;
+                word = 0;
+                nibbles = 0;
+            }
+        } while (value);
+    };
+    const uint16_t invalid = format == KTCP_FORMAT_DEPTH11 ? 2047 : 0;
+    const int32_t offset = format == KTCP_FORMAT_DEPTH11 ? 1 : 0;
+    auto code = [&](uint16_t v) { return v == invalid ? 0 : v + offset; };
+    int32_t previous = 0;
+    size_t i = 0;
+    while (i < pixels) {
+        size_t start = i;
+        while (i < pixels && code(depth[i]) == 0)
+            i++;
+        put(static_cast<uint32_t>(i - start));
+        start = i;
+        while (i < pixels && code(depth[i]) != 0)
+            i++;
+        put(static_cast<uint32_t>(i - start));
+        for (size_t k = start; k < i; k++) {
+            int32_t current = code(depth[k]);
+            int32_t delta = current - previous;
+            put((static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31));
+            previous = current;
+        }
+    }
+    if (nibbles)
+        words[count++] = word << (4 * (8 - nibbles));
+    return count * 4;
+}
+
+#ifdef HAVE_JPEG
+struct JpegError {
+    jpeg_error_mgr mgr;
+    std::jmp_buf jump;
+};
+
+void jpegErrorExit(j_common_ptr cinfo) {
+    std::longjmp(reinterpret_cast<JpegError*>(cinfo->err)->jump, 1);
+}
+
+// Compress an 8-bit frame with 1 (grey) or 3 (RGB) components to JPEG, appending
+// it to out. Returns false if libjpeg reports an error.
+bool encodeJpeg(const uint8_t* pixels, int width, int height, int components, int quality,
+                std::vector<uint8_t>& out) {
+    jpeg_compress_struct cinfo;
+    JpegError err;
+    unsigned char* buffer = nullptr;
+    unsigned long size = 0;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpegErrorExit;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        std::free(buffer);
+        return false;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buffer, &size);
+    cinfo.image_width      = width;
+    cinfo.image_height     = height;
+    cinfo.input_components = components;
+    cinfo.in_color_space   = components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.dct_method = JDCT_IFAST;
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = const_cast<JSAMPROW>(pixels + static_cast<size_t>(cinfo.next_scanline) * width * components);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    out.insert(out.end(), buffer, buffer + size);
+    jpeg_destroy_compress(&cinfo);
+    std::free(buffer);
+    return true;
+}
+#endif
+
+#ifdef __linux__
+class TcpServer {
+public:
+    enum {
+        CLIENT_QUEUE        = 4,  // Encoded frames per client, about two frame sets.
+        JOBS_PER_WORKER     = 2,  // Raw frames waiting for an encoder thread.
+        REPORT_INTERVAL_S   = 10
+    };
+
+    TcpServer(const std::string& address, int port, TcpVideoEncoding video, int quality, unsigned workers)
+        : address_(address), port_(port), video_(video), quality_(quality),
+          worker_count_(workers ? workers : 1), listen_fd_(-1), wake_fd_(-1), running_(false),
+          next_client_id_(1), client_count_(0) {
+        for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++)
+            submitted_[s] = delivered_[s] = 0;
+    }
+
+    ~TcpServer() {
+        stop();
+    }
+
+    bool start() {
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons(static_cast<uint16_t>(port_));
+        if (inet_pton(AF_INET, address_.c_str(), &addr.sin_addr) != 1) {
+            std::cerr << "Error: Invalid --tcp-server address: " << address_ << std::endl;
+            return false;
+        }
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0) {
+            perror("Creating TCP server socket");
+            return false;
+        }
+        int one = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            listen(listen_fd_, 8) < 0) {
+            perror(("Listening on " + endpoint()).c_str());
+            return false;
+        }
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd_ < 0) {
+            perror("Creating TCP server eventfd");
+            return false;
+        }
+        running_ = true;
+        network_ = std::thread(&TcpServer::networkLoop, this);
+        for (unsigned i = 0; i < worker_count_; i++)
+            workers_.push_back(std::thread(&TcpServer::workerLoop, this));
+        std::cout << "TCP server listening on " << endpoint() << " (video "
+                  << (video_ == TCP_VIDEO_JPEG ? "jpeg" : "raw") << ", depth rvl, "
+                  << worker_count_ << " encoder threads)." << std::endl;
+        return true;
+    }
+
+    void stop() {
+        if (running_.exchange(false)) {
+            jobs_cond_.notify_all();
+            wake();
+            for (auto& t : workers_)
+                t.join();
+            workers_.clear();
+            network_.join();
+        }
+        for (auto& c : clients_)
+            close(c->fd);
+        clients_.clear();
+        if (wake_fd_ >= 0)
+            close(wake_fd_);
+        if (listen_fd_ >= 0)
+            close(listen_fd_);
+        wake_fd_ = listen_fd_ = -1;
+    }
+
+    std::string endpoint() const {
+        return address_ + ":" + std::to_string(port_);
+    }
+
+    bool hasClients() const {
+        return client_count_.load() > 0;
+    }
+
+    // Queue a copy of a capture frame for encoding. Never waits for the encoders
+    // or the network, and does nothing while no client is connected.
+    void submit(uint32_t stream, uint32_t format, const void* data, size_t size, const FrameInfo& info) {
+        if (!hasClients())
+            return;
+        std::shared_ptr<SharedFrame> frame = pool_.acquire(size);
+        std::memcpy(frame->data.data(), data, size);
+        frame->width  = WIDTH;
+        frame->height = HEIGHT;
+        frame->info   = info;
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex_);
+            if (jobs_.size() >= worker_count_ * JOBS_PER_WORKER) {
+                jobs_.pop_front();
+                std::lock_guard<std::mutex> statsLock(stats_mutex_);
+                ++encoder_dropped_;
+            }
+            Job job = { frame, stream, format, ++submitted_[stream] };
+            jobs_.push_back(job);
+        }
+        jobs_cond_.notify_one();
+    }
+
+private:
+    struct Job {
+        FrameRef frame;
+        uint32_t stream;
+        uint32_t format;
+        uint64_t order;  // Submission order within the stream.
+    };
+    struct Client {
+        int fd;
+        int id;
+        std::string peer;
+        std::deque<FrameRef> queue;  // Encoded frames, header included; the front may be partly sent.
+        size_t offset = 0;           // Bytes of the front frame already sent.
+        uint64_t frames = 0;         // Reporting window.
+        uint64_t bytes = 0;
+        uint64_t dropped = 0;
+        uint64_t latency_ns = 0;     // Capture to fully sent, summed.
+    };
+    struct EncodeStats {
+        uint64_t frames = 0;
+        uint64_t encode_ns = 0;
+        uint64_t raw_bytes = 0;
+        uint64_t payload_bytes = 0;
+    };
+
+    void wake() {
+        uint64_t one = 1;
+        if (::write(wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("Waking TCP server");
+    }
+
+    void workerLoop() {
+        std::vector<uint8_t> jpeg;
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(jobs_mutex_);
+                jobs_cond_.wait(lock, [this] { return !jobs_.empty() || !running_; });
+                if (!running_)
+                    return;
+                job = jobs_.front();
+                jobs_.pop_front();
+            }
+            const uint64_t start = monotonicNanos();
+            FrameRef encoded = encode(job, jpeg);
+            if (!encoded)
+                continue;
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex_);
+                EncodeStats& s = encode_stats_[job.stream];
+                ++s.frames;
+                s.encode_ns     += monotonicNanos() - start;
+                s.raw_bytes     += job.frame->data.size();
+                s.payload_bytes += encoded->data.size() - sizeof(ktcp_frame_header);
+            }
+            deliver(encoded, job.stream, job.order);
+        }
+    }
+
+    // Header plus encoded payload of one frame, or null if encoding failed.
+    FrameRef encode(const Job& job, std::vector<uint8_t>& jpeg) {
+        const SharedFrame& raw = *job.frame;
+        const size_t pixels = static_cast<size_t>(raw.width) * raw.height;
+        std::shared_ptr<SharedFrame> out;
+        uint32_t encoding = KTCP_ENCODING_RAW;
+        if (job.stream == KREC_STREAM_DEPTH) {
+            encoding = KTCP_ENCODING_RVL;
+            out = pool_.acquire(sizeof(ktcp_frame_header) + rvlMaxBytes(pixels));
+            size_t n = rvlEncode(reinterpret_cast<const uint16_t*>(raw.data.data()), pixels, job.format,
+                                 out->data.data() + sizeof(ktcp_frame_header));
+            out->data.resize(sizeof(ktcp_frame_header) + n);
+        } else if (video_ == TCP_VIDEO_JPEG) {
+#ifdef HAVE_JPEG
+            encoding = KTCP_ENCODING_JPEG;
+            jpeg.clear();
+            if (!encodeJpeg(raw.data.data(), raw.width, raw.height, job.format == KTCP_FORMAT_GREY8 ? 1 : 3,
+                            quality_, jpeg)) {
+                std::cerr << "TCP server: JPEG encoding failed." << std::endl;
+                return FrameRef();
+            }
+            out = pool_.acquire(sizeof(ktcp_frame_header) + jpeg.size());
+            std::memcpy(out->data.data() + sizeof(ktcp_frame_header), jpeg.data(), jpeg.size());
+#else
+            (void)jpeg;
+#endif
+        }
+        if (!out) {
+            out = pool_.acquire(sizeof(ktcp_frame_header) + raw.data.size());
+            std::memcpy(out->data.data() + sizeof(ktcp_frame_header), raw.data.data(), raw.data.size());
+        }
+        ktcp_frame_header h;
+        std::memset(&h, 0, sizeof(h));
+        h.magic            = KTCP_MAGIC;
+        h.version          = KTCP_VERSION;
+        h.header_size      = sizeof(h);
+        h.stream           = job.stream;
+        h.format           = job.format;
+        h.encoding         = encoding;
+        h.width            = raw.width;
+        h.height           = raw.height;
+        h.raw_size         = static_cast<uint32_t>(raw.data.size());
+        h.payload_size     = static_cast<uint32_t>(out->data.size() - sizeof(h));
+        h.sequence         = raw.info.sequence;
+        h.capture_ns       = raw.info.capture_ns;
+        h.encoded_ns       = monotonicNanos();
+        h.kinect_timestamp = raw.info.kinect_timestamp;
+        std::memcpy(out->data.data(), &h, sizeof(h));
+        out->info = raw.info;
+        return out;
+    }
+
+    // Queue an encoded frame for every client. Frames a slower encoder thread
+    // finishes after a newer one of the same stream are dropped.
+    void deliver(const FrameRef& frame, uint32_t stream, uint64_t order) {
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex_);
+            if (order <= delivered_[stream]) {
+                std::lock_guard<std::mutex> statsLock(stats_mutex_);
+                ++late_;
+                return;
+            }
+            delivered_[stream] = order;
+            for (auto& c : clients_) {
+                if (c->queue.size() >= CLIENT_QUEUE) {
+                    c->queue.erase(c->queue.begin() + (c->offset > 0 ? 1 : 0));
+                    ++c->dropped;
+                }
+                c->queue.push_back(frame);
+            }
+        }
+        wake();
+    }
+
+    void networkLoop() {
+        auto last_report = std::chrono::steady_clock::now();
+        std::vector<struct pollfd> fds;
+        std::vector<Client*> polled;
+        while (running_) {
+            fds.clear();
+            polled.clear();
+            fds.push_back({ listen_fd_, POLLIN, 0 });
+            fds.push_back({ wake_fd_, POLLIN, 0 });
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex_);
+                for (auto& c : clients_) {
+                    fds.push_back({ c->fd, static_cast<short>(POLLIN | (c->queue.empty() ? 0 : POLLOUT)), 0 });
+                    polled.push_back(c.get());
+                }
+            }
+            if (poll(fds.data(), fds.size(), 500) < 0 && errno != EINTR) {
+                perror("Polling TCP server sockets");
+                break;
+            }
+            if (fds[1].revents & POLLIN) {
+                uint64_t count;
+                if (::read(wake_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("Reading TCP server eventfd");
+            }
+            if (fds[0].revents & POLLIN)
+                acceptClients();
+            std::vector<Client*> gone;
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex_);
+                for (size_t i = 0; i < polled.size(); i++) {
+                    Client* c = polled[i];
+                    const short revents = fds[i + 2].revents;
+                    bool ok = !(revents & (POLLERR | POLLNVAL));
+                    if (ok && (revents & (POLLIN | POLLHUP)))
+                        ok = drainInput(*c);
+                    if (ok)
+                        ok = sendQueued(*c);
+                    if (!ok)
+                        gone.push_back(c);
+                }
+            }
+            for (Client* c : gone)
+                disconnect(c);
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_report >= std::chrono::seconds(REPORT_INTERVAL_S)) {
+                report(std::chrono::duration<double>(now - last_report).count());
+                last_report = now;
+            }
+        }
+    }
+
+    void acceptClients() {
+        while (true) {
+            struct sockaddr_in peer;
+            socklen_t len = sizeof(peer);
+            int fd = accept4(listen_fd_, reinterpret_cast<struct sockaddr*>(&peer), &len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    perror("Accepting TCP client");
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            char host[INET_ADDRSTRLEN] = "?";
+            inet_ntop(AF_INET, &peer.sin_addr, host, sizeof(host));
+            std::unique_ptr<Client> c(new Client());
+            c->fd = fd;
+            c->id = next_client_id_++;
+            c->peer = std::string(host) + ":" + std::to_string(ntohs(peer.sin_port));
+            std::cout << "TCP server: client " << c->id << " (" << c->peer << ") connected." << std::endl;
+            std::lock_guard<std::mutex> lock(clients_mutex_);
+            clients_.push_back(std::move(c));
+            client_count_ = clients_.size();
+        }
+    }
+
+    // Clients send nothing; read and discard whatever arrives. False once the
+    // client has closed the connection.
+    bool drainInput(Client& c) {
+        char buf[256];
+        while (true) {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n > 0)
+                continue;
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        }
+    }
+
+    // Write queued frames until the socket is full. False on a send error.
+    bool sendQueued(Client& c) {
+        while (!c.queue.empty()) {
+            const SharedFrame& frame = *c.queue.front();
+            ssize_t n = send(c.fd, frame.data.data() + c.offset, frame.data.size() - c.offset,
+                             MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            c.offset += n;
+            if (c.offset < frame.data.size())
+                return true;
+            ++c.frames;
+            c.bytes += frame.data.size();
+            c.latency_ns += monotonicNanos() - frame.info.capture_ns;
+            c.queue.pop_front();
+            c.offset = 0;
+        }
+        return true;
+    }
+
+    void disconnect(Client* client) {
+        std::lock_guard<std::mutex> lock(clients_mutex_);
+        for (size_t i = 0; i < clients_.size(); i++) {
+            if (clients_[i].get() != client)
+                continue;
+            close(client->fd);
+            std::cout << "TCP server: client " << client->id << " (" << client->peer << ") disconnected."
+                      << std::endl;
+            clients_.erase(clients_.begin() + i);
+            break;
+        }
+        client_count_ = clients_.size();
+    }
+
+    void report(double window_s) {
+        EncodeStats stats[KREC_STREAM_COUNT];
+        uint64_t encoderDropped, late;
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++) {
+                stats[s] = encode_stats_[s];
+                encode_stats_[s] = EncodeStats();
+            }
+            encoderDropped = encoder_dropped_;
+            late = late_;
+            encoder_dropped_ = late_ = 0;
+        }
+        std::lock_guard<std::mutex> lock(clients_mutex_);
+        if (clients_.empty() && !stats[0].frames && !stats[1].frames && !stats[2].frames)
+            return;
+        std::string line = "TCP server:";
+        char part[160];
+        for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++) {
+            const EncodeStats& e = stats[s];
+            if (!e.frames)
+                continue;
+            const char* encoding = s == KREC_STREAM_DEPTH ? "rvl" : (video_ == TCP_VIDEO_JPEG ? "jpeg" : "raw");
+            std::snprintf(part, sizeof(part), " %s %.1f fps (%s, %.2f ms, %.1f:1),", krec_stream_name(s),
+                          e.frames / window_s, encoding, e.encode_ns / 1e6 / e.frames,
+                          static_cast<double>(e.raw_bytes) / std::max<uint64_t>(e.payload_bytes, 1));
+            line += part;
+        }
+        std::snprintf(part, sizeof(part), " encoder dropped %llu, late %llu, %zu clients",
+                      static_cast<unsigned long long>(encoderDropped), static_cast<unsigned long long>(late),
+                      clients_.size());
+        line += part;
+        for (auto& c : clients_) {
+            std::snprintf(part, sizeof(part), "; client %d %.1f fps, %.1f MB/s, latency %.2f ms, dropped %llu, queued %zu",
+                          c->id, c->frames / window_s, c->bytes / window_s / 1e6,
+                          c->frames ? c->latency_ns / 1e6 / c->frames : 0.0,
+                          static_cast<unsigned long long>(c->dropped), c->queue.size());
+            line += part;
+            c->frames = c->bytes = c->dropped = c->latency_ns = 0;
+        }
+        std::cout << line << std::endl;
+    }
+
+    std::string address_;
+    int port_;
+    TcpVideoEncoding video_;
+    int quality_;
+    unsigned worker_count_;
+    int listen_fd_;
+    int wake_fd_;                 // eventfd waking the network thread when frames are queued.
+    std::atomic<bool> running_;
+    std::thread network_;
+    std::vector<std::thread> workers_;
+    FramePool pool_;
+
+    std::mutex jobs_mutex_;
+    std::condition_variable jobs_cond_;
+    std::deque<Job> jobs_;        // Guarded by jobs_mutex_, as is submitted_.
+    uint64_t submitted_[KREC_STREAM_COUNT];
+
+    std::mutex clients_mutex_;
+    std::vector<std::unique_ptr<Client>> clients_;  // Guarded by clients_mutex_, as is delivered_.
+    uint64_t delivered_[KREC_STREAM_COUNT];
+    int next_client_id_;          // Network thread only.
+    std::atomic<size_t> client_count_;
+
+    std::mutex stats_mutex_;
+    EncodeStats encode_stats_[KREC_STREAM_COUNT];  // Guarded by stats_mutex_, as are the counters below.
+    uint64_t encoder_dropped_ = 0;
+    uint64_t late_ = 0;
+};
+#else
+class TcpServer {
+public:
+    TcpServer(const std::string&, int, TcpVideoEncoding, int, unsigned) {}
+    bool start() {
+        std::cerr << "The TCP streaming server is only supported on Linux." << std::endl;
+        return false;
+    }
+    void stop() {}
+    std::string endpoint() const { return std::string(); }
+    bool hasClients() const { return false; }
+    void submit(uint32_t, uint32_t, const void*, size_t, const FrameInfo&) {}
+};
+#endif
+
+// --- HTTP Preview ---
+//
+// --http-preview [<address>:]<port> serves low-rate, low-resolution MJPEG
+// previews of the capture streams to browsers, for checking a sensor without
+// logging in: / lists the streams, /<stream>.mjpg streams one as
+// multipart/x-mixed-replace and /<stream>.jpg returns the latest frame.
+//
+// Only streams with viewers are previewed, at most --preview-fps frames per
+// second each. The capture loop only copies such a frame into a pool buffer and
+// hands it over; a single preview thread scales it down to --preview-size with a
+// FramePipeline, encodes it to JPEG once and queues the same part for every
+// viewer. A viewer still sending the
+// previous part gets the newest one next and skips those in between. Sinks never
+// see any of this: previews neither delay frames nor enable conversions.
+#ifdef __linux__
+class PreviewServer {
+public:
+    enum {
+        MAX_REQUEST = 4096,        // Bytes of request header read before giving up.
+        STILL_TIMEOUT_MS = 2000,   // How long a /<stream>.jpg request waits for a frame.
+        REPORT_INTERVAL_S = 10
+    };
+
+    // streams: bit per KREC_STREAM_* that is captured; colour: source format of RGB frames.
+    PreviewServer(const std::string& address, int port, int fps, int width, int height, uint32_t streams,
+                  SourceFormat colour)
+        : address_(address), port_(port), interval_ns_(1000000000ull / (fps > 0 ? fps : 1)),
+          width_(width), height_(height), streams_(streams), listen_fd_(-1), wake_fd_(-1), running_(false), next_viewer_id_(1) {
+        PipelineConfig cfg;
+        cfg.out_width  = width;
+        cfg.out_height = height;
+        cfg.mirror     = false;
+        cfg.gamma      = 1.0;
+        cfg.saturation = 1.0;
+        cfg.format = PIXFMT_RGB24;
+        pipelines_[KREC_STREAM_RGB].reset(new FramePipeline(colour, WIDTH, HEIGHT, cfg));
+        cfg.format = PIXFMT_GREY;
+        pipelines_[KREC_STREAM_IR].reset(new FramePipeline(SOURCE_GREY, WIDTH, HEIGHT, cfg));
+        pipelines_[KREC_STREAM_DEPTH].reset(new FramePipeline(SOURCE_DEPTH11, WIDTH, HEIGHT, cfg));
+        for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++) {
+            pipelines_[s]->setSerial(true);  // Run on the preview thread.
+            viewers_[s] = 0;
+            streaming_[s] = 0;
+            last_submit_ns_[s] = 0;
+        }
+    }
+
+    ~PreviewServer() {
+        stop();
+    }
+
+    bool start() {
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons(static_cast<uint16_t>(port_));
+        if (inet_pton(AF_INET, address_.c_str(), &addr.sin_addr) != 1) {
+            std::cerr << "Error: Invalid --http-preview address: " << address_ << std::endl;
+            return false;
+        }
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0) {
+            perror("Creating HTTP preview socket");
+            return false;
+        }
+        int one = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            listen(listen_fd_, 8) < 0) {
+            perror(("Listening on " + endpoint()).c_str());
+            return false;
+        }
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd_ < 0) {
+            perror("Creating HTTP preview eventfd");
+            return false;
+        }
+        running_ = true;
+        thread_ = std::thread(&PreviewServer::run, this);
+        std::cout << "HTTP preview on http://" << endpoint() << "/ (" << width_ << "x" << height_ << ", "
+                  << 1e9 / interval_ns_ << " fps per stream)." << std::endl;
+        return true;
+    }
+
+    void stop() {
+        if (running_.exchange(false)) {
+            uint64_t one = 1;
+            if (::write(wake_fd_, &one, sizeof(one)) < 0)
+                perror("Waking HTTP preview");
+            thread_.join();
+        }
+        for (auto& v : viewers_list_)
+            close(v->fd);
+        viewers_list_.clear();
+        if (wake_fd_ >= 0)
+            close(wake_fd_);
+        if (listen_fd_ >= 0)
+            close(listen_fd_);
+        wake_fd_ = listen_fd_ = -1;
+    }
+
+    std::string endpoint() const {
+        return address_ + ":" + std::to_string(port_);
+    }
+
+    bool hasViewers() const {
+        for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++) {
+            if (viewers_[s].load() > 0)
+                return true;
+        }
+        return false;
+    }
+
+    // Hand a capture frame to the preview thread if the stream has viewers and a
+    // preview frame is due. Called from the capture loop, which only pays for a
+    // copy of the raw frame; scaling and encoding happen on the preview thread.
+    void submit(uint32_t stream, const void* data, const FrameInfo& info) {
+        if (viewers_[stream].load() == 0 || info.capture_ns - last_submit_ns_[stream] < interval_ns_)
+            return;
+        last_submit_ns_[stream] = info.capture_ns;
+        const size_t size = pipelines_[stream]->inputSize();
+        std::shared_ptr<SharedFrame> frame = pool_.acquire(size);
+        std::memcpy(frame->data.data(), data, size);
+        frame->width  = WIDTH;
+        frame->height = HEIGHT;
+        frame->info   = info;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_[stream] = frame;  // Replaces one the preview thread has not picked up.
+        }
+        uint64_t one = 1;
+        if (::write(wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("Waking HTTP preview");
+    }
+
+private:
+    struct Viewer {
+        int fd;
+        int id;
+        std::string request;          // Header bytes received so far.
+        bool answered = false;        // Response started; further input is ignored.
+        int stream = -1;              // Stream being watched, -1 for single responses.
+        int still = -1;               // Stream whose next frame answers a /<stream>.jpg request.
+        std::chrono::steady_clock::time_point still_since;
+        std::deque<std::shared_ptr<const std::string>> out;  // The front may be partly sent.
+        size_t offset = 0;
+        bool close_when_sent = false;
+    };
+    struct Stats {
+        uint64_t frames = 0;
+        uint64_t encode_ns = 0;
+        uint64_t bytes = 0;
+        uint64_t skipped = 0;         // Parts viewers skipped because they were still sending.
+    };
+
+    void run() {
+        auto last_report = std::chrono::steady_clock::now();
+        std::vector<struct pollfd> fds;
+        std::vector<uint8_t> scaled, jpeg;
+        while (running_) {
+            fds.clear();
+            fds.push_back({ listen_fd_, POLLIN, 0 });
+            fds.push_back({ wake_fd_, POLLIN, 0 });
+            for (auto& v : viewers_list_)
+                fds.push_back({ v->fd, static_cast<short>(POLLIN | (v->out.empty() ? 0 : POLLOUT)), 0 });
+            if (poll(fds.data(), fds.size(), 500) < 0 && errno != EINTR) {
+                perror("Polling HTTP preview sockets");
+                break;
+            }
+            if (fds[1].revents & POLLIN) {
+                uint64_t count;
+                if (::read(wake_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("Reading HTTP preview eventfd");
+                encodePending(scaled, jpeg);
+            }
+            if (fds[0].revents & POLLIN)
+                acceptViewers();
+            // Viewers accepted above were not polled yet; they are serviced next round.
+            for (size_t i = fds.size() - 2; i-- > 0;) {
+                Viewer& v = *viewers_list_[i];
+                const short revents = fds[i + 2].revents;
+                bool ok = !(revents & (POLLERR | POLLNVAL));
+                if (ok && (revents & (POLLIN | POLLHUP)))
+                    ok = readRequest(v);
+                if (ok && v.still >= 0 &&
+                    std::chrono::steady_clock::now() - v.still_since >= std::chrono::milliseconds(STILL_TIMEOUT_MS)) {
+                    endStill(v);
+                    respond(v, "503 Service Unavailable", "text/plain", "No frame captured in time.\n");
+                }
+                if (ok)
+                    ok = sendQueued(v);
+                if (!ok || (v.close_when_sent && v.out.empty() && v.still < 0))
+                    disconnect(i);
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_report >= std::chrono::seconds(REPORT_INTERVAL_S)) {
+                report(std::chrono::duration<double>(now - last_report).count());
+                last_report = now;
+            }
+        }
+    }
+
+    // Scale and encode the frames handed over since the last call, once each,
+    // and queue them for their viewers.
+    void encodePending(std::vector<uint8_t>& scaled, std::vector<uint8_t>& jpeg) {
+        for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++) {
+            FrameRef frame;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                frame.swap(pending_[s]);
+            }
+            if (!frame)
+                continue;
+            const uint64_t start = monotonicNanos();
+            scaled.resize(pipelines_[s]->outputSize());
+            pipelines_[s]->process(frame->data.data(), scaled.data());
+            frame.reset();  // Back to the pool before encoding.
+            jpeg.clear();
+#ifdef HAVE_JPEG
+            if (!encodeJpeg(scaled.data(), width_, height_, s == KREC_STREAM_RGB ? 3 : 1, 75, jpeg)) {
+                std::cerr << "HTTP preview: JPEG encoding failed." << std::endl;
+                continue;
+            }
+#endif
+            latest_[s] = std::make_shared<const std::string>(jpeg.begin(), jpeg.end());
+            std::string header = "--kinectframe\r\nContent-Type: image/jpeg\r\nContent-Length: " +
+                                 std::to_string(jpeg.size()) + "\r\n\r\n";
+            std::shared_ptr<std::string> part = std::make_shared<std::string>();
+            part->reserve(header.size() + jpeg.size() + 2);
+            part->append(header).append(jpeg.begin(), jpeg.end()).append("\r\n");
+            stats_[s].frames++;
+            stats_[s].encode_ns += monotonicNanos() - start;
+            stats_[s].bytes += jpeg.size();
+            for (auto& v : viewers_list_) {
+                if (v->still == static_cast<int>(s)) {
+                    endStill(*v);
+                    respond(*v, "200 OK", "image/jpeg", *latest_[s]);
+                    continue;
+                }
+                if (v->stream != static_cast<int>(s))
+                    continue;
+                // Keep what is being sent; replace a part that has not started.
+                if (v->out.size() > 1) {
+                    v->out.pop_back();
+                    stats_[s].skipped++;
+                }
+                v->out.push_back(part);
+            }
+        }
+    }
+
+    void acceptViewers() {
+        while (true) {
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    perror("Accepting HTTP preview viewer");
+                return;
+            }
+            std::unique_ptr<Viewer> v(new Viewer());
+            v->fd = fd;
+            v->id = next_viewer_id_++;
+            viewers_list_.push_back(std::move(v));
+        }
+    }
+
+    // Read the request header and answer it once complete. False to drop the viewer.
+    bool readRequest(Viewer& v) {
+        char buf[1024];
+        while (true) {
+            ssize_t n = recv(v.fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n == 0)
+                return false;
+            if (n < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            if (v.answered)
+                continue;
+            v.request.append(buf, n);
+            if (v.request.find("\r\n\r\n") != std::string::npos) {
+                answer(v);
+                v.request.clear();
+            } else if (v.request.size() > MAX_REQUEST) {
+                return false;
+            }
+        }
+    }
+
+    void answer(Viewer& v) {
+        v.answered = true;
+        v.close_when_sent = true;
+        std::string method, path;
+        size_t sp1 = v.request.find(' ');
+        size_t sp2 = sp1 == std::string::npos ? sp1 : v.request.find(' ', sp1 + 1);
+        if (sp2 != std::string::npos) {
+            method = v.request.substr(0, sp1);
+            path = v.request.substr(sp1 + 1, sp2 - sp1 - 1);
+            path = path.substr(0, path.find('?'));  // e.g. a cache-busting ?t=<time>
+        }
+        if (method != "GET") {
+            respond(v, "405 Method Not Allowed", "text/plain", "Only GET is supported.\n");
+            return;
+        }
+        if (path == "/") {
+            std::string html = "<!DOCTYPE html>\n<html><head><title>Kinect preview</title></head><body>\n";
+            for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++) {
+                if (!(streams_ & (1u << s)))
+                    continue;
+                std::string name = krec_stream_name(s);
+                html += "<figure style=\"display:inline-block\"><img src=\"/" + name + ".mjpg\" width=\"" +
+                        std::to_string(width_) + "\" height=\"" + std::to_string(height_) + "\" alt=\"" + name +
+                        "\"><figcaption>" + name + "</figcaption></figure>\n";
+            }
+            respond(v, "200 OK", "text/html; charset=utf-8", html + "</body></html>\n");
+            return;
+        }
+        for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++) {
+            std::string name = std::string("/") + krec_stream_name(s);
+            if (!(streams_ & (1u << s)))
+                continue;
+            if (path == name + ".jpg") {
+                // latest_ is only current while an MJPEG viewer keeps it fed;
+                // otherwise the request counts as a viewer until the next frame.
+                if (latest_[s] && streaming_[s] > 0) {
+                    respond(v, "200 OK", "image/jpeg", *latest_[s]);
+                } else {
+                    v.still = static_cast<int>(s);
+                    v.still_since = std::chrono::steady_clock::now();
+                    ++viewers_[s];
+                }
+                return;
+            }
+            if (path == name + ".mjpg") {
+                v.stream = static_cast<int>(s);
+                v.close_when_sent = false;
+                ++viewers_[s];
+                ++streaming_[s];
+                queue(v, "HTTP/1.0 200 OK\r\nContent-Type: multipart/x-mixed-replace; boundary=kinectframe\r\n"
+                         "Cache-Control: no-cache\r\nConnection: close\r\n\r\n");
+                std::cout << "HTTP preview: viewer " << v.id << " watching " << krec_stream_name(s) << "." << std::endl;
+                return;
+            }
+        }
+        respond(v, "404 Not Found", "text/plain", "Not found.\n");
+    }
+
+    // Stop waiting for a frame for a /<stream>.jpg request.
+    void endStill(Viewer& v) {
+        if (v.still < 0)
+            return;
+        --viewers_[v.still];
+        v.still = -1;
+    }
+
+    void respond(Viewer& v, const std::string& status, const std::string& type, const std::string& body) {
+        queue(v, "HTTP/1.0 " + status + "\r\nContent-Type: " + type + "\r\nContent-Length: " +
+                 std::to_string(body.size()) + "\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n" + body);
+    }
+
+    void queue(Viewer& v, const std::string& data) {
+        v.out.push_back(std::make_shared<const std::string>(data));
+    }
+
+    // Write queued data until the socket is full. False on a send error.
+    bool sendQueued(Viewer& v) {
+        while (!v.out.empty()) {
+            const std::string& data = *v.out.front();
+            ssize_t n = send(v.fd, data.data() + v.offset, data.size() - v.offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            v.offset += n;
+            if (v.offset < data.size())
+                return true;
+            v.out.pop_front();
+            v.offset = 0;
+        }
+        return true;
+    }
+
+    void disconnect(size_t index) {
+        Viewer& v = *viewers_list_[index];
+        endStill(v);
+        if (v.stream >= 0) {
+            --viewers_[v.stream];
+            --streaming_[v.stream];
+            std::cout << "HTTP preview: viewer " << v.id << " left." << std::endl;
+        }
+        close(v.fd);
+        viewers_list_.erase(viewers_list_.begin() + index);
+    }
+
+    void report(double window_s) {
+        std::string line;
+        char part[128];
+        for (uint32_t s = 0; s < KREC_STREAM_COUNT; s++) {
+            Stats& st = stats_[s];
+            if (st.frames) {
+                std::snprintf(part, sizeof(part), "%s %s %.1f fps (%.2f ms scale+encode, %.1f KB, %d viewers, skipped %llu)",
+                              line.empty() ? "" : ",", krec_stream_name(s), st.frames / window_s,
+                              st.encode_ns / 1e6 / st.frames, st.bytes / 1e3 / st.frames, streaming_[s],
+                              static_cast<unsigned long long>(st.skipped));
+                line += part;
+            }
+            st = Stats();
+        }
+        if (!line.empty())
+            std::cout << "HTTP preview:" << line << std::endl;
+    }
+
+    std::string address_;
+    int port_;
+    uint64_t interval_ns_;        // Minimum time between preview frames of a stream.
+    int width_;
+    int height_;
+    uint32_t streams_;
+    int listen_fd_;
+    int wake_fd_;                 // eventfd signalling a frame handed over (or stop).
+    std::atomic<bool> running_;
+    std::thread thread_;
+    std::unique_ptr<FramePipeline> pipelines_[KREC_STREAM_COUNT];  // Preview thread.
+    FramePool pool_;
+
+    // Capture loop.
+    uint64_t last_submit_ns_[KREC_STREAM_COUNT];
+
+    std::mutex mutex_;
+    std::shared_ptr<const SharedFrame> pending_[KREC_STREAM_COUNT];  // Guarded by mutex_.
+    std::atomic<int> viewers_[KREC_STREAM_COUNT];  // Streaming viewers and waiting .jpg requests per stream.
+
+    // Preview thread.
+    std::vector<std::unique_ptr<Viewer>> viewers_list_;
+    std::shared_ptr<const std::string> latest_[KREC_STREAM_COUNT];  // JPEG, for /<stream>.jpg.
+    int streaming_[KREC_STREAM_COUNT];  // MJPEG viewers per stream, keeping latest_ current.
+    Stats stats_[KREC_STREAM_COUNT];
+    int next_viewer_id_;
+};
+#else
+class PreviewServer {
+public:
+    PreviewServer(const std::string&, int, int, int, int, uint32_t, SourceFormat) {}
+    bool start() {
+        std::cerr << "The HTTP preview is only supported on Linux." << std::endl;
+        return false;
+    }
+    void stop() {}
+    std::string endpoint() const { return std::string(); }
+    bool hasViewers() const { return false; }
+    void submit(uint32_t, const void*, const FrameInfo&) {}
+};
+#endif
+
+// --- Main Function ---
+int main(int argc, char** argv)
+{
+    // Parse command-line arguments.
+    if (argc < 2) {
+        PrintUsage(argv[0]);
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--help" || arg == "-h") {
+            PrintUsage(argv[0]);
+            return 0;
+        } else if (arg == "--ir") {
+            enable_ir = true;
+        } else if (arg == "--rgb") {
+            enable_rgb = true;
+        } else if (arg == "--depth") {
+            enable_depth = true;
+        } else if (arg == "--loopback" || arg == "--sink") {
+            if (i + 1 < argc) {
+                video_sink_specs.push_back(argv[++i]);
+            } else {
+                std::cerr << "Error: " << arg << " requires a sink argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--denoise") {
+            if (i + 1 < argc) {
+                denoise_strength = std::atoi(argv[++i]);
+                if (denoise_strength < 1 || denoise_strength > 3) {
+                    std::cerr << "Error: --denoise requires a strength between 1 and 3." << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: --denoise requires a strength argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--denoise-depth-mask") {
+            denoise_depth_mask = true;
+        } else if (arg == "--threads") {
+            if (i + 1 < argc) {
+                int n = std::atoi(argv[++i]);
+                if (n < 1) {
+                    std::cerr << "Error: --threads requires a positive count." << std::endl;
+                    return 1;
+                }
+                worker_threads = static_cast<unsigned>(n);
+            } else {
+                std::cerr << "Error: --threads requires a count argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--output-size") {
+            if (i + 1 < argc) {
+                if (std::sscanf(argv[++i], "%dx%d", &output_width, &output_height) != 2 ||
+                    output_width < 2 || output_height < 2 || output_width > 4096 || output_height > 4096) {
+                    std::cerr << "Error: --output-size expects WxH, e.g. 1280x720." << std::endl;
+                    return 1;
+                }
+                output_size_set = true;
+            } else {
+                std::cerr << "Error: --output-size requires a WxH argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--pixel-format") {
+            if (i + 1 < argc) {
+                if (!parsePixelFormatList(argv[++i], output_formats)) {
+                    std::cerr << "Error: Unknown pixel format: " << argv[i] << std::endl;
+                    return 1;
+                }
+                output_format = output_formats.front();
+                output_format_set = true;
+            } else {
+                std::cerr << "Error: --pixel-format requires a format argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--video-filter" || arg == "--depth-filter") {
+            if (i + 1 < argc) {
+                (arg == "--video-filter" ? video_filter_spec : depth_filter_spec) = argv[++i];
+                FilterChain<uint8_t> check;
+                if (!parseFilterChain(argv[i], 255, -1, check)) {
+                    std::cerr << "Error: Invalid " << arg << " list: " << argv[i] << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: " << arg << " requires a filter list." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--composite") {
+            if (i + 1 < argc) {
+                if (!parseCompositeLayout(argv[++i], composite_layout)) {
+                    std::cerr << "Error: Unknown composite layout: " << argv[i] << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: --composite requires a layout argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--depth-alpha") {
+            enable_depth_alpha = true;
+        } else if (arg == "--depth-alpha-range") {
+            if (i + 1 < argc) {
+                if (std::sscanf(argv[++i], "%d:%d", &depth_alpha_near_mm, &depth_alpha_far_mm) != 2 ||
+                    depth_alpha_near_mm < 0 || depth_alpha_far_mm > 10000 ||
+                    depth_alpha_far_mm - depth_alpha_near_mm < 256) {
+                    std::cerr << "Error: --depth-alpha-range expects <near>:<far> in mm, at least 256 mm apart." << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: --depth-alpha-range requires a <near>:<far> argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--alternate-ir") {
+            if (i + 1 < argc) {
+                ir_sink_specs.push_back(argv[++i]);
+            } else {
+                std::cerr << "Error: --alternate-ir requires a device path argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--alternate-dwell") {
+            if (i + 1 < argc) {
+                alternate_dwell_ms = std::atoi(argv[++i]);
+                if (alternate_dwell_ms < 100 || alternate_dwell_ms > 10000) {
+                    std::cerr << "Error: --alternate-dwell requires a time between 100 and 10000 ms." << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: --alternate-dwell requires a time argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--auto-ir") {
+            enable_auto_ir = true;
+        } else if (arg == "--autoframe") {
+            enable_autoframe = true;
+        } else if (arg == "--mirror") {
+            output_mirror = true;
+        } else if (arg == "--gamma" || arg == "--saturation") {
+            if (i + 1 < argc) {
+                double value = std::atof(argv[++i]);
+                if (value <= 0.0 || value > 10.0) {
+                    std::cerr << "Error: " << arg << " requires a value between 0 and 10." << std::endl;
+                    return 1;
+                }
+                (arg == "--gamma" ? output_gamma : output_saturation) = value;
+            } else {
+                std::cerr << "Error: " << arg << " requires a numeric argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--fps") {
+            if (i + 1 < argc) {
+                output_fps = std::atoi(argv[++i]);
+                if (output_fps <= 0 || output_fps > 120) {
+                    std::cerr << "Error: --fps requires a rate between 1 and 120." << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: --fps requires a frame rate argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--synthetic") {
+            use_synthetic = true;
+        } else if (arg == "--synthetic-fps" || arg == "--synthetic-disconnect") {
+            if (i + 1 < argc) {
+                int value = std::atoi(argv[++i]);
+                if (value < 0 || value > 1000) {
+                    std::cerr << "Error: " << arg << " requires a value between 0 and 1000." << std::endl;
+                    return 1;
+                }
+                (arg == "--synthetic-fps" ? synthetic_fps : synthetic_disconnect_s) = value;
+            } else {
+                std::cerr << "Error: " << arg << " requires a numeric argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--replay") {
+            if (i + 1 < argc) {
+                replay_dir = argv[++i];
+            } else {
+                std::cerr << "Error: --replay requires a directory argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--replay-mode") {
+            std::string value = i + 1 < argc ? argv[++i] : "";
+            if (value == "realtime") {
+                replay_mode = REPLAY_REALTIME;
+            } else if (value == "fast") {
+                replay_mode = REPLAY_FAST;
+            } else if (value == "step") {
+                replay_mode = REPLAY_STEP;
+            } else {
+                std::cerr << "Error: --replay-mode requires 'realtime', 'fast' or 'step'." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--replay-loop") {
+            replay_loop = true;
+        } else if (arg == "--record") {
+            if (i + 1 < argc) {
+                record_dir = argv[++i];
+            } else {
+                std::cerr << "Error: --record requires a directory argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--mcap") {
+            if (i + 1 < argc) {
+                mcap_path = argv[++i];
+            } else {
+                std::cerr << "Error: --mcap requires a file argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--mcap-compression") {
+            std::string value = i + 1 < argc ? argv[++i] : "";
+            if (value == "none") {
+                mcap_compression = MCAP_COMPRESSION_NONE;
+            } else if (value == "zstd" || value.compare(0, 5, "zstd:") == 0) {
+#ifndef HAVE_ZSTD
+                std::cerr << "Error: zstd MCAP compression needs a build with libzstd." << std::endl;
+                return 1;
+#endif
+                mcap_compression = MCAP_COMPRESSION_ZSTD;
+                if (value.size() > 5)
+                    mcap_zstd_level = std::atoi(value.c_str() + 5);
+                if (mcap_zstd_level < 1 || mcap_zstd_level > 19) {
+                    std::cerr << "Error: The zstd level must be between 1 and 19." << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: --mcap-compression requires 'none' or 'zstd[:<level>]'." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--on-demand") {
+            on_demand_streaming = true;
+        } else if (arg == "--frame-headers") {
+            frame_headers = true;
+        } else if (arg == "--io-uring") {
+            use_io_uring = true;
+        } else if (arg == "--tcp-server") {
+            if (!parseListenAddress(i + 1 < argc ? argv[++i] : "", tcp_address, tcp_port)) {
+                std::cerr << "Error: --tcp-server requires [<address>:]<port>." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--http-preview") {
+            if (!parseListenAddress(i + 1 < argc ? argv[++i] : "", preview_address, preview_port)) {
+                std::cerr << "Error: --http-preview requires [<address>:]<port>." << std::endl;
+                return 1;
+            }
+#ifndef HAVE_JPEG
+            std::cerr << "Error: --http-preview needs a build with libjpeg." << std::endl;
+            return 1;
+#endif
+        } else if (arg == "--preview-fps") {
+            preview_fps = i + 1 < argc ? std::atoi(argv[++i]) : 0;
+            if (preview_fps < 1 || preview_fps > 30) {
+                std::cerr << "Error: --preview-fps requires a rate of 1-30." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--preview-size") {
+            if (i + 1 >= argc || std::sscanf(argv[++i], "%dx%d", &preview_width, &preview_height) != 2 ||
+                preview_width < 16 || preview_height < 16 || preview_width > WIDTH || preview_height > HEIGHT) {
+                std::cerr << "Error: --preview-size requires WxH, from 16x16 up to " << WIDTH << "x" << HEIGHT << "."
+                          << std::endl;
+                return 1;
+            }
+        } else if (arg == "--tcp-video") {
+            std::string value = i + 1 < argc ? argv[++i] : "";
+            if (value == "raw") {
+                tcp_video = TCP_VIDEO_RAW;
+            } else if (value.compare(0, 4, "jpeg") == 0 && (value.size() == 4 || value[4] == ':')) {
+                tcp_video = TCP_VIDEO_JPEG;
+                if (value.size() > 4)
+                    tcp_jpeg_quality = std::atoi(value.c_str() + 5);
+                if (tcp_jpeg_quality < 1 || tcp_jpeg_quality > 100) {
+                    std::cerr << "Error: --tcp-video jpeg quality must be 1-100." << std::endl;
+                    return 1;
+                }
+#ifndef HAVE_JPEG
+                std::cerr << "Error: --tcp-video jpeg needs a build with libjpeg." << std::endl;
+                return 1;
+#endif
+            } else {
+                std::cerr << "Error: --tcp-video requires 'raw' or 'jpeg[:<quality>]'." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--tcp-workers") {
+            if (i + 1 < argc) {
+                int n = std::atoi(argv[++i]);
+                if (n < 1) {
+                    std::cerr << "Error: --tcp-workers requires a positive count." << std::endl;
+                    return 1;
+                }
+                tcp_workers = static_cast<unsigned>(n);
+            } else {
+                std::cerr << "Error: --tcp-workers requires a count argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--io") {
+            std::string value = i + 1 < argc ? argv[++i] : "";
+            if (value == "write") {
+                device_io = DEVICE_IO_WRITE;
+            } else if (value == "mmap") {
+                device_io = DEVICE_IO_MMAP;
+            } else {
+                std::cerr << "Error: --io requires 'write' or 'mmap'." << std::endl;
+                return 1;
+            }
+        } else {
+            std::cerr << "Unknown argument: " << arg << "\n";
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (enable_ir && enable_rgb) {
+        std::cerr << "Error: Cannot enable both IR and RGB streaming simultaneously.\n";
+        return 1;
+    }
+    if (!replay_dir.empty() && use_synthetic) {
+        std::cerr << "Error: --replay and --synthetic cannot be combined.\n";
+        return 1;
+    }
+    if (!enable_ir && !enable_rgb && !enable_depth) {
+        std::cerr << "Error: No streaming mode enabled. Use --ir, --rgb, and/or --depth.\n";
+        return 1;
+    }
+    if (enable_autoframe && !enable_ir && !enable_rgb) {
+        std::cerr << "Error: --autoframe requires --ir or --rgb.\n";
+        return 1;
+    }
+    if (enable_depth_alpha) {
+        if (!enable_rgb || enable_depth) {
+            std::cerr << "Error: --depth-alpha requires --rgb and replaces --depth.\n";
+            return 1;
+        }
+        if (composite_layout != COMPOSITE_NONE || enable_autoframe || output_mirror || output_size_set ||
+            output_gamma != 1.0 || output_saturation != 1.0) {
+            std::cerr << "Error: --depth-alpha packs camera pixels directly and cannot be combined with\n"
+                      << "       --composite, --autoframe, --mirror, --output-size, --gamma or --saturation.\n";
+            return 1;
+        }
+        if (!output_format_set)
+            output_format = PIXFMT_ABGR32;
+        if (output_format != PIXFMT_ABGR32 && output_format != PIXFMT_BGR32) {
+            std::cerr << "Error: --depth-alpha requires --pixel-format abgr32 or bgr32.\n";
+            return 1;
+        }
+    }
+    if (enable_auto_ir && (!enable_rgb || enable_depth_alpha)) {
+        std::cerr << "Error: --auto-ir requires --rgb and cannot be combined with --depth-alpha.\n";
+        return 1;
+    }
+    if (!ir_sink_specs.empty() &&
+        (!enable_rgb || enable_auto_ir || enable_depth_alpha || composite_layout != COMPOSITE_NONE)) {
+        std::cerr << "Error: --alternate-ir requires --rgb and cannot be combined with --auto-ir,\n"
+                  << "       --depth-alpha or --composite.\n";
+        return 1;
+    }
+    capture_depth = enable_depth || enable_autoframe || enable_depth_alpha;
+    if (composite_layout != COMPOSITE_NONE) {
+        if (!(enable_ir || enable_rgb) || !enable_depth) {
+            std::cerr << "Error: --composite requires --depth and either --ir or --rgb.\n";
+            return 1;
+        }
+        // Keep each source at its native size unless told otherwise.
+        if (!output_size_set && composite_layout == COMPOSITE_SIDE_BY_SIDE)
+            output_width = 2 * WIDTH;
+        if (!output_size_set && composite_layout == COMPOSITE_TOP_BOTTOM)
+            output_height = 2 * HEIGHT;
+    }
+    if (denoise_depth_mask && (!enable_depth || !denoise_strength)) {
+        std::cerr << "Error: --denoise-depth-mask requires --denoise and --depth.\n";
+        return 1;
+    }
+    if (!output_format_set) {
+        if (!enable_depth_alpha)  // Which already chose abgr32.
+            output_format = enable_rgb ? PIXFMT_RGB24 : PIXFMT_GREY;
+        output_formats.assign(1, output_format);
+    }
+    ir_output_format = output_format_set ? output_format : PIXFMT_GREY;
+
+    // The source is needed up front: the video modes it offers shape the format plan.
+    std::unique_ptr<CaptureSource> source;
+    if (!replay_dir.empty()) {
+#ifdef __linux__
+        ReplaySource* replay = new ReplaySource(replay_dir, replay_mode, replay_loop);
+        source.reset(replay);
+        if (!replay->load())
+            return 1;
+#else
+        std::cerr << "Error: --replay is only supported on Linux.\n";
+        return 1;
+#endif
+    } else if (use_synthetic) {
+        source.reset(new SyntheticSource(synthetic_fps, synthetic_disconnect_s));
+    } else {
+        source.reset(new KinectSource());
+    }
+
+    // Resolve the sinks of each stream; those without a ":<format>" suffix accept the
+    // stream's output formats. With --record, --mcap or --tcp-server and no sinks,
+    // frames only go there.
+    if (video_sink_specs.empty() && record_dir.empty() && mcap_path.empty() && !tcp_port)
+        video_sink_specs.push_back("/dev/video2");
+    std::vector<SinkSpec> videoSinks, irSinks;
+    for (const auto& arg : video_sink_specs) {
+        SinkSpec spec = parseSinkSpec(arg);
+        if (!spec.format_set)
+            spec.formats = output_formats;
+        videoSinks.push_back(spec);
+    }
+    for (const auto& arg : ir_sink_specs) {
+        SinkSpec spec = parseSinkSpec(arg);
+        if (!spec.format_set)
+            spec.formats = output_format_set ? output_formats : std::vector<PixelFormat>(1, PIXFMT_GREY);
+        for (const auto& other : videoSinks) {
+            if (other.target == spec.target) {
+                std::cerr << "Error: --alternate-ir needs a different device than --loopback.\n";
+                return 1;
+            }
+        }
+        irSinks.push_back(spec);
+    }
+    PipelineConfig pipelineConfig;
+    pipelineConfig.out_width  = output_width;
+    pipelineConfig.out_height = output_height;
+    pipelineConfig.mirror     = output_mirror;
+    pipelineConfig.gamma      = output_gamma;
+    pipelineConfig.saturation = output_saturation;
+    Region videoRegion, depthRegion;
+    compositeRegions(composite_layout, output_width, output_height, videoRegion, depthRegion);
+    const FormatPlan formatPlan = planFormats(videoSinks, irSinks, *source, pipelineConfig, videoRegion, depthRegion);
+    // Bytes per pixel of the colour capture mode.
+    const int colourChannels = formatPlan.colour_mode == FREENECT_VIDEO_YUV_RAW ? 2 : 3;
+    videoChannels = (enable_ir ? 1 : (enable_rgb ? colourChannels : 0));
+    for (const auto* sinks : { &videoSinks, &irSinks }) {
+        for (const auto& spec : *sinks) {
+            if ((spec.format == PIXFMT_YUYV || spec.format == PIXFMT_UYVY) && output_width % 2 != 0) {
+                std::cerr << "Error: Packed YUV output requires an even output width.\n";
+                return 1;
+            }
+            if (enable_depth_alpha && spec.format != PIXFMT_ABGR32 && spec.format != PIXFMT_BGR32) {
+                std::cerr << "Error: --depth-alpha requires abgr32 or bgr32 sinks (" << spec.target << ").\n";
+                return 1;
+            }
+        }
+    }
+
+    if (worker_threads == 0) {
+        worker_threads = std::thread::hardware_concurrency();
+        if (worker_threads == 0)
+            worker_threads = 1;
+    }
+    g_pool.reset(new ThreadPool(worker_threads));
+
+    // One denoiser per capture mode (RGB, IR) so switching modes keeps each history.
+    std::unique_ptr<TemporalDenoiser> denoisers[2];
+    if (denoise_strength > 0 && (enable_ir || enable_rgb)) {
+        denoisers[0].reset(new TemporalDenoiser(denoise_strength));
+        denoisers[1].reset(new TemporalDenoiser(denoise_strength));
+    }
+
+    // Sinks of the main stream and, when alternating, of the IR stream. Each stream
+    // converts a frame once per distinct sink format; with --auto-ir the IR pipeline
+    // expands IR to the same formats as RGB.
+    StreamOutput videoOutput, irOutput;
+    for (const auto* sinks : { &videoSinks, &irSinks }) {
+        for (const auto& spec : *sinks) {
+            std::unique_ptr<Sink> sink = createSink(spec, output_width, output_height);
+            if (!sink)
+                return 1;
+            (sinks == &videoSinks ? videoOutput : irOutput).add(std::move(sink));
+        }
+    }
+    std::vector<FormatRenderer> videoRenderers, irRenderers;
+    for (PixelFormat format : videoOutput.formats()) {
+        videoRenderers.push_back(makeRenderer(format, pipelineConfig, videoRegion, depthRegion,
+                                              formatPlan.colour_source, enable_rgb, enable_ir || enable_auto_ir, enable_depth));
+    }
+    for (PixelFormat format : irOutput.formats())
+        irRenderers.push_back(makeRenderer(format, pipelineConfig, videoRegion, depthRegion,
+                                           formatPlan.colour_source, false, true, false));
+    FramePool framePool;
+
+    std::unique_ptr<VideoMultiplexer> multiplexer;
+    if (!irOutput.empty())
+        multiplexer.reset(new VideoMultiplexer(alternate_dwell_ms));
+    std::unique_ptr<DayNightSwitcher> dayNight;
+    if (enable_auto_ir)
+        dayNight.reset(new DayNightSwitcher(DayNightSwitcher::MODE_RGB));
+
+    std::unique_ptr<AutoFramer> autoFramer;
+    if (enable_autoframe)
+        autoFramer.reset(new AutoFramer(WIDTH, HEIGHT, videoRegion.w, videoRegion.h));
+
+    // The lists were validated while parsing the options. Depth filters skip
+    // pixels without a reading: 2047 in raw depth, 0 in registered millimetres.
+    FilterChain<uint8_t> videoFilters;
+    FilterChain<uint16_t> depthFilters;
+    if (!video_filter_spec.empty())
+        parseFilterChain(video_filter_spec, 255, -1, videoFilters);
+    if (!depth_filter_spec.empty())
+        parseFilterChain(depth_filter_spec, 2047, enable_depth_alpha ? 0 : 2047, depthFilters);
+    if (!videoFilters.empty())
+        std::cout << "Video filters: " << videoFilters.describe() << std::endl;
+    if (!depthFilters.empty())
+        std::cout << "Depth filters: " << depthFilters.describe() << std::endl;
+    std::vector<uint8_t> filteredVideo;
+    std::vector<uint16_t> filteredDepth;
+
+    // Composite mode: whether a depth frame has arrived. Each new video frame is
+    // drawn with the latest depth, read in place (the shared depth frame under
+    // depthMutex, or the filtered depth frame) instead of from a copy.
+    bool compositeHaveDepth = false;
+
+    // Depth-alpha mode: latest registered depth frame, packed with each RGB frame.
+    std::vector<uint16_t> alphaDepth;
+    DepthAlphaRange alphaRange = { depth_alpha_near_mm, depth_alpha_far_mm };
+
+    // Per-pixel depth motion mask for the denoiser, and the depth frame it was derived from.
+    std::vector<uint8_t> depthMotionMask;
+    std::vector<uint16_t> previousDepth;
+
+#ifdef __linux__
+    // A pipe or socket reader going away must not kill the process; writes fail with EPIPE instead.
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    std::unique_ptr<Recorder> recorder;
+    if (!record_dir.empty()) {
+        recorder.reset(new Recorder(record_dir));
+        if (!recorder->open())
+            return 1;
+    }
+    std::unique_ptr<McapRecorder> mcap;
+    if (!mcap_path.empty()) {
+        mcap.reset(new McapRecorder(mcap_path, mcap_compression, mcap_zstd_level));
+        if (!mcap->open())
+            return 1;
+    }
+    std::unique_ptr<TcpServer> tcpServer;
+    if (tcp_port) {
+        tcpServer.reset(new TcpServer(tcp_address, tcp_port, tcp_video, tcp_jpeg_quality, tcp_workers));
+        if (!tcpServer->start())
+            return 1;
+    }
+    std::unique_ptr<PreviewServer> preview;
+    if (preview_port) {
+        uint32_t streams = (enable_rgb ? 1u << KREC_STREAM_RGB : 0) |
+                           (enable_ir || enable_auto_ir || !ir_sink_specs.empty() ? 1u << KREC_STREAM_IR : 0) |
+                           (enable_depth && !enable_depth_alpha ? 1u << KREC_STREAM_DEPTH : 0);
+        preview.reset(new PreviewServer(preview_address, preview_port, preview_fps, preview_width, preview_height,
+                                        streams, formatPlan.colour_source));
+        if (!preview->start())
+            return 1;
+    }
+    std::signal(SIGINT, requestStop);
+    std::signal(SIGTERM, requestStop);
+
+    // Open the sinks once; they stay open across Kinect reconnects.
+    videoOutput.start();
+    irOutput.start();
+
+    std::cout << "Starting Kinect streaming. Press Ctrl+C to exit." << std::endl;
+
+    // Start the video stream in whichever mode day/night switching or alternation
+    // last chose, e.g. after a reconnect or when readers return.
+    auto startVideoStream = [&]() -> bool {
+        bool start_ir = dayNight ? dayNight->mode() == DayNightSwitcher::MODE_IR
+                      : (multiplexer ? multiplexer->irActive() : enable_ir);
+        {
+            std::lock_guard<std::mutex> lock(videoMutex);
+            videoChannels = start_ir ? 1 : colourChannels;
+            newVideoFrame = false;
+        }
+        if (!source->startVideo(start_ir ? FREENECT_VIDEO_IR_8BIT : formatPlan.colour_mode))
+            return false;
+        if (multiplexer)
+            multiplexer->streamStarted();
+        return true;
+    };
+    const freenect_depth_format depthFormat =
+        enable_depth_alpha ? FREENECT_DEPTH_REGISTERED : FREENECT_DEPTH_11BIT;
+
+    // Outer loop: auto-reconnect if the Kinect disconnects.
+    while (!stop_requested) {
+        if (!source->open()) {
+            std::this_thread::sleep_for(std::chrono::seconds(5));
+            continue;
+        }
+
+        // Set up video stream if IR or RGB is enabled.
+        if (enable_ir || enable_rgb) {
+            if (!startVideoStream()) {
+                source->close();
+                if (stop_requested)
+                    break;
+                std::cerr << "Could not start video stream. Reconnecting..." << std::endl;
+                std::this_thread::sleep_for(std::chrono::seconds(5));
+                continue;
+            }
+        }
+        // Set up depth stream if enabled.
+        if (capture_depth) {
+            // Depth-alpha needs depth aligned to the RGB image, in millimetres.
+            if (!source->startDepth(depthFormat)) {
+                source->close();
+                if (stop_requested)
+                    break;
+                std::cerr << "Could not start depth stream. Reconnecting..." << std::endl;
+                std::this_thread::sleep_for(std::chrono::seconds(5));
+                continue;
+            }
+        }
+
+        std::string targets = videoOutput.describe();
+        if (!irOutput.empty())
+            targets += ", IR: " + irOutput.describe();
+        if (recorder)
+            targets += (targets.empty() ? "" : ", ") + std::string("recording to ") + record_dir;
+        if (mcap)
+            targets += (targets.empty() ? "" : ", ") + std::string("MCAP ") + mcap_path;
+        if (tcpServer)
+            targets += (targets.empty() ? "" : ", ") + std::string("TCP ") + tcpServer->endpoint();
+        if (preview)
+            targets += (targets.empty() ? "" : ", ") + std::string("preview http://") + preview->endpoint() + "/";
+        std::cout << source->name() << " connected. Streaming data to virtual device (" << targets << ")..." << std::endl;
+
+        // With --on-demand, streams nobody reads are stopped after a grace period and
+        // restarted, without reconnecting, as soon as a sink has readers again.
+        bool videoRunning = enable_ir || enable_rgb;
+        bool depthRunning = capture_depth;
+        auto lastVideoDemand = std::chrono::steady_clock::now();
+        auto lastDepthDemand = lastVideoDemand;
+        std::chrono::steady_clock::time_point resumedAt;
+        bool resumePending = false;
+
+        // Inner loop: process events and forward frames.
+        bool kinect_active = true;
+        while (kinect_active && !stop_requested) {
+            if (on_demand_streaming) {
+                const bool wasIdle = !videoRunning && !depthRunning;
+                const bool remoteReaders = (tcpServer && tcpServer->hasClients()) || (preview && preview->hasViewers());
+                const bool recording = recorder || mcap;
+                const bool wantVideo = (enable_ir || enable_rgb) &&
+                                       (recording || remoteReaders || videoOutput.active() || irOutput.active());
+                const bool wantDepth = capture_depth && (recording || remoteReaders || videoOutput.active());
+                const auto now = std::chrono::steady_clock::now();
+                const auto grace = std::chrono::seconds(2);
+                if (wantVideo)
+                    lastVideoDemand = now;
+                if (wantDepth)
+                    lastDepthDemand = now;
+                if (videoRunning && now - lastVideoDemand >= grace) {
+                    source->stopVideo();
+                    videoRunning = false;
+                }
+                if (depthRunning && now - lastDepthDemand >= grace) {
+                    source->stopDepth();
+                    depthRunning = false;
+                }
+                if (!wasIdle && !videoRunning && !depthRunning)
+                    std::cout << "No readers; capture streams stopped." << std::endl;
+                if ((wantVideo && !videoRunning) || (wantDepth && !depthRunning)) {
+                    resumedAt = now;
+                    resumePending = true;
+                    if ((wantVideo && !videoRunning && !startVideoStream()) ||
+                        (wantDepth && !depthRunning && !source->startDepth(depthFormat))) {
+                        std::cerr << "Could not resume capture. Reconnecting..." << std::endl;
+                        kinect_active = false;
+                        break;
+                    }
+                    videoRunning = videoRunning || wantVideo;
+                    depthRunning = depthRunning || wantDepth;
+                    if (wasIdle)
+                        std::cout << "Readers connected; capture streams resumed." << std::endl;
+                }
+                if (!videoRunning && !depthRunning) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                    continue;
+                }
+            }
+            int ret = source->processEvents();
+            if (ret < 0 && stop_requested)
+                break;
+            if (ret < 0) {
+                std::cerr << source->name() << " disconnected or error encountered (code " << ret << "). Reconnecting..." << std::endl;
+                kinect_active = false;
+                break;
+            }
+            if (resumePending && (newVideoFrame.load() || newDepthFrame.load())) {
+                std::cout << "First frame " << std::chrono::duration_cast<std::chrono::milliseconds>(
+                                 std::chrono::steady_clock::now() - resumedAt).count()
+                          << " ms after resuming capture." << std::endl;
+                resumePending = false;
+            }
+            // Process video frame (IR or RGB) if available.
+            if ((enable_ir || enable_rgb) && newVideoFrame.load()) {
+                std::vector<uint8_t> outputFrame;
+                FrameInfo frameInfo;
+                {
+                    std::lock_guard<std::mutex> lock(videoMutex);
+                    outputFrame = videoBuffer;
+                    frameInfo = videoInfo;
+                    newVideoFrame = false;
+                }
+                const bool frameIsIR = videoChannels == 1;
+                if (recorder) {
+                    recorder->submit(frameIsIR ? KREC_STREAM_IR : KREC_STREAM_RGB,
+                                     frameIsIR ? KREC_FORMAT_GREY8 : KREC_FORMAT_RGB24,
+                                     outputFrame.data(), outputFrame.size(), frameInfo);
+                }
+                if (mcap) {
+                    mcap->submit(frameIsIR ? KREC_STREAM_IR : KREC_STREAM_RGB,
+                                 frameIsIR ? KREC_FORMAT_GREY8 : KREC_FORMAT_RGB24,
+                                 outputFrame.data(), outputFrame.size(), frameInfo);
+                }
+                if (tcpServer) {
+                    tcpServer->submit(frameIsIR ? KREC_STREAM_IR : KREC_STREAM_RGB,
+                                      frameIsIR ? KTCP_FORMAT_GREY8 : KTCP_FORMAT_RGB24,
+                                      outputFrame.data(), outputFrame.size(), frameInfo);
+                }
+                if (preview)
+                    preview->submit(frameIsIR ? KREC_STREAM_IR : KREC_STREAM_RGB, outputFrame.data(), frameInfo);
+                if (multiplexer)
+                    multiplexer->frameArrived();
+                // A mode switch or a suppressed probe frame skips only the video
+                // render; depth below and the idle wait still run this iteration.
+                bool renderVideo = true;
+                if (dayNight) {
+                    dayNight->observe(outputFrame.data(), WIDTH, HEIGHT);
+                    DayNightSwitcher::Mode wanted = dayNight->wanted();
+                    if (dayNight->suppressOutput())
+                        renderVideo = false;
+                    if (wanted != dayNight->mode()) {
+                        if (!dayNight->switchTo(*source, wanted)) {
+                            kinect_active = false;
+                            break;
+                        }
+                        {
+                            // Drop any frame still buffered from the previous mode.
+                            std::lock_guard<std::mutex> lock(videoMutex);
+                            videoChannels = wanted == DayNightSwitcher::MODE_IR ? 1 : 3;
+                            newVideoFrame = false;
+                        }
+                        renderVideo = false;
+                    }
+                }
+                if (renderVideo) {
+                    TemporalDenoiser* denoiser = denoisers[frameIsIR ? 1 : 0].get();
+                    if (denoiser) {
+                        denoiser->apply(outputFrame.data(), WIDTH, HEIGHT, videoChannels,
+                                        depthMotionMask.empty() ? nullptr : depthMotionMask.data());
+                    }
+                    const uint8_t* videoSource = outputFrame.data();
+                    if (!videoFilters.empty()) {
+                        filteredVideo.resize(outputFrame.size());
+                        videoFilters.apply(outputFrame.data(), filteredVideo.data(), WIDTH, HEIGHT, videoChannels);
+                        videoSource = filteredVideo.data();
+                    }
+                    int crop_x = 0, crop_y = 0, crop_w = 0, crop_h = 0;
+                    if (autoFramer)
+                        autoFramer->crop(crop_x, crop_y, crop_w, crop_h);
+                    const bool toIrSinks = multiplexer && frameIsIR;
+                    StreamOutput& output = toIrSinks ? irOutput : videoOutput;
+                    for (FormatRenderer& r : toIrSinks ? irRenderers : videoRenderers) {
+                        if (!output.wants(r.format))
+                            continue;  // Only sinks without readers take this format.
+                        FramePipeline* videoPipeline = frameIsIR ? r.ir.get() : r.rgb.get();
+                        if (autoFramer)
+                            videoPipeline->setCrop(crop_x, crop_y, crop_w, crop_h);
+                        const size_t bpp = pixelFormatBytesPerPixel(r.format);
+                        const size_t stride = static_cast<size_t>(output_width) * bpp;
+                        const size_t frameSize = composite_layout != COMPOSITE_NONE ? stride * output_height
+                                               : enable_depth_alpha ? static_cast<size_t>(WIDTH) * HEIGHT * 4
+                                               : videoPipeline->outputSize();
+                        OutputFrame frame(output, framePool, r.format, frameSize);
+                        if (composite_layout != COMPOSITE_NONE) {
+                            uint8_t* out = frame.data();
+                            uint8_t* depthOut = regionOrigin(out, depthRegion, output_width, r.format);
+                            // The picture-in-picture inset lies inside the video region; video
+                            // skips it so every output pixel is written once.
+                            if (composite_layout == COMPOSITE_PIP && compositeHaveDepth)
+                                videoPipeline->setHole(depthRegion.x - videoRegion.x, depthRegion.y - videoRegion.y,
+                                                       depthRegion.w, depthRegion.h);
+                            else
+                                videoPipeline->setHole(0, 0, 0, 0);
+                            if (!compositeHaveDepth && composite_layout != COMPOSITE_PIP) {
+                                for (int y = 0; y < depthRegion.h; y++)
+                                    std::memset(depthOut + y * stride, 0, depthRegion.w * bpp);
+                            }
+                            videoPipeline->process(videoSource, regionOrigin(out, videoRegion, output_width, r.format), stride);
+                            if (compositeHaveDepth && !depthFilters.empty()) {
+                                r.depth->process(filteredDepth.data(), depthOut, stride);
+                            } else if (compositeHaveDepth) {
+                                std::lock_guard<std::mutex> lock(depthMutex);
+                                r.depth->process(depthBuffer.data(), depthOut, stride);
+                            }
+                        } else if (enable_depth_alpha) {
+                            if (alphaDepth.empty())
+                                alphaDepth.assign(static_cast<size_t>(WIDTH) * HEIGHT, 0);
+                            packRgbDepth(videoSource, alphaDepth.data(), frame.data(), WIDTH, HEIGHT, alphaRange);
+                        } else {
+                            videoPipeline->process(videoSource, frame.data());
+                        }
+                        frame.finish(FRAME_VIDEO, output_width, output_height, frameInfo);
+                    }
+                    output.flush();
+                }
+                if (multiplexer && multiplexer->due()) {
+                    if (!multiplexer->switchNext(*source)) {
+                        kinect_active = false;
+                        break;
+                    }
+                    std::lock_guard<std::mutex> lock(videoMutex);
+                    videoChannels = multiplexer->irActive() ? 1 : 3;
+                    newVideoFrame = false;
+                }
+            }
+            // Process depth frame if available.
+            if (capture_depth && newDepthFrame.load()) {
+                {
+                    std::lock_guard<std::mutex> lock(depthMutex);
+                    if (recorder) {
+                        recorder->submit(KREC_STREAM_DEPTH, enable_depth_alpha ? KREC_FORMAT_DEPTH_MM : KREC_FORMAT_DEPTH11,
+                                         depthBuffer.data(), depthBuffer.size() * sizeof(uint16_t), depthInfo);
+                    }
+                    if (mcap) {
+                        mcap->submit(KREC_STREAM_DEPTH, enable_depth_alpha ? KREC_FORMAT_DEPTH_MM : KREC_FORMAT_DEPTH11,
+                                     depthBuffer.data(), depthBuffer.size() * sizeof(uint16_t), depthInfo);
+                    }
+                    if (tcpServer) {
+                        tcpServer->submit(KREC_STREAM_DEPTH, enable_depth_alpha ? KTCP_FORMAT_DEPTH_MM : KTCP_FORMAT_DEPTH11,
+                                          depthBuffer.data(), depthBuffer.size() * sizeof(uint16_t), depthInfo);
+                    }
+                    if (preview && !enable_depth_alpha)
+                        preview->submit(KREC_STREAM_DEPTH, depthBuffer.data(), depthInfo);
+                    const uint16_t* depthSource = depthBuffer.data();
+                    if (!depthFilters.empty()) {
+                        filteredDepth.resize(depthBuffer.size());
+                        depthFilters.apply(depthBuffer.data(), filteredDepth.data(), WIDTH, HEIGHT, 1);
+                        depthSource = filteredDepth.data();
+                    }
+                    if (enable_depth_alpha) {
+                        alphaDepth.assign(depthSource, depthSource + depthBuffer.size());
+                    } else if (composite_layout != COMPOSITE_NONE) {
+                        compositeHaveDepth = true;  // Drawn with the next video frame.
+                    } else if (enable_depth) {
+                        for (FormatRenderer& r : videoRenderers) {
+                            if (!videoOutput.wants(r.format))
+                                continue;
+                            OutputFrame frame(videoOutput, framePool, r.format, r.depth->outputSize());
+                            r.depth->process(depthSource, frame.data());
+                            frame.finish(FRAME_DEPTH, output_width, output_height, depthInfo);
+                        }
+                        videoOutput.flush();
+                    }
+                    if (autoFramer)
+                        autoFramer->update(depthSource);
+                    if (denoise_depth_mask) {
+                        // Mark pixels whose depth moved noticeably or changed validity.
+                        if (previousDepth.size() == depthBuffer.size()) {
+                            depthMotionMask.resize(depthBuffer.size());
+                            for (size_t i = 0; i < depthBuffer.size(); i++) {
+                                int a = depthBuffer[i], b = previousDepth[i];
+                                bool invalid_change = (a >= 2047) != (b >= 2047);
+                                depthMotionMask[i] = (invalid_change || std::abs(a - b) > 24) ? 0xFF : 0;
+                            }
+                        }
+                        previousDepth = depthBuffer;
+                    }
+                    newDepthFrame = false;
+                }
+            }
+            if (source->needsIdleWait())
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
         }
 
         // Cleanup Kinect before attempting to reconnect.
-        if (enable_ir || enable_rgb) freenect_stop_video(f_dev);
-        if (enable_depth) freenect_stop_depth(f_dev);
-        freenect_close_device(f_dev);
-        freenect_shutdown(f_ctx);
-        std::cerr << "Kinect connection lost. Attempting to reconnect in 5 seconds..." << std::endl;
+        source->close();
+        if (stop_requested)
+            break;
+        std::cerr << source->name() << " connection lost. Attempting to reconnect in 5 seconds..." << std::endl;
         std::this_thread::sleep_for(std::chrono::seconds(5));
     }
 
+    std::cout << "Stopping." << std::endl;
+    if (recorder)
+        recorder->stop();
+    if (mcap)
+        mcap->stop();
+    if (tcpServer)
+        tcpServer->stop();
+    if (preview)
+        preview->stop();
     return 0;
 }
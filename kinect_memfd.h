@@ -0,0 +1,67 @@
+/*
+ * kinect_memfd.h
+ *
+ * Wire protocol of the unix-socket frame server in freenectVirtualCamera
+ * (--sink unix:<path>). Shared by the server and by clients; see
+ * kinect_memfd_client.c for a complete client.
+ *
+ * The server listens on a SOCK_SEQPACKET unix socket. On connect it sends one
+ * kmfd_hello message carrying slot_count memfds (SCM_RIGHTS), each holding one
+ * frame of slot_size bytes. The descriptors are opened read-only, and the
+ * memfds are sealed against resizing and (F_SEAL_FUTURE_WRITE, Linux 5.1 and
+ * later) against writes by anyone but the server. Clients map them once with
+ * PROT_READ; a writable mapping fails.
+ *
+ * For every frame the server sends a kmfd_frame naming the slot that holds it.
+ * The slot is not rewritten until the client returns it with a kmfd_release.
+ * A client holding KMFD_MAX_IN_FLIGHT slots, or whose socket is full, simply
+ * skips frames until it releases one, so a slow client never delays the
+ * server or other clients.
+ */
+#ifndef KINECT_MEMFD_H
+#define KINECT_MEMFD_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KMFD_MAGIC          0x44464D4Bu  /* "KMFD" */
+#define KMFD_VERSION        1u
+#define KMFD_MAX_SLOTS      8
+#define KMFD_MAX_IN_FLIGHT  2
+
+/* Server -> client, once, with slot_count memfds attached. */
+typedef struct kmfd_hello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint32_t fourcc;           /* Pixel format (V4L2 four-character code). */
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+} kmfd_hello;
+
+/* Server -> client, per frame. */
+typedef struct kmfd_frame {
+    uint32_t slot;
+    uint32_t size;             /* Bytes of frame data at the start of the slot. */
+    uint64_t frame_number;     /* Position in the server's publish order, from 1. */
+    uint64_t sequence;         /* Capture sequence number of the source stream. */
+    uint64_t capture_ns;       /* CLOCK_MONOTONIC time the frame was captured. */
+    uint32_t kinect_timestamp;
+    uint32_t reserved;
+} kmfd_frame;
+
+/* Client -> server, once the client is done with a slot. */
+typedef struct kmfd_release {
+    uint32_t slot;
+} kmfd_release;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KINECT_MEMFD_H */
@@ -0,0 +1,147 @@
+/*
+ * kinect_memfd_client.c
+ *
+ * Sample client for the unix-socket frame server of freenectVirtualCamera
+ * (--sink unix:<path>). Connects, maps the frame slots it is handed and prints
+ * the frame rate, latency and mean pixel value of the frames it receives.
+ *
+ * Usage: kinect_memfd_client <socket path> [frames]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "kinect_memfd.h"
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Receive the hello message and the slot memfds that come with it. */
+static int receive_hello(int sock, kmfd_hello* hello, int* fds) {
+    char control[CMSG_SPACE(sizeof(int) * KMFD_MAX_SLOTS)];
+    struct iovec iov = { hello, sizeof(*hello) };
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(*hello)) {
+        perror("Receiving hello");
+        return -1;
+    }
+    if (hello->magic != KMFD_MAGIC || hello->version != KMFD_VERSION || hello->slot_count > KMFD_MAX_SLOTS) {
+        fprintf(stderr, "Unexpected hello from server.\n");
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * hello->slot_count)) {
+        fprintf(stderr, "Hello did not carry %u slot descriptors.\n", hello->slot_count);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * hello->slot_count);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    struct sockaddr_un addr;
+    kmfd_hello hello;
+    int fds[KMFD_MAX_SLOTS];
+    const uint8_t* slots[KMFD_MAX_SLOTS];
+    long limit = argc > 2 ? atol(argv[2]) : 0;
+    long received = 0;
+    uint64_t window_start, window_frames = 0, latency_sum = 0;
+    uint32_t i;
+    int sock;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <socket path> [frames]\n", argv[0]);
+        return 1;
+    }
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("Creating socket");
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Connecting to frame server");
+        return 1;
+    }
+    if (receive_hello(sock, &hello, fds) < 0)
+        return 1;
+    for (i = 0; i < hello.slot_count; i++) {
+        void* p = mmap(NULL, hello.slot_size, PROT_READ, MAP_SHARED, fds[i], 0);
+        if (p == MAP_FAILED) {
+            perror("Mapping frame slot");
+            return 1;
+        }
+        slots[i] = (const uint8_t*)p;
+        close(fds[i]);
+    }
+    printf("Connected: %u slots of %u bytes, %ux%u %.4s\n", hello.slot_count, hello.slot_size,
+           hello.width, hello.height, (const char*)&hello.fourcc);
+
+    window_start = monotonic_ns();
+    while (limit <= 0 || received < limit) {
+        kmfd_frame frame;
+        kmfd_release release;
+        uint64_t sum = 0, now;
+        uint32_t k;
+        ssize_t n = recv(sock, &frame, sizeof(frame), 0);
+        if (n == 0) {
+            printf("Server closed the connection.\n");
+            break;
+        }
+        if (n != (ssize_t)sizeof(frame)) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            perror("Receiving frame");
+            break;
+        }
+        if (frame.slot >= hello.slot_count || frame.size > hello.slot_size) {
+            fprintf(stderr, "Bad frame message (slot %u).\n", frame.slot);
+            break;
+        }
+        /* Sample every 64th byte instead of touching the whole frame. */
+        for (k = 0; k < frame.size; k += 64)
+            sum += slots[frame.slot][k];
+        now = monotonic_ns();
+        latency_sum += now - frame.capture_ns;
+        window_frames++;
+        received++;
+
+        release.slot = frame.slot;
+        if (send(sock, &release, sizeof(release), MSG_NOSIGNAL) != (ssize_t)sizeof(release)) {
+            perror("Releasing slot");
+            break;
+        }
+        if (now - window_start >= 1000000000ull) {
+            printf("%.1f fps, latency %.2f ms, frame %llu, mean sample %.1f\n",
+                   window_frames * 1e9 / (double)(now - window_start),
+                   latency_sum / 1e6 / (double)window_frames,
+                   (unsigned long long)frame.frame_number,
+                   frame.size ? (double)sum / ((frame.size + 63) / 64) : 0.0);
+            window_start = now;
+            window_frames = 0;
+            latency_sum = 0;
+        }
+    }
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * kinect_raw.h
+ *
+ * Frame header written by freenectVirtualCamera's file, FIFO and stdout sinks
+ * (--sink file:<path>, --sink -) when --frame-headers is given. Each frame is
+ * then a kraw_frame_header followed by `size` bytes of pixel data; without
+ * --frame-headers the stream is just the raw frames back to back.
+ */
+#ifndef KINECT_RAW_H
+#define KINECT_RAW_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KRAW_MAGIC 0x5741524Bu  /* "KRAW" */
+
+typedef struct kraw_frame_header {
+    uint32_t magic;            /* KRAW_MAGIC. */
+    uint32_t header_size;      /* sizeof(kraw_frame_header); skip this many bytes to reach the data. */
+    uint32_t fourcc;           /* Pixel format (V4L2 four-character code). */
+    uint32_t width;
+    uint32_t height;
+    uint32_t size;             /* Bytes of pixel data that follow. */
+    uint64_t sequence;         /* Capture sequence number of the source stream. */
+    uint64_t capture_ns;       /* CLOCK_MONOTONIC time the frame was captured. */
+    uint32_t kinect_timestamp;
+    uint32_t reserved;
+} kraw_frame_header;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KINECT_RAW_H */
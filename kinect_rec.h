@@ -0,0 +1,133 @@
+/*
+ * kinect_rec.h
+ *
+ * On-disk layout of the recordings made by freenectVirtualCamera (--record
+ * <dir>). A recording is a directory holding, for each captured stream, a series
+ * of chunk files named <stream>-<NNNN>.krec (rgb, ir, depth; numbered from 0000).
+ *
+ * A chunk file is laid out as
+ *
+ *   krec_chunk_header
+ *   frame records: krec_frame_header followed by `size` bytes of raw frame data
+ *   index:         one krec_index_entry per frame record
+ *   krec_footer    (the last KREC_FOOTER_SIZE bytes of the file)
+ *
+ * Frames are the unprocessed capture buffers: RGB24, 8-bit IR, or 16-bit depth
+ * (11-bit disparity or registered millimetres), all little-endian.
+ *
+ * The index is only written when a chunk is closed. A chunk whose recording was
+ * cut short has no footer; its frames can still be found by walking the frame
+ * records from the header onwards.
+ *
+ * Usage (with the file mapped at `base`, `size` bytes long):
+ *   const krec_index_entry* index;
+ *   uint64_t count;
+ *   if (krec_find_index(base, size, &index, &count) == 0) {
+ *       const krec_frame_header* f = krec_frame_at(base, index[i].offset);
+ *       const uint8_t* pixels = (const uint8_t*)(f + 1);
+ *       ...
+ *   }
+ */
+#ifndef KINECT_REC_H
+#define KINECT_REC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KREC_MAGIC        0x4345524Bu  /* "KREC" */
+#define KREC_FRAME_MAGIC  0x5246524Bu  /* "KRFR" */
+#define KREC_INDEX_MAGIC  0x5849524Bu  /* "KRIX" */
+#define KREC_VERSION      1u
+
+/* Streams, also the <stream> part of the chunk file names. */
+#define KREC_STREAM_RGB    0u  /* "rgb" */
+#define KREC_STREAM_IR     1u  /* "ir" */
+#define KREC_STREAM_DEPTH  2u  /* "depth" */
+#define KREC_STREAM_COUNT  3u
+
+/* Frame formats. */
+#define KREC_FORMAT_RGB24     1u  /* 3 bytes per pixel, R G B. */
+#define KREC_FORMAT_GREY8     2u  /* 1 byte per pixel (IR). */
+#define KREC_FORMAT_DEPTH11   3u  /* uint16 disparity, 2047 = no reading. */
+#define KREC_FORMAT_DEPTH_MM  4u  /* uint16 millimetres registered to RGB, 0 = no reading. */
+
+typedef struct krec_chunk_header {
+    uint32_t magic;            /* KREC_MAGIC. */
+    uint32_t version;          /* KREC_VERSION. */
+    uint32_t header_size;      /* sizeof(krec_chunk_header); the first frame record follows. */
+    uint32_t stream;           /* KREC_STREAM_*. */
+    uint32_t format;           /* KREC_FORMAT_*. */
+    uint32_t width;
+    uint32_t height;
+    uint32_t chunk;            /* Position of this file in the stream, from 0. */
+    uint64_t start_realtime_ns;/* CLOCK_REALTIME when the chunk was started. */
+    uint8_t  reserved[24];
+} krec_chunk_header;
+
+typedef struct krec_frame_header {
+    uint32_t magic;            /* KREC_FRAME_MAGIC. */
+    uint32_t size;             /* Bytes of frame data that follow. */
+    uint64_t sequence;         /* Capture sequence number; gaps mark dropped frames. */
+    uint64_t capture_ns;       /* CLOCK_MONOTONIC time the frame was captured. */
+    uint32_t kinect_timestamp;
+    uint32_t reserved;
+} krec_frame_header;
+
+typedef struct krec_index_entry {
+    uint64_t offset;           /* File offset of the frame's krec_frame_header. */
+    uint64_t sequence;
+    uint64_t capture_ns;
+    uint32_t kinect_timestamp;
+    uint32_t size;
+} krec_index_entry;
+
+typedef struct krec_footer {
+    uint32_t magic;            /* KREC_INDEX_MAGIC. */
+    uint32_t entry_size;       /* sizeof(krec_index_entry). */
+    uint64_t index_offset;     /* File offset of the first krec_index_entry. */
+    uint64_t count;            /* Number of index entries (frames in the chunk). */
+    uint64_t dropped;          /* Frames dropped while this chunk was written. */
+} krec_footer;
+
+#define KREC_FOOTER_SIZE sizeof(krec_footer)
+
+/* The <stream> part of chunk file names. */
+static inline const char* krec_stream_name(uint32_t stream) {
+    switch (stream) {
+    case KREC_STREAM_RGB:   return "rgb";
+    case KREC_STREAM_IR:    return "ir";
+    case KREC_STREAM_DEPTH: return "depth";
+    }
+    return "unknown";
+}
+
+static inline const krec_frame_header* krec_frame_at(const void* base, uint64_t offset) {
+    return (const krec_frame_header*)((const uint8_t*)base + offset);
+}
+
+/* Locate the index of a mapped chunk. Returns 0 on success and -1 if the chunk
+ * has no valid footer (e.g. the recording was interrupted). */
+static inline int krec_find_index(const void* base, size_t size, const krec_index_entry** index,
+                                  uint64_t* count) {
+    const krec_footer* footer;
+    if (size < sizeof(krec_chunk_header) + KREC_FOOTER_SIZE)
+        return -1;
+    footer = (const krec_footer*)((const uint8_t*)base + size - KREC_FOOTER_SIZE);
+    if (footer->magic != KREC_INDEX_MAGIC || footer->entry_size != sizeof(krec_index_entry) ||
+        footer->index_offset < sizeof(krec_chunk_header) || footer->index_offset > size - KREC_FOOTER_SIZE ||
+        footer->count > (size - KREC_FOOTER_SIZE - footer->index_offset) / sizeof(krec_index_entry))
+        return -1;
+    *index = (const krec_index_entry*)((const uint8_t*)base + footer->index_offset);
+    *count = footer->count;
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KINECT_REC_H */
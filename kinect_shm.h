@@ -0,0 +1,203 @@
+/*
+ * kinect_shm.h
+ *
+ * Header-only C reader for the shared-memory frame rings published by
+ * freenectVirtualCamera (--sink shm:<name>). Also defines the ring layout used
+ * by the writer.
+ *
+ * A ring is a POSIX shared memory object holding a kshm_header (padded to
+ * KSHM_HEADER_SIZE) followed by slot_count slots of slot_stride bytes. Each
+ * slot starts with a kshm_slot header; the frame data follows at
+ * KSHM_SLOT_DATA_OFFSET.
+ *
+ * Readers take no locks. Every slot is guarded by a sequence counter that the
+ * writer makes odd before touching the slot and even again once the slot is
+ * complete. A reader copies the slot and then re-checks the counter: if it was
+ * odd or changed in between, the copy may be torn and is retried.
+ *
+ * While a reader has the ring open it holds a shared flock() on it, which the
+ * writer uses to tell whether anyone is reading (freenectVirtualCamera
+ * --on-demand). The lock goes away with the reader, even if it crashes.
+ *
+ * Usage:
+ *   kshm_reader r;
+ *   if (kshm_open(&r, "/kinect-rgb") == 0) {
+ *       kshm_frame_info info;
+ *       int ret = kshm_read_latest(&r, buf, sizeof(buf), &info);
+ *       ...
+ *       kshm_close(&r);
+ *   }
+ *
+ * Link with -lrt on glibc older than 2.34.
+ */
+#ifndef KINECT_SHM_H
+#define KINECT_SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KSHM_MAGIC   0x4D48534Bu  /* "KSHM" */
+#define KSHM_VERSION 1u
+
+/* Four-character code of a frame format (same values as V4L2). */
+#define KSHM_FOURCC(a, b, c, d) \
+    ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+/* Bytes reserved for the kshm_header; slots follow it, 64-byte aligned. */
+#define KSHM_HEADER_SIZE 64u
+
+/* Offset of the frame data from the start of a slot. */
+#define KSHM_SLOT_DATA_OFFSET 64u
+
+/* Attempts kshm_read_latest makes before giving up on a slot being rewritten. */
+#define KSHM_READ_RETRIES 16
+
+typedef struct kshm_header {
+    uint32_t magic;          /* KSHM_MAGIC once the ring is initialized. */
+    uint32_t version;        /* KSHM_VERSION. */
+    uint32_t slot_count;
+    uint32_t slot_stride;    /* Bytes per slot, including its kshm_slot header. */
+    uint32_t max_frame_size; /* Largest frame a slot can hold. */
+    uint32_t reserved;
+    uint64_t write_count;    /* Frames published so far; the newest is in slot (write_count - 1) % slot_count. */
+} kshm_header;
+
+typedef struct kshm_frame_info {
+    uint32_t fourcc;           /* Pixel format, e.g. KSHM_FOURCC('Y','U','Y','V'). */
+    uint32_t width;
+    uint32_t height;
+    uint32_t size;             /* Bytes of frame data. */
+    uint64_t frame_number;     /* 1-based position in the ring's publish order. */
+    uint64_t sequence;         /* Capture sequence number of the source stream. */
+    uint64_t capture_ns;       /* CLOCK_MONOTONIC time the frame was captured. */
+    uint32_t kinect_timestamp; /* Kinect hardware timestamp. */
+    uint32_t reserved;
+} kshm_frame_info;
+
+typedef struct kshm_slot {
+    uint64_t seq;              /* Odd while the writer is updating the slot. */
+    kshm_frame_info info;
+} kshm_slot;
+
+typedef struct kshm_reader {
+    int fd;
+    void* base;
+    size_t size;
+    uint64_t last;             /* frame_number of the last frame returned. */
+} kshm_reader;
+
+static inline const kshm_header* kshm_ring_header(const void* base) {
+    return (const kshm_header*)base;
+}
+
+static inline kshm_slot* kshm_ring_slot(void* base, uint32_t index) {
+    const kshm_header* h = kshm_ring_header(base);
+    return (kshm_slot*)((uint8_t*)base + KSHM_HEADER_SIZE + (size_t)index * h->slot_stride);
+}
+
+/* Total size of a ring with the given geometry. */
+static inline size_t kshm_ring_size(uint32_t slot_count, uint32_t slot_stride) {
+    return KSHM_HEADER_SIZE + (size_t)slot_count * slot_stride;
+}
+
+/* Map an existing ring read-only. Returns 0 on success, -1 on error (errno set)
+ * and -2 if the object is not a ring of this version. */
+static inline int kshm_open(kshm_reader* r, const char* name) {
+    struct stat st;
+    const kshm_header* h;
+    r->fd = -1;
+    r->base = NULL;
+    r->size = 0;
+    r->last = 0;
+    r->fd = shm_open(name, O_RDONLY, 0);
+    if (r->fd < 0)
+        return -1;
+    if (fstat(r->fd, &st) < 0 || (size_t)st.st_size < KSHM_HEADER_SIZE) {
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+    /* Announce the reader (the writer only holds the lock for an instant). */
+    flock(r->fd, LOCK_SH);
+    r->size = (size_t)st.st_size;
+    r->base = mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (r->base == MAP_FAILED) {
+        r->base = NULL;
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+    h = kshm_ring_header(r->base);
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != KSHM_MAGIC || h->version != KSHM_VERSION ||
+        kshm_ring_size(h->slot_count, h->slot_stride) > r->size) {
+        munmap(r->base, r->size);
+        close(r->fd);
+        r->base = NULL;
+        r->fd = -1;
+        return -2;
+    }
+    return 0;
+}
+
+static inline void kshm_close(kshm_reader* r) {
+    if (r->base)
+        munmap(r->base, r->size);
+    if (r->fd >= 0)
+        close(r->fd);
+    r->base = NULL;
+    r->fd = -1;
+}
+
+/* Copy the newest frame into buf if it has not been returned before.
+ * Returns 1 when a frame was copied, 0 when there is nothing new, -1 when buf
+ * is smaller than the frame (info is still filled in) and -2 when the slot kept
+ * being rewritten while it was read. */
+static inline int kshm_read_latest(kshm_reader* r, void* buf, size_t buf_size, kshm_frame_info* info) {
+    const kshm_header* h = kshm_ring_header(r->base);
+    uint64_t count = __atomic_load_n(&h->write_count, __ATOMIC_ACQUIRE);
+    kshm_slot* slot;
+    int attempt;
+    if (count == 0 || count == r->last)
+        return 0;
+    slot = kshm_ring_slot(r->base, (uint32_t)((count - 1) % h->slot_count));
+    for (attempt = 0; attempt < KSHM_READ_RETRIES; attempt++) {
+        uint64_t before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        kshm_frame_info copy;
+        if (before & 1)
+            continue;
+        memcpy(&copy, &slot->info, sizeof(copy));
+        if (copy.size > h->max_frame_size)
+            continue;  /* Torn header; never read past the slot. */
+        if (copy.size > buf_size) {
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != before)
+                continue;
+            *info = copy;
+            return -1;
+        }
+        memcpy(buf, (const uint8_t*)slot + KSHM_SLOT_DATA_OFFSET, copy.size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != before)
+            continue;
+        *info = copy;
+        r->last = copy.frame_number;
+        return 1;
+    }
+    return -2;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KINECT_SHM_H */
@@ -0,0 +1,144 @@
+/*
+ * kinect_tcp.h
+ *
+ * Wire format of the TCP streaming server in freenectVirtualCamera
+ * (--tcp-server [<address>:]<port>), and a decoder for its depth compression.
+ * See kinect_tcp_client.c for a complete client.
+ *
+ * After connecting, a client receives a stream of frames and sends nothing. Each
+ * frame is a ktcp_frame_header followed by payload_size bytes. Frames are the
+ * unprocessed capture streams (as recorded by --record):
+ *
+ *   RGB    RGB24, raw or JPEG (--tcp-video)
+ *   IR     8-bit grey, raw or JPEG (--tcp-video)
+ *   Depth  uint16 11-bit disparity or registered millimetres, always compressed
+ *          losslessly with RVL (ktcp_rvl_decode)
+ *
+ * The server keeps a short queue per client and drops the oldest queued frame
+ * when a client falls behind, so frames may be skipped (see the sequence
+ * numbers) but arrive complete and in order within each stream.
+ *
+ * All fields are little-endian.
+ */
+#ifndef KINECT_TCP_H
+#define KINECT_TCP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KTCP_MAGIC        0x5043544Bu  /* "KTCP" */
+#define KTCP_VERSION      1u
+#define KTCP_DEFAULT_PORT 5590
+
+/* Streams (the same values as KREC_STREAM_* in kinect_rec.h). */
+#define KTCP_STREAM_RGB    0u
+#define KTCP_STREAM_IR     1u
+#define KTCP_STREAM_DEPTH  2u
+
+/* Frame formats before encoding (the same values as KREC_FORMAT_*). */
+#define KTCP_FORMAT_RGB24     1u  /* 3 bytes per pixel, R G B. */
+#define KTCP_FORMAT_GREY8     2u  /* 1 byte per pixel (IR). */
+#define KTCP_FORMAT_DEPTH11   3u  /* uint16 disparity, 2047 = no reading. */
+#define KTCP_FORMAT_DEPTH_MM  4u  /* uint16 millimetres registered to RGB, 0 = no reading. */
+
+/* Payload encodings. */
+#define KTCP_ENCODING_RAW   0u  /* The frame as is, raw_size bytes. */
+#define KTCP_ENCODING_JPEG  1u  /* Baseline JFIF (RGB or greyscale). */
+#define KTCP_ENCODING_RVL   2u  /* RVL-compressed depth, see ktcp_rvl_decode(). */
+
+typedef struct ktcp_frame_header {
+    uint32_t magic;            /* KTCP_MAGIC. */
+    uint32_t version;          /* KTCP_VERSION. */
+    uint32_t header_size;      /* sizeof(ktcp_frame_header); the payload starts this many bytes in. */
+    uint32_t stream;           /* KTCP_STREAM_*. */
+    uint32_t format;           /* KTCP_FORMAT_* of the decoded frame. */
+    uint32_t encoding;         /* KTCP_ENCODING_*. */
+    uint32_t width;
+    uint32_t height;
+    uint32_t raw_size;         /* Bytes of the decoded frame. */
+    uint32_t payload_size;     /* Bytes that follow this header. */
+    uint64_t sequence;         /* Capture sequence number; gaps mark skipped frames. */
+    uint64_t capture_ns;       /* CLOCK_MONOTONIC time the frame was captured. */
+    uint64_t encoded_ns;       /* CLOCK_MONOTONIC time encoding finished. */
+    uint32_t kinect_timestamp;
+    uint32_t reserved;
+} ktcp_frame_header;
+
+/*
+ * RVL ("run length, variable length", A. D. Wilson, 2017) codes a depth frame as
+ * alternating runs of invalid and valid pixels. Each run starts with the number of
+ * invalid pixels, then the number of valid ones, then every valid pixel as the
+ * zigzag-coded difference to the previous valid pixel. All numbers are written in
+ * 4-bit groups of 3 value bits plus a continuation bit (low bits first), packed
+ * into 32-bit words from the most significant nibble down.
+ *
+ * Invalid pixels are 0 in the coded values. DEPTH11 frames are coded as v + 1,
+ * with 2047 (no reading) as 0; DEPTH_MM frames are coded as they are.
+ */
+
+/* Read the next value from the nibble stream; returns -1 past the end. */
+static inline int64_t ktcp_rvl_next(const uint32_t** word, const uint32_t* end, uint32_t* current,
+                                    int* nibbles) {
+    uint64_t value = 0;
+    int shift = 0;
+    uint32_t nibble;
+    do {
+        if (*nibbles == 0) {
+            if (*word >= end || shift > 30)
+                return -1;
+            *current = *(*word)++;
+            *nibbles = 8;
+        }
+        nibble = *current >> 28;
+        *current <<= 4;
+        (*nibbles)--;
+        value |= (uint64_t)(nibble & 7u) << shift;
+        shift += 3;
+    } while (nibble & 8u);
+    return (int64_t)value;
+}
+
+/* Decode an RVL payload of `size` bytes into `pixels` values of the given
+ * KTCP_FORMAT_DEPTH*. Returns 0 on success and -1 if the payload is malformed. */
+static inline int ktcp_rvl_decode(const void* payload, size_t size, uint32_t format, uint16_t* out,
+                                  size_t pixels) {
+    const uint32_t* word = (const uint32_t*)payload;
+    const uint32_t* end = word + size / 4;
+    const uint16_t invalid = format == KTCP_FORMAT_DEPTH11 ? 2047 : 0;
+    const int offset = format == KTCP_FORMAT_DEPTH11 ? 1 : 0;
+    uint32_t current = 0;
+    int nibbles = 0;
+    int32_t previous = 0;
+    size_t i = 0;
+    while (i < pixels) {
+        int64_t zeros = ktcp_rvl_next(&word, end, &current, &nibbles);
+        int64_t valid;
+        if (zeros < 0 || (uint64_t)zeros > pixels - i)
+            return -1;
+        for (; zeros > 0; zeros--)
+            out[i++] = invalid;
+        valid = ktcp_rvl_next(&word, end, &current, &nibbles);
+        if (valid < 0 || (uint64_t)valid > pixels - i)
+            return -1;
+        for (; valid > 0; valid--) {
+            int64_t coded = ktcp_rvl_next(&word, end, &current, &nibbles);
+            int32_t delta;
+            if (coded < 0)
+                return -1;
+            delta = (int32_t)((uint32_t)coded >> 1) ^ -(int32_t)(coded & 1);
+            previous += delta;
+            out[i++] = (uint16_t)(previous - offset);
+        }
+    }
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KINECT_TCP_H */
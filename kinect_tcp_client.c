@@ -0,0 +1,164 @@
+/*
+ * kinect_tcp_client.c
+ *
+ * Sample client for the TCP streaming server of freenectVirtualCamera
+ * (--tcp-server [<address>:]<port>). Connects, decodes the RVL depth frames and
+ * prints, once a second and per stream, the frame rate, bandwidth, compression
+ * ratio and latency of the frames it receives. Run on the same machine as the
+ * server, the latencies are exact (both sides use CLOCK_MONOTONIC), which makes
+ * it a benchmark of the server over the loopback interface.
+ *
+ * Usage: kinect_tcp_client [<host> [<port> [seconds]]]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "kinect_tcp.h"
+
+typedef struct stream_stats {
+    uint64_t frames;
+    uint64_t skipped;          /* Gaps in the sequence numbers. */
+    uint64_t wire_bytes;
+    uint64_t raw_bytes;
+    uint64_t encode_ns;        /* Capture to encoded, summed. */
+    uint64_t latency_ns;       /* Capture to received, summed. */
+    uint64_t decode_ns;
+    uint64_t last_sequence;
+} stream_stats;
+
+static const char* stream_names[] = { "rgb", "ir", "depth" };
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int read_all(int sock, void* buf, size_t size) {
+    uint8_t* p = (uint8_t*)buf;
+    while (size > 0) {
+        ssize_t n = recv(sock, p, size, 0);
+        if (n == 0)
+            return -1;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Receiving");
+            return -1;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : KTCP_DEFAULT_PORT;
+    long seconds = argc > 3 ? atol(argv[3]) : 0;
+    struct sockaddr_in addr;
+    stream_stats stats[3];
+    uint8_t* payload = NULL;
+    uint16_t* depth = NULL;
+    size_t payload_capacity = 0, depth_capacity = 0;
+    uint64_t start, window_start;
+    int sock;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Usage: %s [<host> [<port> [seconds]]] (host as an IPv4 address)\n", argv[0]);
+        return 1;
+    }
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("Creating socket");
+        return 1;
+    }
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Connecting to TCP server");
+        return 1;
+    }
+    printf("Connected to %s:%d\n", host, port);
+
+    memset(stats, 0, sizeof(stats));
+    start = window_start = monotonic_ns();
+    for (;;) {
+        ktcp_frame_header h;
+        stream_stats* s;
+        uint64_t received, now;
+        unsigned i;
+        if (read_all(sock, &h, sizeof(h)) < 0)
+            break;
+        if (h.magic != KTCP_MAGIC || h.version != KTCP_VERSION || h.header_size != sizeof(h) ||
+            h.stream > KTCP_STREAM_DEPTH) {
+            fprintf(stderr, "Unexpected frame header.\n");
+            break;
+        }
+        if (h.payload_size > payload_capacity) {
+            payload_capacity = h.payload_size;
+            payload = (uint8_t*)realloc(payload, payload_capacity);
+        }
+        if (read_all(sock, payload, h.payload_size) < 0)
+            break;
+        received = monotonic_ns();
+        s = &stats[h.stream];
+        if (h.encoding == KTCP_ENCODING_RVL) {
+            size_t pixels = (size_t)h.width * h.height;
+            uint64_t t0 = monotonic_ns();
+            if (pixels > depth_capacity) {
+                depth_capacity = pixels;
+                depth = (uint16_t*)realloc(depth, depth_capacity * sizeof(uint16_t));
+            }
+            if (ktcp_rvl_decode(payload, h.payload_size, h.format, depth, pixels) < 0) {
+                fprintf(stderr, "Corrupt RVL frame %llu.\n", (unsigned long long)h.sequence);
+                break;
+            }
+            s->decode_ns += monotonic_ns() - t0;
+        }
+        if (s->frames && h.sequence > s->last_sequence + 1)
+            s->skipped += h.sequence - s->last_sequence - 1;
+        s->last_sequence = h.sequence;
+        s->frames++;
+        s->wire_bytes += sizeof(h) + h.payload_size;
+        s->raw_bytes += h.raw_size;
+        s->encode_ns += h.encoded_ns - h.capture_ns;
+        s->latency_ns += received - h.capture_ns;
+
+        now = monotonic_ns();
+        if (now - window_start < 1000000000ull)
+            continue;
+        for (i = 0; i < 3; i++) {
+            stream_stats* w = &stats[i];
+            double window = (now - window_start) / 1e9;
+            if (!w->frames)
+                continue;
+            printf("%s: %.1f fps, %.2f MB/s (%.1f:1), skipped %llu, latency %.2f ms (encoded after %.2f ms)",
+                   stream_names[i], w->frames / window, w->wire_bytes / window / 1e6,
+                   (double)w->raw_bytes / (double)w->wire_bytes, (unsigned long long)w->skipped,
+                   w->latency_ns / 1e6 / w->frames, w->encode_ns / 1e6 / w->frames);
+            if (w->decode_ns)
+                printf(", decode %.2f ms", w->decode_ns / 1e6 / w->frames);
+            printf("\n");
+            w->frames = w->skipped = w->wire_bytes = w->raw_bytes = 0;
+            w->encode_ns = w->latency_ns = w->decode_ns = 0;
+        }
+        window_start = now;
+        if (seconds > 0 && now - start >= (uint64_t)seconds * 1000000000ull)
+            break;
+    }
+    close(sock);
+    free(payload);
+    free(depth);
+    return 0;
+}